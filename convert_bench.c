@@ -0,0 +1,233 @@
+// convert_bench.c
+// Checks the kernels in fast_convert.h against sws_scale and against each
+// other, then prints the milliseconds per frame of sws_scale and of every
+// kernel this CPU can run, for yuv420p, yuvj420p and nv12 input.
+//
+// Use the Makefile to build all the samples.
+//
+// Run using
+// convert_bench [width height] [frames]
+//
+// The defaults are 3840x2160 and 100 frames. The exit status is non-zero
+// if any kernel's output differs from the plain C one, or from sws_scale
+// by more than TOLERANCE.
+
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+
+#include "fast_convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// How far sws_scale's output may be from the C kernel's in any sample;
+// its own rgb tables round a little differently
+#define TOLERANCE 3
+
+typedef struct Conversion
+{
+  enum AVPixelFormat src, dst;
+} Conversion;
+
+static const Conversion conversions[] =
+{
+  { AV_PIX_FMT_YUV420P, AV_PIX_FMT_RGB24 },
+  { AV_PIX_FMT_YUVJ420P, AV_PIX_FMT_RGB24 },
+  { AV_PIX_FMT_NV12, AV_PIX_FMT_YUV420P },
+};
+
+// Kernel sets to try, skipped when the CPU doesn't have them
+static const struct
+{
+  const char *name;
+  int flags;
+} levels[] =
+{
+  { "c", 0 },
+  { "sse2", AV_CPU_FLAG_SSE2 },
+  { "avx2", AV_CPU_FLAG_AVX2 | AV_CPU_FLAG_SSE2 },
+};
+
+// 0..255 and back down again
+int triangle(int t)
+{
+  t %= 510;
+  return t < 256 ? t : 509 - t;
+}
+
+AVFrame *alloc_frame(enum AVPixelFormat format, int width, int height)
+{
+  AVFrame *frame = av_frame_alloc();
+  if (!frame)
+    return NULL;
+  frame->format = format;
+  frame->width = width;
+  frame->height = height;
+  if (av_frame_get_buffer(frame, 32) < 0)
+    av_frame_free(&frame);
+  return frame;
+}
+
+// Noise in luma, which sws_scale takes one for one, and chroma that
+// changes by at most one step per sample, so it doesn't matter whether
+// sws_scale interpolates chroma or repeats it like the kernels do
+void fill_frame(AVFrame *frame)
+{
+  int x, y;
+
+  for (y = 0; y < frame->height; y++)
+  {
+    for (x = 0; x < frame->width; x++)
+      frame->data[0][y * frame->linesize[0] + x] = rand() & 0xff;
+  }
+  for (y = 0; y < (frame->height + 1) / 2; y++)
+  {
+    for (x = 0; x < (frame->width + 1) / 2; x++)
+    {
+      if (frame->format == AV_PIX_FMT_NV12)
+      {
+        frame->data[1][y * frame->linesize[1] + 2 * x] = triangle(x + y);
+        frame->data[1][y * frame->linesize[1] + 2 * x + 1] = triangle(x + 383 - y);
+      }
+      else
+      {
+        frame->data[1][y * frame->linesize[1] + x] = triangle(x + y);
+        frame->data[2][y * frame->linesize[2] + x] = triangle(x + 383 - y);
+      }
+    }
+  }
+}
+
+// Largest difference between the visible samples of two frames
+int max_difference(const AVFrame *a, const AVFrame *b)
+{
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(a->format);
+  int linesizes[4];
+  int plane, rows, x, y, diff, max = 0;
+
+  av_image_fill_linesizes(linesizes, a->format, a->width);
+  for (plane = 0; plane < 4 && a->data[plane]; plane++)
+  {
+    rows = plane == 1 || plane == 2 ? AV_CEIL_RSHIFT(a->height, desc->log2_chroma_h) : a->height;
+    for (y = 0; y < rows; y++)
+    {
+      for (x = 0; x < linesizes[plane]; x++)
+      {
+        diff = abs(a->data[plane][y * a->linesize[plane] + x] - b->data[plane][y * b->linesize[plane] + x]);
+        if (diff > max)
+          max = diff;
+      }
+    }
+  }
+  return max;
+}
+
+// Check and time one conversion at one size. Returns the number of
+// failed checks.
+int run_conversion(const Conversion *conv, int width, int height, int nb_frames)
+{
+  AVFrame *src = alloc_frame(conv->src, width, height);
+  AVFrame *ref = alloc_frame(conv->dst, width, height);
+  AVFrame *c_out = alloc_frame(conv->dst, width, height);
+  AVFrame *out = alloc_frame(conv->dst, width, height);
+  struct SwsContext *sws;
+  int cpu_flags = av_get_cpu_flags();
+  int64_t start;
+  double sws_ms, ms;
+  int failed = 0;
+  int i, l, diff;
+
+  sws = sws_getContext(width, height, conv->src, width, height, conv->dst,
+                       SWS_BILINEAR, NULL, NULL, NULL);
+  if (!src || !ref || !c_out || !out || !sws)
+  {
+    fprintf(stderr, "Could not set up %dx%d %s -> %s\n", width, height,
+            av_get_pix_fmt_name(conv->src), av_get_pix_fmt_name(conv->dst));
+    failed = 1;
+    goto end;
+  }
+  fill_frame(src);
+
+  start = av_gettime_relative();
+  for (i = 0; i < nb_frames; i++)
+    sws_scale(sws, (const uint8_t * const *)src->data, src->linesize, 0, height, ref->data, ref->linesize);
+  sws_ms = (av_gettime_relative() - start) / 1000.0 / nb_frames;
+  printf("%dx%d %s -> %s\n", width, height, av_get_pix_fmt_name(conv->src), av_get_pix_fmt_name(conv->dst));
+  printf("  %-10s %8.3f ms/frame\n", "sws_scale", sws_ms);
+
+  for (l = 0; l < (int)(sizeof(levels) / sizeof(levels[0])); l++)
+  {
+    if ((cpu_flags & levels[l].flags) != levels[l].flags ||
+        strcmp(fast_convert_init(levels[l].flags), levels[l].name))
+    {
+      printf("  %-10s not supported here\n", levels[l].name);
+      continue;
+    }
+    start = av_gettime_relative();
+    for (i = 0; i < nb_frames; i++)
+      fast_convert_frame(src, out, 0, height);
+    ms = (av_gettime_relative() - start) / 1000.0 / nb_frames;
+
+    if (l == 0)
+    {
+      av_frame_copy(c_out, out);
+      diff = max_difference(out, ref);
+      printf("  %-10s %8.3f ms/frame, %5.2fx, max difference from sws_scale %d%s\n",
+             levels[l].name, ms, ms > 0 ? sws_ms / ms : 0.0, diff, diff > TOLERANCE ? " FAILED" : "");
+    }
+    else
+    {
+      diff = max_difference(out, c_out);
+      printf("  %-10s %8.3f ms/frame, %5.2fx, %s\n", levels[l].name, ms, ms > 0 ? sws_ms / ms : 0.0,
+             diff ? "differs from c FAILED" : "same as c");
+    }
+    if (l == 0 ? diff > TOLERANCE : diff != 0)
+      failed++;
+  }
+
+end:
+  sws_freeContext(sws);
+  av_frame_free(&src);
+  av_frame_free(&ref);
+  av_frame_free(&c_out);
+  av_frame_free(&out);
+  return failed;
+}
+
+int main(int argc, char *argv[])
+{
+  int width = 3840, height = 2160;
+  int nb_frames = 100;
+  int failed = 0;
+  int i;
+
+  if (argc > 2)
+  {
+    width = atoi(argv[1]);
+    height = atoi(argv[2]);
+  }
+  if (argc == 2 || argc > 3)
+    nb_frames = atoi(argv[argc - 1]);
+  if (width <= 0 || height <= 0 || nb_frames <= 0)
+  {
+    fprintf(stderr, "Usage: %s [width height] [frames]\n", argv[0]);
+    return -1;
+  }
+
+  for (i = 0; i < (int)(sizeof(conversions) / sizeof(conversions[0])); i++)
+  {
+    failed += run_conversion(&conversions[i], width, height, nb_frames);
+    // An odd size as well, to go through the ends of rows the vector
+    // loops leave to the C code
+    failed += run_conversion(&conversions[i], 97, 33, 1);
+  }
+
+  fast_convert_init(av_get_cpu_flags());
+  printf("the samples will use the %s kernels\n", fast_convert.name);
+  if (failed)
+    printf("%d checks FAILED\n", failed);
+  return failed ? 1 : 0;
+}
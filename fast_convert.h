@@ -0,0 +1,315 @@
+// fast_convert.h
+// Hand-written kernels for the two conversions the samples do nearly every
+// frame: yuv420p (and yuvj420p) to rgb24 for tutorial01's PPM files and
+// nv12 to yuv420p for the IYUV textures of tutorial02 and tutorial04.
+// Every kernel comes as plain C, SSE2 and AVX2. fast_convert_init() picks
+// the widest one the CPU runs, and all three give identical output.
+//
+// Everything is static inline so each sample can include this on its own;
+// convert_bench.c checks the kernels against sws_scale and times them.
+
+#ifndef FAST_CONVERT_H
+#define FAST_CONVERT_H
+
+#include <libavutil/cpu.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FAST_CONVERT_X86 1
+#include <immintrin.h>
+#else
+#define FAST_CONVERT_X86 0
+#endif
+
+// BT.601, which is what sws_getContext() assumes when it isn't told
+// otherwise, in 6-bit fixed point. Luma is scaled by y_mul + y_half / 2
+// so the 74.5 of limited range fits. The sums can only overflow 16 bits
+// for values that clamp to 255 anyway, so the SIMD kernels use
+// saturating adds and still match the C one exactly.
+typedef struct YuvCoefficients
+{
+  int16_t y_offset, y_mul, y_half;
+  int16_t vr, ug, vg, ub;
+} YuvCoefficients;
+
+static const YuvCoefficients yuv_limited_range = { 16, 74, 1, 102, 25, 52, 129 };
+static const YuvCoefficients yuv_full_range = { 0, 64, 0, 90, 22, 46, 113 };
+
+static inline uint8_t fast_convert_clip(int value)
+{
+  return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+// Convert x0 to width of one row. u and v hold one sample per two pixels.
+static inline void yuv420p_to_rgb24_row_c(uint8_t *dst, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                                   int x0, int width, const YuvCoefficients *k)
+{
+  int x, luma, yy, cu, cv;
+
+  for (x = x0; x < width; x++)
+  {
+    luma = y[x] - k->y_offset;
+    yy = luma * k->y_mul + (luma >> 1) * k->y_half + 32;
+    cu = u[x >> 1] - 128;
+    cv = v[x >> 1] - 128;
+    dst[3 * x] = fast_convert_clip((yy + k->vr * cv) >> 6);
+    dst[3 * x + 1] = fast_convert_clip((yy - k->ug * cu - k->vg * cv) >> 6);
+    dst[3 * x + 2] = fast_convert_clip((yy + k->ub * cu) >> 6);
+  }
+}
+
+// Split the interleaved chroma of one nv12 row into separate planes
+static inline void nv12_to_yuv420p_row_c(uint8_t *u, uint8_t *v, const uint8_t *uv, int x0, int width)
+{
+  int x;
+
+  for (x = x0; x < width; x++)
+  {
+    u[x] = uv[2 * x];
+    v[x] = uv[2 * x + 1];
+  }
+}
+
+#if FAST_CONVERT_X86
+__attribute__((target("sse2")))
+static inline void yuv420p_to_rgb24_row_sse2(uint8_t *dst, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                                      int x0, int width, const YuvCoefficients *k)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i max = _mm_set1_epi16(255);
+  const __m128i bias = _mm_set1_epi16(128);
+  const __m128i round = _mm_set1_epi16(32);
+  const __m128i offset = _mm_set1_epi16(k->y_offset);
+  const __m128i mul = _mm_set1_epi16(k->y_mul);
+  const __m128i half = _mm_set1_epi16(k->y_half);
+  const __m128i vr = _mm_set1_epi16(k->vr);
+  const __m128i ug = _mm_set1_epi16(k->ug);
+  const __m128i vg = _mm_set1_epi16(k->vg);
+  const __m128i ub = _mm_set1_epi16(k->ub);
+  __m128i luma, yy, cu, cv, r, g, b, rgbx[2];
+  int32_t chroma, pixel;
+  int x, i, j;
+
+  // Eight pixels at a time. Each is stored as four bytes, the fourth of
+  // which the next pixel overwrites, so stop while one pixel is left.
+  for (x = x0; x + 9 <= width; x += 8)
+  {
+    luma = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + x)), zero);
+    memcpy(&chroma, u + x / 2, 4);
+    cu = _mm_unpacklo_epi8(_mm_cvtsi32_si128(chroma), zero);
+    cu = _mm_sub_epi16(_mm_unpacklo_epi16(cu, cu), bias);
+    memcpy(&chroma, v + x / 2, 4);
+    cv = _mm_unpacklo_epi8(_mm_cvtsi32_si128(chroma), zero);
+    cv = _mm_sub_epi16(_mm_unpacklo_epi16(cv, cv), bias);
+
+    luma = _mm_sub_epi16(luma, offset);
+    yy = _mm_add_epi16(_mm_mullo_epi16(luma, mul), _mm_mullo_epi16(_mm_srai_epi16(luma, 1), half));
+    yy = _mm_add_epi16(yy, round);
+    r = _mm_srai_epi16(_mm_adds_epi16(yy, _mm_mullo_epi16(cv, vr)), 6);
+    g = _mm_subs_epi16(_mm_subs_epi16(yy, _mm_mullo_epi16(cu, ug)), _mm_mullo_epi16(cv, vg));
+    g = _mm_srai_epi16(g, 6);
+    b = _mm_srai_epi16(_mm_adds_epi16(yy, _mm_mullo_epi16(cu, ub)), 6);
+    r = _mm_max_epi16(_mm_min_epi16(r, max), zero);
+    g = _mm_max_epi16(_mm_min_epi16(g, max), zero);
+    b = _mm_max_epi16(_mm_min_epi16(b, max), zero);
+
+    r = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+    rgbx[0] = _mm_unpacklo_epi16(r, b);
+    rgbx[1] = _mm_unpackhi_epi16(r, b);
+    for (i = 0; i < 2; i++)
+    {
+      for (j = 0; j < 4; j++)
+      {
+        pixel = _mm_cvtsi128_si32(rgbx[i]);
+        memcpy(dst + 3 * (x + 4 * i + j), &pixel, 4);
+        rgbx[i] = _mm_srli_si128(rgbx[i], 4);
+      }
+    }
+  }
+  yuv420p_to_rgb24_row_c(dst, y, u, v, x, width, k);
+}
+
+__attribute__((target("sse2")))
+static inline void nv12_to_yuv420p_row_sse2(uint8_t *u, uint8_t *v, const uint8_t *uv, int x0, int width)
+{
+  const __m128i mask = _mm_set1_epi16(0xff);
+  __m128i a, b;
+  int x;
+
+  for (x = x0; x + 16 <= width; x += 16)
+  {
+    a = _mm_loadu_si128((const __m128i *)(uv + 2 * x));
+    b = _mm_loadu_si128((const __m128i *)(uv + 2 * x + 16));
+    _mm_storeu_si128((__m128i *)(u + x), _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+    _mm_storeu_si128((__m128i *)(v + x), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+  }
+  nv12_to_yuv420p_row_c(u, v, uv, x, width);
+}
+
+__attribute__((target("avx2")))
+static inline void yuv420p_to_rgb24_row_avx2(uint8_t *dst, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                                      int x0, int width, const YuvCoefficients *k)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i max = _mm256_set1_epi16(255);
+  const __m256i bias = _mm256_set1_epi16(128);
+  const __m256i round = _mm256_set1_epi16(32);
+  const __m256i offset = _mm256_set1_epi16(k->y_offset);
+  const __m256i mul = _mm256_set1_epi16(k->y_mul);
+  const __m256i half = _mm256_set1_epi16(k->y_half);
+  const __m256i vr = _mm256_set1_epi16(k->vr);
+  const __m256i ug = _mm256_set1_epi16(k->ug);
+  const __m256i vg = _mm256_set1_epi16(k->vg);
+  const __m256i ub = _mm256_set1_epi16(k->ub);
+  // Drops the fourth byte of each pixel within a 128-bit lane
+  const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  __m256i luma, yy, cu, cv, r, g, b, lo, hi;
+  __m128i chroma;
+  int x;
+
+  // Sixteen pixels at a time, stored as four runs of twelve bytes with
+  // four bytes of junk after each that the next store overwrites, so
+  // stop while two pixels are left.
+  for (x = x0; x + 18 <= width; x += 16)
+  {
+    luma = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + x)));
+    chroma = _mm_loadl_epi64((const __m128i *)(u + x / 2));
+    cu = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(chroma, chroma)), bias);
+    chroma = _mm_loadl_epi64((const __m128i *)(v + x / 2));
+    cv = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(chroma, chroma)), bias);
+
+    luma = _mm256_sub_epi16(luma, offset);
+    yy = _mm256_add_epi16(_mm256_mullo_epi16(luma, mul),
+                          _mm256_mullo_epi16(_mm256_srai_epi16(luma, 1), half));
+    yy = _mm256_add_epi16(yy, round);
+    r = _mm256_srai_epi16(_mm256_adds_epi16(yy, _mm256_mullo_epi16(cv, vr)), 6);
+    g = _mm256_subs_epi16(_mm256_subs_epi16(yy, _mm256_mullo_epi16(cu, ug)), _mm256_mullo_epi16(cv, vg));
+    g = _mm256_srai_epi16(g, 6);
+    b = _mm256_srai_epi16(_mm256_adds_epi16(yy, _mm256_mullo_epi16(cu, ub)), 6);
+    r = _mm256_max_epi16(_mm256_min_epi16(r, max), zero);
+    g = _mm256_max_epi16(_mm256_min_epi16(g, max), zero);
+    b = _mm256_max_epi16(_mm256_min_epi16(b, max), zero);
+
+    // The unpacks work within each lane: lo holds pixels 0-3 and 8-11,
+    // hi pixels 4-7 and 12-15
+    r = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+    lo = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(r, b), pack);
+    hi = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(r, b), pack);
+    _mm_storeu_si128((__m128i *)(dst + 3 * x), _mm256_castsi256_si128(lo));
+    _mm_storeu_si128((__m128i *)(dst + 3 * x + 12), _mm256_castsi256_si128(hi));
+    _mm_storeu_si128((__m128i *)(dst + 3 * x + 24), _mm256_extracti128_si256(lo, 1));
+    _mm_storeu_si128((__m128i *)(dst + 3 * x + 36), _mm256_extracti128_si256(hi, 1));
+  }
+  yuv420p_to_rgb24_row_sse2(dst, y, u, v, x, width, k);
+}
+
+__attribute__((target("avx2")))
+static inline void nv12_to_yuv420p_row_avx2(uint8_t *u, uint8_t *v, const uint8_t *uv, int x0, int width)
+{
+  const __m256i mask = _mm256_set1_epi16(0xff);
+  __m256i a, b, planar;
+  int x;
+
+  for (x = x0; x + 32 <= width; x += 32)
+  {
+    a = _mm256_loadu_si256((const __m256i *)(uv + 2 * x));
+    b = _mm256_loadu_si256((const __m256i *)(uv + 2 * x + 32));
+    // packus interleaves the lanes of a and b, permute puts them back
+    planar = _mm256_packus_epi16(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask));
+    _mm256_storeu_si256((__m256i *)(u + x), _mm256_permute4x64_epi64(planar, 0xd8));
+    planar = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+    _mm256_storeu_si256((__m256i *)(v + x), _mm256_permute4x64_epi64(planar, 0xd8));
+  }
+  nv12_to_yuv420p_row_sse2(u, v, uv, x, width);
+}
+#endif
+
+// The kernels fast_convert_init() picked, plain C until it is called
+typedef struct FastConvert
+{
+  const char *name;
+  void (*yuv420p_to_rgb24_row)(uint8_t *dst, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                               int x0, int width, const YuvCoefficients *k);
+  void (*nv12_to_yuv420p_row)(uint8_t *u, uint8_t *v, const uint8_t *uv, int x0, int width);
+} FastConvert;
+
+static FastConvert fast_convert = { "c", yuv420p_to_rgb24_row_c, nv12_to_yuv420p_row_c };
+
+// Pick the widest kernels allowed by cpu_flags, normally
+// av_get_cpu_flags(), and return their name. Call it before any thread
+// converts.
+static inline const char *fast_convert_init(int cpu_flags)
+{
+  fast_convert.name = "c";
+  fast_convert.yuv420p_to_rgb24_row = yuv420p_to_rgb24_row_c;
+  fast_convert.nv12_to_yuv420p_row = nv12_to_yuv420p_row_c;
+#if FAST_CONVERT_X86
+  if (cpu_flags & AV_CPU_FLAG_AVX2)
+  {
+    fast_convert.name = "avx2";
+    fast_convert.yuv420p_to_rgb24_row = yuv420p_to_rgb24_row_avx2;
+    fast_convert.nv12_to_yuv420p_row = nv12_to_yuv420p_row_avx2;
+  }
+  else if (cpu_flags & AV_CPU_FLAG_SSE2)
+  {
+    fast_convert.name = "sse2";
+    fast_convert.yuv420p_to_rgb24_row = yuv420p_to_rgb24_row_sse2;
+    fast_convert.nv12_to_yuv420p_row = nv12_to_yuv420p_row_sse2;
+  }
+#endif
+  return fast_convert.name;
+}
+
+// Whether src can go into dst through one of the kernels here: same size,
+// and one of the two format pairs
+static inline int fast_convert_supported(const AVFrame *src, const AVFrame *dst)
+{
+  if (src->width != dst->width || src->height != dst->height)
+    return 0;
+  if (src->format == AV_PIX_FMT_YUV420P || src->format == AV_PIX_FMT_YUVJ420P)
+    return dst->format == AV_PIX_FMT_RGB24;
+  if (src->format == AV_PIX_FMT_NV12)
+    return dst->format == AV_PIX_FMT_YUV420P;
+  return 0;
+}
+
+// Convert rows y to y + h of src into the same rows of dst, which
+// fast_convert_supported() has accepted. y must be even unless it is the
+// last row.
+static inline void fast_convert_frame(const AVFrame *src, AVFrame *dst, int y, int h)
+{
+  int row;
+
+  if (src->format == AV_PIX_FMT_NV12)
+  {
+    av_image_copy_plane(dst->data[0] + y * dst->linesize[0], dst->linesize[0],
+                        src->data[0] + y * src->linesize[0], src->linesize[0], src->width, h);
+    // One chroma row for every two luma rows, rounding up
+    for (row = y / 2; row < (y + h + 1) / 2; row++)
+    {
+      fast_convert.nv12_to_yuv420p_row(dst->data[1] + row * dst->linesize[1],
+                                       dst->data[2] + row * dst->linesize[2],
+                                       src->data[1] + row * src->linesize[1],
+                                       0, (src->width + 1) / 2);
+    }
+    return;
+  }
+
+  // yuvj420p is the full range variant, as sws_scale treats it
+  const YuvCoefficients *k = src->format == AV_PIX_FMT_YUVJ420P ? &yuv_full_range : &yuv_limited_range;
+  for (row = y; row < y + h; row++)
+  {
+    fast_convert.yuv420p_to_rgb24_row(dst->data[0] + row * dst->linesize[0],
+                                      src->data[0] + row * src->linesize[0],
+                                      src->data[1] + (row >> 1) * src->linesize[1],
+                                      src->data[2] + (row >> 1) * src->linesize[2],
+                                      0, src->width, k);
+  }
+}
+
+#endif /* FAST_CONVERT_H */
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
@@ -10,25 +11,30 @@
 #include <stdbool.h>
 #include <assert.h>
 
+#include "trace.h"
+
 #undef main
 
 #define SAMPLE_RATE 48000
 #define CHANNELS_NUMBER 2
 
-#define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
-#define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
+// 每个packet队列最多缓冲的播放时长；字节上限只对不带duration的流起作用
+#define MAX_QUEUE_DURATION (2 * AV_TIME_BASE)
+#define MAX_QUEUE_SIZE (16 * 1024 * 1024)
 
 #define BYTES_PER_SAMPLE 2
 #define NUM_OF_SAMPLES 2048
 
 #define AUDIO_BUFFER_SIZE 65536
+#define PCM_RING_SIZE (1 << 16)
 
 #define WINDOW_ORIG_X 100
 #define WINDOW_ORIG_Y 100
 #define WINDOW_WIDTH 720
 #define WINDOW_HEIGHT 480
 
-#define PICTURE_QUEUE_SIZE 1
+#define PICTURE_QUEUE_SIZE 3 // 默认值，可用 -pictq 修改
+#define MAX_PICTURE_QUEUE_SIZE 32
 
 #define REFRESH_SCREEN_EVENT (SDL_USEREVENT + 1)
 #define QUIT_EVENT (SDL_USEREVENT + 2)
@@ -73,11 +79,30 @@ typedef struct PacketQueue
 
     int num_of_packets;
     int num_of_bytes;
+    int64_t duration;     // 队列中packet的总时长，单位AV_TIME_BASE
+    AVRational time_base; // packet时间戳和duration的时间基
 
     SDL_mutex *mutex;
     SDL_cond *cond;
+    SDL_cond *not_full; // 取走packet后队列有空间时通知
 } PacketQueue;
 
+// 解码线程与音频回调之间的PCM环形缓冲区
+// 解码线程是唯一的写者，音频回调是唯一的读者；回调从不阻塞，数据不够时记一次欠载
+typedef struct PcmRing
+{
+    uint8_t *buffer;
+    int capacity; // 字节数，必须是2的幂
+    SDL_atomic_t read_pos;
+    SDL_atomic_t write_pos;
+    SDL_atomic_t writer_waiting;
+    SDL_sem *space;
+
+    SDL_atomic_t underruns;
+    SDL_atomic_t silence_bytes;
+    SDL_atomic_t fill_low;
+} PcmRing;
+
 typedef struct VideoDevice
 {
     SDL_Window *window;
@@ -104,7 +129,8 @@ typedef struct PictureQueue
     int rd_index;
     SDL_mutex *mutex;
     SDL_cond *cond;
-    Picture pictures[PICTURE_QUEUE_SIZE];
+    int capacity; // 启动时设置的槽位数
+    Picture *pictures;
 } PictureQueue;
 
 static int finished = 0;
@@ -122,8 +148,7 @@ static AudioDevice audio_device;
 static AudioResample audio_resample;
 
 int8_t audio_buffer[AUDIO_BUFFER_SIZE];
-static unsigned int audio_buffer_index = 0;
-static unsigned int audio_data_length = 0;
+static PcmRing audio_ring;
 
 static PacketQueue audio_queue;
 static PacketQueue video_queue;
@@ -141,6 +166,11 @@ static double frame_timer = 0.0;
 
 static SDL_Thread *parse_container_thread = NULL;
 static SDL_Thread *decode_video_thread = NULL;
+static SDL_Thread *decode_audio_thread = NULL;
+
+// 视频解码线程数（0 表示由 FFmpeg 自动决定）和线程类型，可用 -threads / -thread_type 修改
+static int decoder_thread_count = 0;
+static int decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
 
 static bool init_media_container(MediaContainer *media_container, const char *filename);
 static void release_media_container(MediaContainer *media_container);
@@ -148,6 +178,7 @@ static void release_media_container(MediaContainer *media_container);
 static bool init_audio_decoder(Decoder *decoder, AVStream *stream);
 static bool init_video_decoder(Decoder *decoder, AVStream *stream);
 static void release_decoder(Decoder *decoder);
+static int parse_thread_type(const char *name);
 
 static bool init_audio_device(AudioDevice *device);
 static void release_audio_device(AudioDevice *device);
@@ -167,12 +198,23 @@ static bool init_video_rescale(VideoRescale *rescale,
                                int out_width, int out_height, int out_format);
 static void release_video_rescale(VideoRescale *rescale);
 
-static bool packet_queue_init(PacketQueue *queue);
-static bool packet_queue_put(PacketQueue *queue, const AVPacket *packet);
+static bool packet_queue_init(PacketQueue *queue, AVRational time_base);
+static bool packet_queue_full(const PacketQueue *queue);
+static bool packet_queue_put(PacketQueue *queue, AVPacket *packet);
 static int packet_queue_get(PacketQueue *queue, AVPacket *packet, bool block);
+static bool packet_queue_wait_space(PacketQueue *queue);
+static void packet_queue_abort(PacketQueue *queue);
 static void packet_queue_destroy(PacketQueue *queue);
 
-static bool picture_queue_init(PictureQueue *queue);
+static bool pcm_ring_init(PcmRing *ring, int capacity);
+static int pcm_ring_fill(PcmRing *ring);
+static int pcm_ring_write(PcmRing *ring, const uint8_t *data, int length);
+static int pcm_ring_read(PcmRing *ring, uint8_t *stream, int length);
+static void pcm_ring_abort(PcmRing *ring);
+static void pcm_ring_destroy(PcmRing *ring);
+
+static bool picture_queue_init(PictureQueue *queue, int capacity);
+static bool picture_queue_alloc_textures(PictureQueue *queue, SDL_Renderer *renderer, int width, int height);
 static bool picture_queue_put_frame(PictureQueue *queue, const AVFrame *frame, double pts);
 static void picture_queue_peek(PictureQueue *queue, Picture **picture);
 static bool picture_queue_consume(PictureQueue *queue);
@@ -194,7 +236,11 @@ static void synchronize_video(const AVFrame *frame, double pts);
 
 /* Thread functions */
 static int parse_container(void *userdata);
+static int read_frame_traced(AVFormatContext *format_ctx, AVPacket *packet);
 static int decode_video(void *userdata);
+static int decode_audio_loop(void *userdata);
+static void wait_for_quit(void);
+static void stop_threads(void);
 
 // 初始化媒体容器
 static bool init_media_container(MediaContainer *media_container, const char *filename)
@@ -326,20 +372,46 @@ static bool init_video_decoder(Decoder *decoder, AVStream *stream)
         return false;
     }
     decoder->codec = codec;
+
+    codec_ctx = avcodec_alloc_context3(codec);
+    if (!codec_ctx)
+    {
+        fprintf(stderr, "Could not allocate video codec context.\n");
+        return false;
+    }
+    decoder->codec_ctx = codec_ctx;
     if (avcodec_parameters_to_context(codec_ctx, stream->codecpar) < 0)
     {
         fprintf(stderr, "Could not copy video codec parameters to decoder context!\n");
         return false;
     }
 
+    // 帧级线程增加一帧/线程的延迟，片级线程需要码流按 slice 编码
+    codec_ctx->thread_count = decoder_thread_count;
+    codec_ctx->thread_type = decoder_thread_type;
     if (avcodec_open2(codec_ctx, codec, NULL) < 0)
     {
         fprintf(stderr, "Could not open video codec!\n");
         return false;
     }
+    printf("video decoder: %d threads, %s\n", codec_ctx->thread_count,
+           (codec_ctx->active_thread_type & FF_THREAD_FRAME) ? "frame" :
+           (codec_ctx->active_thread_type & FF_THREAD_SLICE) ? "slice" : "none");
     return true;
 }
 
+// 解析 -thread_type 参数，无法识别时返回 -1
+static int parse_thread_type(const char *name)
+{
+    if (strcmp(name, "frame") == 0)
+        return FF_THREAD_FRAME;
+    if (strcmp(name, "slice") == 0)
+        return FF_THREAD_SLICE;
+    if (strcmp(name, "both") == 0)
+        return FF_THREAD_FRAME | FF_THREAD_SLICE;
+    return -1;
+}
+
 static int decode_audio(void *userdata, uint8_t *audio_buffer, int buffer_size)
 {
     AVCodecContext *codec_ctx = audio_decoder.codec_ctx;
@@ -352,6 +424,7 @@ static int decode_audio(void *userdata, uint8_t *audio_buffer, int buffer_size)
     assert(frame != NULL);
 
     AVPacket packet;
+    int64_t span;
     int ret = packet_queue_get(&audio_queue, &packet, true);
     if (ret == -1)
     {
@@ -364,7 +437,9 @@ static int decode_audio(void *userdata, uint8_t *audio_buffer, int buffer_size)
         return 0;
     }
 
+    span = trace_begin();
     ret = avcodec_send_packet(codec_ctx, &packet);
+    trace_end("decode audio", span);
     if (ret < 0)
     {
         fprintf(stderr, "Error sending packet (%s)\n", av_err2str(ret));
@@ -376,7 +451,9 @@ static int decode_audio(void *userdata, uint8_t *audio_buffer, int buffer_size)
     while (ret >= 0)
     {
         // 接收编码帧
+        span = trace_begin();
         ret = avcodec_receive_frame(codec_ctx, frame);
+        trace_end("decode audio", span);
         // 如果返回AVERROR(EAGAIN)或者AVERROR_EOF，则表示没有可用的帧
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
             break;
@@ -405,7 +482,9 @@ static int decode_audio(void *userdata, uint8_t *audio_buffer, int buffer_size)
             break;
         }
         // 转换采样
+        span = trace_begin();
         int nsamples_convered = swr_convert(swr_ctx, samples, nsamples, (const uint8_t **)frame->data, frame->nb_samples);
+        trace_end("swr_convert", span);
         // 计算转换后的字节数
         int nbytes = av_samples_get_buffer_size(NULL, CHANNELS_NUMBER, nsamples_convered, AV_SAMPLE_FMT_S16, 1);
         // 判断是否溢出
@@ -426,41 +505,140 @@ static int decode_audio(void *userdata, uint8_t *audio_buffer, int buffer_size)
     return length;
 }
 
-static void audio_callback(void *userdata, Uint8 *stream, int length)
+static bool pcm_ring_init(PcmRing *ring, int capacity)
 {
-    int decoded_length = 0;
-    int audio_chunk_length = 0;
+    assert(ring != NULL);
+    SDL_memset(ring, 0, sizeof(*ring));
 
-    SDL_memset(stream, 0, length);
-    while (length > 0)
+    ring->buffer = av_malloc(capacity);
+    if (!ring->buffer)
     {
-        if (audio_buffer_index >= audio_data_length)
-        {
-            decoded_length = decode_audio(userdata, audio_buffer, sizeof(audio_buffer));
-            if (decoded_length < 0)
-            {
-                audio_data_length = 1024;
-                memset(audio_buffer, 0, audio_data_length);
-            }
-            else
-            {
-                audio_data_length = decoded_length;
-            }
+        fprintf(stderr, "Could not allocate memory for the PCM ring!\n");
+        return false;
+    }
+    ring->space = SDL_CreateSemaphore(0);
+    if (!ring->space)
+    {
+        fprintf(stderr, "SDL_CreateSemaphore() error: %s\n", SDL_GetError());
+        av_freep(&ring->buffer);
+        return false;
+    }
+    ring->capacity = capacity;
+    SDL_AtomicSet(&ring->fill_low, capacity);
+    return true;
+}
 
-            audio_buffer_index = 0;
-        }
+static int pcm_ring_fill(PcmRing *ring)
+{
+    return (unsigned)SDL_AtomicGet(&ring->write_pos) - (unsigned)SDL_AtomicGet(&ring->read_pos);
+}
 
-        audio_chunk_length = audio_data_length - audio_buffer_index;
-        if (audio_chunk_length > length)
-            audio_chunk_length = length;
+// 写入尽可能多的数据，缓冲区满时等待；返回写入的字节数，退出时返回-1
+static int pcm_ring_write(PcmRing *ring, const uint8_t *data, int length)
+{
+    int space = 0;
+    for (;;)
+    {
+        if (finished)
+            return -1;
+        space = ring->capacity - pcm_ring_fill(ring);
+        if (space > 0)
+            break;
+        SDL_AtomicSet(&ring->writer_waiting, 1);
+        if (ring->capacity - pcm_ring_fill(ring) == 0 && !finished)
+            SDL_SemWait(ring->space); // 由读取方或pcm_ring_abort()唤醒
+        SDL_AtomicSet(&ring->writer_waiting, 0);
+    }
+    if (length > space)
+        length = space;
+
+    unsigned int pos = SDL_AtomicGet(&ring->write_pos);
+    int offset = pos & (ring->capacity - 1);
+    int chunk = ring->capacity - offset;
+    if (chunk > length)
+        chunk = length;
+    memcpy(ring->buffer + offset, data, chunk);
+    memcpy(ring->buffer, data + chunk, length - chunk);
+    SDL_AtomicSet(&ring->write_pos, pos + length);
+    return length;
+}
 
-        const Uint8 *src = &audio_buffer[audio_buffer_index];
-        SDL_MixAudioFormat(stream, src, AUDIO_S16SYS, audio_chunk_length, SDL_MIX_MAXVOLUME);
+// 从不阻塞；数据不足时返回值小于length
+static int pcm_ring_read(PcmRing *ring, uint8_t *stream, int length)
+{
+    int fill = pcm_ring_fill(ring);
+    if (fill < SDL_AtomicGet(&ring->fill_low))
+        SDL_AtomicSet(&ring->fill_low, fill);
+    if (length > fill)
+        length = fill;
+
+    unsigned int pos = SDL_AtomicGet(&ring->read_pos);
+    int offset = pos & (ring->capacity - 1);
+    int chunk = ring->capacity - offset;
+    if (chunk > length)
+        chunk = length;
+    memcpy(stream, ring->buffer + offset, chunk);
+    memcpy(stream + chunk, ring->buffer, length - chunk);
+    SDL_AtomicSet(&ring->read_pos, pos + length);
+
+    if (SDL_AtomicCAS(&ring->writer_waiting, 1, 0))
+        SDL_SemPost(ring->space);
+    return length;
+}
 
-        length -= audio_chunk_length;
-        stream += audio_chunk_length;
-        audio_buffer_index += audio_chunk_length;
+// 设置finished之后调用，唤醒等待空间的写入者
+static void pcm_ring_abort(PcmRing *ring)
+{
+    assert(ring != NULL);
+    if (ring->space != NULL)
+        SDL_SemPost(ring->space);
+}
+
+static void pcm_ring_destroy(PcmRing *ring)
+{
+    assert(ring != NULL);
+    if (ring->space != NULL)
+        SDL_DestroySemaphore(ring->space);
+    ring->space = NULL;
+    av_freep(&ring->buffer);
+}
+
+// 音频解码线程：解码后写入PCM环形缓冲区，音频回调只负责拷贝
+static int decode_audio_loop(void *userdata)
+{
+    trace_thread_name("audio decode");
+    while (!finished)
+    {
+        int decoded_length = decode_audio(userdata, (uint8_t *)audio_buffer, sizeof(audio_buffer));
+        if (decoded_length < 0)
+            break;
+
+        int written = 0;
+        while (written < decoded_length)
+        {
+            int ret = pcm_ring_write(&audio_ring, (const uint8_t *)audio_buffer + written, decoded_length - written);
+            if (ret < 0)
+                return 0;
+            written += ret;
+        }
+    }
+    return 0;
+}
+
+static void audio_callback(void *userdata, Uint8 *stream, int length)
+{
+    // 回调线程不是我们创建的，只有第一次调用会命名
+    trace_thread_name("audio callback");
+    int64_t span = trace_begin();
+    int copied = pcm_ring_read(&audio_ring, stream, length);
+    if (copied < length)
+    {
+        // 解码线程跟不上：输出静音而不是等待
+        SDL_memset(stream + copied, 0, length - copied);
+        SDL_AtomicAdd(&audio_ring.underruns, 1);
+        SDL_AtomicAdd(&audio_ring.silence_bytes, length - copied);
     }
+    trace_end("audio_callback", span);
 }
 
 static bool init_audio_device(AudioDevice *device)
@@ -601,7 +779,7 @@ static void release_video_rescale(VideoRescale *rescale)
     rescale->sws_ctx = NULL;
 }
 
-static bool packet_queue_init(PacketQueue *queue)
+static bool packet_queue_init(PacketQueue *queue, AVRational time_base)
 {
     assert(queue != NULL);
 
@@ -609,6 +787,8 @@ static bool packet_queue_init(PacketQueue *queue)
     queue->last_packet = NULL;
     queue->num_of_packets = 0;
     queue->num_of_bytes = 0;
+    queue->duration = 0;
+    queue->time_base = time_base;
 
     queue->mutex = SDL_CreateMutex();
     if (!queue->mutex)
@@ -622,10 +802,22 @@ static bool packet_queue_init(PacketQueue *queue)
         fprintf(stderr, "SDL_CreateCond() error:%s\n", SDL_GetError());
         return false;
     }
+    queue->not_full = SDL_CreateCond();
+    if (!queue->not_full)
+    {
+        fprintf(stderr, "SDL_CreateCond() error:%s\n", SDL_GetError());
+        return false;
+    }
     return true;
 }
 
-static bool picture_queue_init(PictureQueue *queue)
+// 解复用线程是否应暂停读取，调用时须持有queue->mutex
+static bool packet_queue_full(const PacketQueue *queue)
+{
+    return queue->duration > MAX_QUEUE_DURATION || queue->num_of_bytes > MAX_QUEUE_SIZE;
+}
+
+static bool picture_queue_init(PictureQueue *queue, int capacity)
 {
     assert(queue != NULL);
 
@@ -633,10 +825,18 @@ static bool picture_queue_init(PictureQueue *queue)
     queue->wr_index = 0;
     queue->rd_index = 0;
 
+    queue->pictures = av_mallocz_array(capacity, sizeof(Picture));
+    if (!queue->pictures)
+    {
+        fprintf(stderr, "Could not allocate memory for %d pictures!\n", capacity);
+        return false;
+    }
+    queue->capacity = capacity;
+
     queue->mutex = SDL_CreateMutex();
-    if (!queue->cond)
+    if (!queue->mutex)
     {
-        fprintf(stderr, "SDL_CreateCond() error:%s\n", SDL_GetError());
+        fprintf(stderr, "SDL_CreateMutex() error:%s\n", SDL_GetError());
         return false;
     }
     queue->cond = SDL_CreateCond();
@@ -648,7 +848,7 @@ static bool picture_queue_init(PictureQueue *queue)
     }
     int i = 0;
     Picture *picture = &queue->pictures[0];
-    for (; i < PICTURE_QUEUE_SIZE; i++, picture++)
+    for (; i < queue->capacity; i++, picture++)
     {
         picture->texture = NULL;
         picture->width = 0;
@@ -670,7 +870,33 @@ static bool picture_queue_init(PictureQueue *queue)
     return true;
 }
 
-static bool packet_queue_put(PacketQueue *queue, const AVPacket *packet)
+// 预先为每个槽位分配纹理（帧池），解码过程中不再分配
+static bool picture_queue_alloc_textures(PictureQueue *queue, SDL_Renderer *renderer, int width, int height)
+{
+    assert(queue != NULL);
+    assert(renderer != NULL);
+
+    int i = 0;
+    Picture *picture = &queue->pictures[0];
+    for (; i < queue->capacity; i++, picture++)
+    {
+        if (picture->texture != NULL && picture->width == width && picture->height == height)
+            continue;
+        if (picture->texture != NULL)
+            SDL_DestroyTexture(picture->texture);
+        picture->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, width, height);
+        if (!picture->texture)
+        {
+            fprintf(stderr, "SDL_CreateTexture() error: %s\n", SDL_GetError());
+            return false;
+        }
+        picture->width = width;
+        picture->height = height;
+    }
+    return true;
+}
+
+static bool packet_queue_put(PacketQueue *queue, AVPacket *packet)
 {
     assert(queue != NULL);
 
@@ -683,13 +909,30 @@ static bool packet_queue_put(PacketQueue *queue, const AVPacket *packet)
 
     pktl->next = NULL;
 
+    // 接管调用者的引用，packet被清空，数据原样交给解码器；
+    // 只有仍归demuxer所有的数据才需要复制
+    if (packet->buf || !packet->data)
+    {
+        av_packet_move_ref(&pktl->pkt, packet);
+    }
+    else
+    {
+        if (av_packet_ref(&pktl->pkt, packet) < 0)
+        {
+            fprintf(stderr, "Could not reference packet!\n");
+            av_free(pktl);
+            return false;
+        }
+        av_packet_unref(packet);
+    }
+
     if (SDL_LockMutex(queue->mutex) != 0)
     {
         fprintf(stderr, "SDL_LockMutex() error: %s\n", SDL_GetError());
+        av_packet_unref(&pktl->pkt);
         av_free(pktl);
         return false;
     }
-    pktl->pkt = *packet;
 
     if (!queue->last_packet)
         queue->first_packet = pktl; // 队列为空时
@@ -700,6 +943,7 @@ static bool packet_queue_put(PacketQueue *queue, const AVPacket *packet)
     queue->last_packet = pktl;
     queue->num_of_packets++;
     queue->num_of_bytes += pktl->pkt.size;
+    queue->duration += av_rescale_q(pktl->pkt.duration, queue->time_base, AV_TIME_BASE_Q);
 
     if (SDL_CondSignal(queue->cond) != 0)
     {
@@ -741,6 +985,9 @@ static int packet_queue_get(PacketQueue *queue, AVPacket *pkt, bool block)
                 queue->last_packet = NULL;
             queue->num_of_packets--;
             queue->num_of_bytes -= pktl->pkt.size;
+            queue->duration -= av_rescale_q(pktl->pkt.duration, queue->time_base, AV_TIME_BASE_Q);
+            if (!packet_queue_full(queue))
+                SDL_CondSignal(queue->not_full);
             *pkt = pktl->pkt;
             av_free(pktl);
             ret = 1;
@@ -768,6 +1015,46 @@ static int packet_queue_get(PacketQueue *queue, AVPacket *pkt, bool block)
     return ret;
 }
 
+// 阻塞解复用线程直到队列有空间，由消费者通知而不是轮询
+static bool packet_queue_wait_space(PacketQueue *queue)
+{
+    assert(queue != NULL);
+
+    if (SDL_LockMutex(queue->mutex) != 0)
+    {
+        fprintf(stderr, "SDL_LockMutex() error: %s\n", SDL_GetError());
+        return false;
+    }
+    while (packet_queue_full(queue) && !finished)
+    {
+        if (SDL_CondWait(queue->not_full, queue->mutex) != 0)
+        {
+            fprintf(stderr, "SDL_CondWait() error: %s\n", SDL_GetError());
+            break;
+        }
+    }
+    if (SDL_UnlockMutex(queue->mutex) != 0)
+    {
+        fprintf(stderr, "SDL_UnlockMutex() error: %s\n", SDL_GetError());
+        return false;
+    }
+    return !finished;
+}
+
+// 设置finished之后调用，唤醒在队列上等待的生产者和消费者
+static void packet_queue_abort(PacketQueue *queue)
+{
+    assert(queue != NULL);
+    if (SDL_LockMutex(queue->mutex) != 0)
+    {
+        fprintf(stderr, "SDL_LockMutex() error: %s\n", SDL_GetError());
+        return;
+    }
+    SDL_CondBroadcast(queue->cond);
+    SDL_CondBroadcast(queue->not_full);
+    SDL_UnlockMutex(queue->mutex);
+}
+
 static uint32_t on_refresh_screen_timer(uint32_t interval, void *param)
 {
     SDL_Event event;
@@ -784,21 +1071,30 @@ static void schedule_screen_refresh(uint32_t delay_ms)
     SDL_AddTimer(delay_ms, on_refresh_screen_timer, NULL);
 }
 
+// av_read_frame()，记录为一个trace span
+static int read_frame_traced(AVFormatContext *format_ctx, AVPacket *packet)
+{
+    int64_t span = trace_begin();
+    int ret = av_read_frame(format_ctx, packet);
+    trace_end("demux", span);
+    return ret;
+}
+
 static int parse_container(void *userdata)
 {
     AVPacket packet;
     SDL_Event event;
 
+    trace_thread_name("demux");
+
     av_init_packet(&packet);
     packet.data = NULL;
     packet.size = 0;
 
-    while (!finished && av_read_frame(media_container.format_ctx, &packet) >= 0)
+    // 先等两个队列都有空间再读下一个packet
+    while (packet_queue_wait_space(&audio_queue) && packet_queue_wait_space(&video_queue) &&
+           read_frame_traced(media_container.format_ctx, &packet) >= 0)
     {
-        if (audio_queue.num_of_bytes > MAX_AUDIOQ_SIZE || video_queue.num_of_bytes > MAX_VIDEOQ_SIZE)
-        {
-            SDL_Delay(10);
-        }
         if (packet.stream_index == media_container.video_stream_idx) // 视频packet
         {
             if (!packet_queue_put(&video_queue, &packet))
@@ -810,14 +1106,15 @@ static int parse_container(void *userdata)
         }
         else if (packet.stream_index == media_container.audio_stream_idx)
         {
+            // put之后packet已被清空
+            if (packet.pts != AV_NOPTS_VALUE)
+                audio_clock = av_q2d(media_container.audio_stream->time_base) * packet.pts;
             if (!packet_queue_put(&audio_queue, &packet))
             {
                 fprintf(stderr, "Could not put audio packet!\n");
                 av_packet_unref(&packet);
                 goto parse_fail;
             }
-            if (packet.pts != AV_NOPTS_VALUE)
-                audio_clock = av_q2d(media_container.audio_stream->time_base) * packet.pts;
         }
         else
         {
@@ -840,6 +1137,8 @@ static int decode_video(void *userdata)
     AVCodecContext *codec_ctx = video_decoder.codec_ctx;
     assert(codec_ctx != NULL);
 
+    trace_thread_name("video decode");
+
     AVFrame *frame = av_frame_alloc();
 
     if (!frame)
@@ -865,7 +1164,10 @@ static int decode_video(void *userdata)
             goto decode_video_fail;
         }
 
+        int64_t span = trace_begin();
         ret = avcodec_send_packet(codec_ctx, &packet);
+        trace_end("decode video", span);
+        av_packet_unref(&packet);
         if (ret < 0)
         {
             fprintf(stderr, "Error sending packet (%s)\n", av_err2str(ret));
@@ -886,13 +1188,82 @@ decode_video_end:
     return 0;
 }
 
+// 处理事件直到收到退出事件
+static void wait_for_quit(void)
+{
+    SDL_Event event;
+    for (;;)
+    {
+        if (SDL_WaitEvent(&event) == 0)
+        {
+            fprintf(stderr, "SDL_WaitEvent() error: %s\n", SDL_GetError());
+            return;
+        }
+        switch (event.type)
+        {
+        case QUIT_EVENT:
+        case SDL_QUIT:
+            return;
+        default:
+            break;
+        }
+    }
+}
+
+// 通知所有线程退出，关闭音频设备并等待线程结束，之后才能释放它们用到的资源
+static void stop_threads(void)
+{
+    finished = 1;
+    packet_queue_abort(&audio_queue);
+    packet_queue_abort(&video_queue);
+    pcm_ring_abort(&audio_ring);
+    // 关闭设备后音频回调不会再被调用
+    if (audio_device.id != 0)
+        SDL_CloseAudioDevice(audio_device.id);
+    audio_device.id = 0;
+    if (parse_container_thread)
+        SDL_WaitThread(parse_container_thread, NULL);
+    if (decode_video_thread)
+        SDL_WaitThread(decode_video_thread, NULL);
+    if (decode_audio_thread)
+        SDL_WaitThread(decode_audio_thread, NULL);
+    parse_container_thread = NULL;
+    decode_video_thread = NULL;
+    decode_audio_thread = NULL;
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    const char *filename = NULL;
+    const char *trace_file = NULL;
+    int picture_queue_size = PICTURE_QUEUE_SIZE;
+    bool played = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-pictq") == 0 && i + 1 < argc)
+            picture_queue_size = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+            decoder_thread_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-thread_type") == 0 && i + 1 < argc)
+            decoder_thread_type = parse_thread_type(argv[++i]);
+        else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+            trace_file = argv[++i];
+        else
+            filename = argv[i];
+    }
+    if (!filename || picture_queue_size < 1 || picture_queue_size > MAX_PICTURE_QUEUE_SIZE ||
+        decoder_thread_count < 0 || decoder_thread_type < 0)
     {
-        printf("Usage: %s file\n", argv[0]);
+        printf("Usage: %s [-pictq 1..%d] [-threads N] [-thread_type frame|slice|both] [-trace file.json] file\n",
+               argv[0], MAX_PICTURE_QUEUE_SIZE);
         return -1;
     }
+    if (trace_file && trace_start(trace_file) < 0)
+    {
+        fprintf(stderr, "Could not start tracing\n");
+        return -1;
+    }
+    trace_thread_name("main");
     // 初始化SDL
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER))
     {
@@ -900,7 +1271,7 @@ int main(int argc, char *argv[])
         goto end;
     }
     // 初始化媒体容器
-    if (!init_media_container(&media_container, argv[1]))
+    if (!init_media_container(&media_container, filename))
     {
         fprintf(stderr, "Could not initialize media container\n");
         goto end;
@@ -958,22 +1329,32 @@ int main(int argc, char *argv[])
         fprintf(stderr, "init_video_rescale() failed!\n");
         goto end;
     }
-    if (!packet_queue_init(&audio_queue))
+    if (!packet_queue_init(&audio_queue, media_container.audio_stream->time_base))
     {
         fprintf(stderr, "Couldn't initialize audio queue!\n");
         goto end;
     }
 
-    if (!packet_queue_init(&video_queue))
+    if (!packet_queue_init(&video_queue, media_container.video_stream->time_base))
     {
         fprintf(stderr, "Couldn't initialize video queue!\n");
         goto end;
     }
-    if (!picture_queue_init(&picture_queue))
+    if (!picture_queue_init(&picture_queue, picture_queue_size))
     {
         fprintf(stderr, "Couldn't initialize pictures queue!\n");
         goto end;
     }
+    if (!picture_queue_alloc_textures(&picture_queue, video_device.renderer, WINDOW_WIDTH, WINDOW_HEIGHT))
+    {
+        fprintf(stderr, "Couldn't allocate picture textures!\n");
+        goto end;
+    }
+    if (!pcm_ring_init(&audio_ring, PCM_RING_SIZE))
+    {
+        fprintf(stderr, "Couldn't initialize audio ring!\n");
+        goto end;
+    }
 
     frame_last_delay = 40e-3;
     frame_timer = (double)av_gettime() / 1000000.0;
@@ -984,19 +1365,40 @@ int main(int argc, char *argv[])
     if (!parse_container_thread)
     {
         fprintf(stderr, "SDL_CreateThread() error: %s\n", SDL_GetError());
-        goto end;
+        goto stop;
     }
 
     decode_video_thread = SDL_CreateThread(decode_video, "decode video", NULL);
     if (!decode_video_thread)
     {
         fprintf(stderr, "SDL_CreateThread() error: %s\n", SDL_GetError());
-        goto end;
+        goto stop;
     }
+
+    decode_audio_thread = SDL_CreateThread(decode_audio_loop, "decode audio", NULL);
+    if (!decode_audio_thread)
+    {
+        fprintf(stderr, "SDL_CreateThread() error: %s\n", SDL_GetError());
+        goto stop;
+    }
+
+    wait_for_quit();
+    played = true;
+
+stop:
+    // 线程结束后才能释放PCM环形缓冲区
+    stop_threads();
+    if (played)
+        printf("audio underruns: %d, silence bytes: %d, ring fill: %d/%d (lowest %d)\n",
+               SDL_AtomicGet(&audio_ring.underruns), SDL_AtomicGet(&audio_ring.silence_bytes),
+               pcm_ring_fill(&audio_ring), audio_ring.capacity, SDL_AtomicGet(&audio_ring.fill_low));
+    pcm_ring_destroy(&audio_ring);
 end:
+    if (trace_save() < 0)
+        fprintf(stderr, "Could not write %s\n", trace_file);
     // 退出SDL
     SDL_Quit();
     // 释放媒体容器
     release_media_container(&media_container);
-    return -1;
-}
\ No newline at end of file
+    return played ? 0 : -1;
+}
@@ -0,0 +1,122 @@
+// frame_pool.h
+// A get_buffer2 for video decoders that hands out frame buffers from an
+// AVBufferPool. Each buffer holds every plane of one frame, padded to the
+// codec's avcodec_align_dimensions2 size and linesize alignment. The pool
+// is only rebuilt when the frame size or format changes, so in steady
+// state decoding a frame makes no frame-sized allocation; the small
+// AVBufferRef av_buffer_pool_get() wraps each buffer in is still
+// allocated per frame.
+//
+// Usage:
+//   frame_pool_init(&pool);
+//   frame_pool_attach(&pool, codecCtx); // before avcodec_open2()
+//
+// Everything is static so each player can include this on its own.
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/imgutils.h>
+
+#include <SDL.h>
+#include <SDL_thread.h>
+
+#include <string.h>
+
+// Frames before the decoder buffers count as steady
+#define FRAME_POOL_WARMUP 100
+
+typedef struct FrameBufferPool
+{
+  AVBufferPool *pool;
+  SDL_mutex *mutex; // frame threads call get_buffer2 concurrently
+  int width, height, format; // as the decoder asked for them
+  int aligned_width, aligned_height, align;
+  // counters
+  int frames; // buffers handed to the decoder
+  int allocs; // frame-sized buffers the pool had to allocate
+  int steady_allocs; // allocs after the first FRAME_POOL_WARMUP frames
+} FrameBufferPool;
+
+static int frame_pool_init(FrameBufferPool *fp)
+{
+  memset(fp, 0, sizeof(FrameBufferPool));
+  fp->mutex = SDL_CreateMutex();
+  return fp->mutex ? 0 : -1;
+}
+
+static AVBufferRef *frame_pool_alloc(void *opaque, int size)
+{
+  FrameBufferPool *fp = (FrameBufferPool *)opaque;
+
+  fp->allocs++;
+  if (fp->frames > FRAME_POOL_WARMUP)
+    fp->steady_allocs++;
+  return av_buffer_alloc(size);
+}
+
+// get_buffer2 for the video decoder. Nothing rides along with the
+// buffer: the frame carries its own best_effort_timestamp.
+static int frame_pool_get_buffer(struct AVCodecContext *c, AVFrame *pic, int flags)
+{
+  FrameBufferPool *fp = (FrameBufferPool *)c->opaque;
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  int w, h, i, size;
+
+  if (!(c->codec->capabilities & AV_CODEC_CAP_DR1))
+    return avcodec_default_get_buffer2(c, pic, flags);
+
+  SDL_LockMutex(fp->mutex);
+  if (!fp->pool || fp->width != pic->width || fp->height != pic->height ||
+      fp->format != pic->format)
+  {
+    // room for the codec's edges and SIMD row overreads
+    w = pic->width;
+    h = pic->height;
+    avcodec_align_dimensions2(c, &w, &h, linesize_align);
+    fp->align = 1;
+    for (i = 0; i < AV_NUM_DATA_POINTERS; i++)
+    {
+      if (linesize_align[i] > fp->align)
+        fp->align = linesize_align[i];
+    }
+    size = av_image_get_buffer_size(pic->format, w, h, fp->align);
+    if (size < 0)
+    {
+      SDL_UnlockMutex(fp->mutex);
+      return size;
+    }
+    // buffers still out return to the old pool, which then goes away
+    av_buffer_pool_uninit(&fp->pool);
+    fp->pool = av_buffer_pool_init2(size + 16 + fp->align - 1, fp,
+                                    frame_pool_alloc, NULL);
+    fp->width = pic->width;
+    fp->height = pic->height;
+    fp->format = pic->format;
+    fp->aligned_width = w;
+    fp->aligned_height = h;
+  }
+  pic->buf[0] = fp->pool ? av_buffer_pool_get(fp->pool) : NULL;
+  fp->frames++;
+  SDL_UnlockMutex(fp->mutex);
+  if (!pic->buf[0])
+    return AVERROR(ENOMEM);
+
+  size = av_image_fill_arrays(pic->data, pic->linesize, pic->buf[0]->data,
+                              pic->format, fp->aligned_width, fp->aligned_height,
+                              fp->align);
+  pic->extended_data = pic->data;
+  return size < 0 ? size : 0;
+}
+
+// Serve the decoder's frames from fp. Takes over the codec's opaque.
+static void frame_pool_attach(FrameBufferPool *fp, AVCodecContext *c)
+{
+  c->opaque = fp;
+  c->get_buffer2 = frame_pool_get_buffer;
+  c->thread_safe_callbacks = 1;
+}
+
+#endif
@@ -0,0 +1,446 @@
+// packet_queue_bench.c
+// A microbenchmark that pushes packets from one thread to another through
+// the linked-list PacketQueue used by tutorial03-06 and through the
+// single-producer/single-consumer ring used by tutorial07, and prints the
+// packets/sec each one sustains, the list also with the batched put and
+// get of tutorial04-06. It then puts packets into the ring the
+// way the queues used to (av_dup_packet and a struct copy) and the way
+// they do now (av_packet_move_ref), with refcounted payloads and with
+// payloads the demuxer still owns, and prints how many payload bytes
+// each handoff had to copy.
+//
+// Use the Makefile to build all the samples.
+//
+// Run using
+// packet_queue_bench [packets] [payload bytes]
+//
+// The defaults are 2000000 packets of 4096 bytes. Every packet shares one
+// payload, so the numbers only measure the handoff itself.
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/time.h>
+
+#include <SDL.h>
+#include <SDL_thread.h>
+
+#ifdef __MINGW32__
+#undef main /* Prevents SDL from overriding main() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RING_CAPACITY 1024
+#define BATCH_SIZE 16 /* PACKET_BATCH_SIZE in tutorial04-06 */
+
+int quit = 0;
+/* put packets the old way, with av_dup_packet and a struct copy */
+int use_dup = 0;
+
+/* How the queues take a packet over from the caller. */
+int take_packet(AVPacket *dst, AVPacket *pkt)
+{
+  if (use_dup)
+  {
+    if (av_dup_packet(pkt) < 0)
+    {
+      return -1;
+    }
+    *dst = *pkt;
+    return 0;
+  }
+  if (pkt->buf || !pkt->data)
+  {
+    av_packet_move_ref(dst, pkt);
+    return 0;
+  }
+  if (av_packet_ref(dst, pkt) < 0)
+  {
+    return -1;
+  }
+  av_packet_unref(pkt);
+  return 0;
+}
+
+/* The queue from tutorial03-06, unchanged apart from the names; the
+   batches go in and out under one lock as in tutorial04-06. */
+typedef struct ListQueue
+{
+  AVPacketList *first_pkt, *last_pkt;
+  int nb_packets;
+  int size;
+  SDL_mutex *mutex;
+  SDL_cond *cond;
+} ListQueue;
+
+void list_queue_init(ListQueue *q)
+{
+  memset(q, 0, sizeof(ListQueue));
+  q->mutex = SDL_CreateMutex();
+  q->cond = SDL_CreateCond();
+}
+int list_queue_put_batch(ListQueue *q, AVPacket *pkts, int n)
+{
+  AVPacketList *first = NULL, *last = NULL, *pkt1;
+  int i, size = 0;
+
+  for (i = 0; i < n; i++)
+  {
+    pkt1 = av_malloc(sizeof(AVPacketList));
+    if (!pkt1)
+      return -1;
+    if (take_packet(&pkt1->pkt, &pkts[i]) < 0)
+    {
+      av_free(pkt1);
+      return -1;
+    }
+    pkt1->next = NULL;
+    if (!last)
+      first = pkt1;
+    else
+      last->next = pkt1;
+    last = pkt1;
+    size += pkt1->pkt.size;
+  }
+
+  SDL_LockMutex(q->mutex);
+
+  if (!q->last_pkt)
+    q->first_pkt = first;
+  else
+    q->last_pkt->next = first;
+  q->last_pkt = last;
+  q->nb_packets += n;
+  q->size += size;
+  SDL_CondSignal(q->cond);
+
+  SDL_UnlockMutex(q->mutex);
+  return 0;
+}
+int list_queue_get_batch(ListQueue *q, AVPacket *pkts, int max, int block)
+{
+  AVPacketList *pkt1;
+  int ret;
+
+  SDL_LockMutex(q->mutex);
+
+  for (;;)
+  {
+    if (quit)
+    {
+      ret = -1;
+      break;
+    }
+
+    if (q->first_pkt)
+    {
+      for (ret = 0; ret < max && q->first_pkt; ret++)
+      {
+        pkt1 = q->first_pkt;
+        q->first_pkt = pkt1->next;
+        q->nb_packets--;
+        q->size -= pkt1->pkt.size;
+        pkts[ret] = pkt1->pkt;
+        av_free(pkt1);
+      }
+      if (!q->first_pkt)
+        q->last_pkt = NULL;
+      break;
+    }
+    else if (!block)
+    {
+      ret = 0;
+      break;
+    }
+    else
+    {
+      SDL_CondWait(q->cond, q->mutex);
+    }
+  }
+  SDL_UnlockMutex(q->mutex);
+  return ret;
+}
+void list_queue_destroy(ListQueue *q)
+{
+  SDL_DestroyCond(q->cond);
+  SDL_DestroyMutex(q->mutex);
+}
+
+/* The ring from tutorial07, without the playback serials. */
+typedef struct RingQueue
+{
+  AVPacket *pkts;
+  int capacity;
+  SDL_atomic_t head;
+  SDL_atomic_t tail;
+  SDL_atomic_t size;
+  SDL_atomic_t producer_waiting;
+  SDL_atomic_t consumer_waiting;
+  SDL_mutex *mutex;
+  SDL_cond *not_empty;
+  SDL_cond *not_full;
+} RingQueue;
+
+void ring_queue_init(RingQueue *q, int capacity)
+{
+  memset(q, 0, sizeof(RingQueue));
+  q->capacity = capacity;
+  q->pkts = av_mallocz(capacity * sizeof(AVPacket));
+  q->mutex = SDL_CreateMutex();
+  q->not_empty = SDL_CreateCond();
+  q->not_full = SDL_CreateCond();
+}
+int ring_queue_nb_packets(RingQueue *q)
+{
+  return (unsigned)SDL_AtomicGet(&q->tail) - (unsigned)SDL_AtomicGet(&q->head);
+}
+int ring_queue_put(RingQueue *q, AVPacket *pkt)
+{
+  unsigned int tail;
+
+  if (ring_queue_nb_packets(q) >= q->capacity)
+  {
+    SDL_LockMutex(q->mutex);
+    SDL_AtomicSet(&q->producer_waiting, 1);
+    while (ring_queue_nb_packets(q) >= q->capacity && !quit)
+    {
+      SDL_CondWait(q->not_full, q->mutex);
+    }
+    SDL_AtomicSet(&q->producer_waiting, 0);
+    SDL_UnlockMutex(q->mutex);
+    if (quit)
+    {
+      return -1;
+    }
+  }
+
+  tail = SDL_AtomicGet(&q->tail);
+  if (take_packet(&q->pkts[tail & (q->capacity - 1)], pkt) < 0)
+  {
+    return -1;
+  }
+  SDL_AtomicAdd(&q->size, q->pkts[tail & (q->capacity - 1)].size);
+  SDL_AtomicSet(&q->tail, tail + 1);
+
+  if (SDL_AtomicGet(&q->consumer_waiting))
+  {
+    SDL_LockMutex(q->mutex);
+    SDL_CondSignal(q->not_empty);
+    SDL_UnlockMutex(q->mutex);
+  }
+  return 0;
+}
+int ring_queue_get(RingQueue *q, AVPacket *pkt, int block)
+{
+  unsigned int head;
+
+  if (ring_queue_nb_packets(q) == 0)
+  {
+    if (!block)
+    {
+      return 0;
+    }
+    SDL_LockMutex(q->mutex);
+    SDL_AtomicSet(&q->consumer_waiting, 1);
+    while (ring_queue_nb_packets(q) == 0 && !quit)
+    {
+      SDL_CondWait(q->not_empty, q->mutex);
+    }
+    SDL_AtomicSet(&q->consumer_waiting, 0);
+    SDL_UnlockMutex(q->mutex);
+    if (quit)
+    {
+      return -1;
+    }
+  }
+
+  head = SDL_AtomicGet(&q->head);
+  *pkt = q->pkts[head & (q->capacity - 1)];
+  SDL_AtomicAdd(&q->size, -pkt->size);
+  SDL_AtomicSet(&q->head, head + 1);
+
+  if (SDL_AtomicGet(&q->producer_waiting))
+  {
+    SDL_LockMutex(q->mutex);
+    SDL_CondSignal(q->not_full);
+    SDL_UnlockMutex(q->mutex);
+  }
+  return 1;
+}
+void ring_queue_destroy(RingQueue *q)
+{
+  SDL_DestroyCond(q->not_full);
+  SDL_DestroyCond(q->not_empty);
+  SDL_DestroyMutex(q->mutex);
+  av_freep(&q->pkts);
+}
+
+typedef struct BenchArgs
+{
+  ListQueue *list;
+  RingQueue *ring;
+  AVPacket *template_pkt;
+  int borrowed; /* hand out the template's payload without a reference */
+  int batch; /* packets per list put and get */
+  int nb_packets;
+  int64_t copied_bytes; /* payload that reached the consumer in a new buffer */
+} BenchArgs;
+
+int producer_thread(void *arg)
+{
+  BenchArgs *args = (BenchArgs *)arg;
+  AVPacket pkts[BATCH_SIZE], pkt;
+  int i, n = 0;
+
+  for (i = 0; i < args->nb_packets; i++)
+  {
+    av_init_packet(&pkt);
+    if (args->borrowed)
+    {
+      /* like a demuxer handing out a buffer it will reuse */
+      pkt.data = args->template_pkt->data;
+      pkt.size = args->template_pkt->size;
+    }
+    else if (av_packet_ref(&pkt, args->template_pkt) < 0)
+    {
+      fprintf(stderr, "Could not reference packet\n");
+      return -1;
+    }
+    pkt.pts = i;
+    if (args->list)
+    {
+      pkts[n++] = pkt;
+      if (n == args->batch || i == args->nb_packets - 1)
+      {
+        list_queue_put_batch(args->list, pkts, n);
+        n = 0;
+      }
+    }
+    else
+    {
+      ring_queue_put(args->ring, &pkt);
+    }
+  }
+  return 0;
+}
+
+double run_bench(BenchArgs *args)
+{
+  SDL_Thread *producer;
+  AVPacket pkts[BATCH_SIZE], *pkt;
+  int64_t start, elapsed;
+  int received = 0;
+  int ret, i;
+
+  args->copied_bytes = 0;
+  start = av_gettime();
+  producer = SDL_CreateThread(producer_thread, "Producer", args);
+  if (!producer)
+  {
+    fprintf(stderr, "SDL_CreateThread: %s\n", SDL_GetError());
+    return 0;
+  }
+  while (received < args->nb_packets)
+  {
+    if (args->list)
+      ret = list_queue_get_batch(args->list, pkts, args->batch, 1);
+    else
+      ret = ring_queue_get(args->ring, pkts, 1);
+    if (ret <= 0)
+      break;
+    for (i = 0; i < ret; i++)
+    {
+      pkt = &pkts[i];
+      if (pkt->pts != received)
+      {
+        fprintf(stderr, "Packet %d arrived out of order\n", received);
+      }
+      if (pkt->data != args->template_pkt->data)
+        args->copied_bytes += pkt->size;
+      av_packet_unref(pkt);
+      received++;
+    }
+  }
+  SDL_WaitThread(producer, NULL);
+  elapsed = av_gettime() - start;
+
+  return elapsed > 0 ? received * 1000000.0 / elapsed : 0;
+}
+
+int main(int argc, char *argv[])
+{
+  ListQueue list;
+  RingQueue ring;
+  BenchArgs args;
+  AVPacket template_pkt;
+  int nb_packets = 2000000;
+  int payload_size = 4096;
+  double list_rate, batch_rate, ring_rate, rate;
+  int borrowed;
+
+  if (argc > 1)
+    nb_packets = atoi(argv[1]);
+  if (argc > 2)
+    payload_size = atoi(argv[2]);
+  if (nb_packets <= 0 || payload_size <= 0)
+  {
+    fprintf(stderr, "Usage: %s [packets] [payload bytes]\n", argv[0]);
+    return -1;
+  }
+
+  if (SDL_Init(0))
+  {
+    fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
+    return -1;
+  }
+
+  if (av_new_packet(&template_pkt, payload_size) < 0)
+  {
+    fprintf(stderr, "Could not allocate packet payload\n");
+    return -1;
+  }
+  memset(template_pkt.data, 0, payload_size);
+
+  list_queue_init(&list);
+  ring_queue_init(&ring, RING_CAPACITY);
+
+  memset(&args, 0, sizeof(args));
+  args.template_pkt = &template_pkt;
+  args.nb_packets = nb_packets;
+
+  args.list = &list;
+  args.batch = 1;
+  list_rate = run_bench(&args);
+  args.batch = BATCH_SIZE;
+  batch_rate = run_bench(&args);
+
+  args.list = NULL;
+  args.ring = &ring;
+  ring_rate = run_bench(&args);
+
+  printf("%d packets of %d bytes\n", nb_packets, payload_size);
+  printf("PacketQueue (list): %12.0f packets/sec\n", list_rate);
+  printf("PacketQueue (list): %12.0f packets/sec (batches of %d)\n", batch_rate, BATCH_SIZE);
+  printf("PacketQueue (ring): %12.0f packets/sec (%d slots)\n", ring_rate, RING_CAPACITY);
+  if (list_rate > 0)
+    printf("speedup: %.2fx batched, %.2fx ring\n", batch_rate / list_rate, ring_rate / list_rate);
+
+  for (borrowed = 0; borrowed <= 1; borrowed++)
+  {
+    args.borrowed = borrowed;
+    for (use_dup = 1; use_dup >= 0; use_dup--)
+    {
+      rate = run_bench(&args);
+      printf("%-18s %-10s payload: %12.0f packets/sec, %8.1f bytes copied per packet\n",
+             use_dup ? "av_dup_packet" : "av_packet_move_ref",
+             borrowed ? "borrowed" : "refcounted", rate,
+             (double)args.copied_bytes / nb_packets);
+    }
+  }
+
+  list_queue_destroy(&list);
+  ring_queue_destroy(&ring);
+  av_packet_unref(&template_pkt);
+  SDL_Quit();
+  return 0;
+}
@@ -0,0 +1,171 @@
+// trace.h
+// Spans around the stages of a player (demuxing, decoding, sws_scale,
+// swr_convert, display, the audio callback), saved as a Chrome trace_event
+// JSON file that chrome://tracing or ui.perfetto.dev can open.
+//
+// Every thread records into a buffer of its own, so a span takes no lock;
+// the only lock is taken once per thread, when its buffer is created.
+// Tracing is off until trace_start() is called, and while it is off a
+// span costs one test of a global.
+//
+// Usage:
+//   int64_t t = trace_begin();
+//   ...
+//   trace_end("decode video", t);
+//
+// Everything is static so each player can include this on its own.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include <SDL.h>
+#include <SDL_thread.h>
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Spans each thread can hold; later ones are counted and dropped
+#define TRACE_BUFFER_EVENTS (1 << 16)
+
+typedef struct TraceEvent
+{
+  const char *name; // a string literal
+  int64_t start, duration; // us
+} TraceEvent;
+
+// Only the owning thread writes events and count. count is published
+// after the event it covers, so trace_save() can read up to it while
+// the thread goes on.
+typedef struct TraceBuffer
+{
+  struct TraceBuffer *next;
+  int tid;
+  const char *thread_name;
+  SDL_atomic_t count;
+  int dropped;
+  TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+static int trace_enabled = 0;
+static const char *trace_path;
+static int64_t trace_origin; // ts 0 in the file
+static SDL_mutex *trace_mutex; // guards trace_buffers and trace_nb_threads
+static TraceBuffer *trace_buffers;
+static int trace_nb_threads;
+static __thread TraceBuffer *trace_buffer;
+static __thread const char *trace_thread;
+
+// Turn tracing on; trace_save() writes everything recorded to path.
+static int trace_start(const char *path)
+{
+  trace_mutex = SDL_CreateMutex();
+  if (!trace_mutex)
+    return -1;
+  trace_path = path;
+  trace_origin = av_gettime_relative();
+  trace_enabled = 1;
+  return 0;
+}
+
+// Name the calling thread in the trace. A callback on a thread the
+// player didn't create can call this every time it runs there; only
+// the first call does anything.
+static void trace_thread_name(const char *name)
+{
+  if (!trace_enabled || trace_thread == name)
+    return;
+  trace_thread = name;
+  if (trace_buffer)
+    trace_buffer->thread_name = name;
+}
+
+static TraceBuffer *trace_get_buffer(void)
+{
+  TraceBuffer *b = trace_buffer;
+
+  if (b)
+    return b;
+  b = av_mallocz(sizeof(TraceBuffer));
+  if (!b)
+    return NULL;
+  b->thread_name = trace_thread ? trace_thread : "thread";
+  SDL_LockMutex(trace_mutex);
+  b->tid = ++trace_nb_threads;
+  b->next = trace_buffers;
+  trace_buffers = b;
+  SDL_UnlockMutex(trace_mutex);
+  trace_buffer = b;
+  return b;
+}
+
+// Start a span. Returns 0 when tracing is off.
+static inline int64_t trace_begin(void)
+{
+  return trace_enabled ? av_gettime_relative() : 0;
+}
+
+// End the span trace_begin() returned start for, if there is one.
+static inline void trace_end(const char *name, int64_t start)
+{
+  TraceBuffer *b;
+  int64_t end;
+  int n;
+
+  if (!start)
+    return;
+  end = av_gettime_relative();
+  b = trace_get_buffer();
+  if (!b)
+    return;
+  n = SDL_AtomicGet(&b->count);
+  if (n == TRACE_BUFFER_EVENTS)
+  {
+    b->dropped++;
+    return;
+  }
+  b->events[n].name = name;
+  b->events[n].start = start;
+  b->events[n].duration = end - start;
+  SDL_AtomicSet(&b->count, n + 1);
+}
+
+// Write the spans recorded so far to the file given to trace_start().
+// The other threads may still be running. Returns -1 if the file can't
+// be written, 0 otherwise, also when tracing is off.
+static int trace_save(void)
+{
+  TraceBuffer *b;
+  FILE *f;
+  int i, n, first = 1;
+
+  if (!trace_enabled)
+    return 0;
+  f = fopen(trace_path, "w");
+  if (!f)
+    return -1;
+  fprintf(f, "{\"traceEvents\": [\n");
+  SDL_LockMutex(trace_mutex);
+  for (b = trace_buffers; b; b = b->next)
+  {
+    fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+            first ? "" : ",\n", b->tid, b->thread_name);
+    first = 0;
+    n = SDL_AtomicGet(&b->count);
+    for (i = 0; i < n; i++)
+    {
+      fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %" PRId64 ", \"dur\": %" PRId64 "}",
+              b->events[i].name, b->tid, b->events[i].start - trace_origin, b->events[i].duration);
+    }
+    if (b->dropped)
+      fprintf(stderr, "trace: thread %s dropped %d spans\n", b->thread_name, b->dropped);
+  }
+  SDL_UnlockMutex(trace_mutex);
+  fprintf(f, "\n]}\n");
+  return fclose(f) ? -1 : 0;
+}
+
+#endif
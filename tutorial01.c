@@ -12,234 +12,1577 @@
 //
 // Run using
 //
-// tutorial01 myvideofile.mpg
+// tutorial01 myvideofile.mpg [frames]
 //
-// to write the first five frames from "myvideofile.mpg" to disk in PPM
-// format.
+// to write the first five frames (or the given number, 0 for all of them)
+// from "myvideofile.mpg" to disk in PPM format.
+//
+// tutorial01 -thumbs N myvideofile.mpg
+//
+// seeks to N evenly spaced points and saves the keyframe at each one, and
+//
+// tutorial01 -keyframes K myvideofile.mpg [frames]
+//
+// saves every Kth keyframe (all of them unless a count is given). Both only
+// decode keyframes and report how long each thumbnail took.
+//
+// tutorial01 -batch [-j workers] [-frames N] input...
+//
+// runs the same extraction over many files in one process. Each input is a
+// movie, a directory of movies, or @list, a file with one path per line.
+// Frames are saved as file<n>-frame<m>.ppm.
+//
+// tutorial01 -gop [-j workers] myvideofile.mpg [frames]
+//
+// splits one file into runs of whole GOPs and decodes each run on its own
+// core, numbering the frames in pts order as if they had been decoded in
+// one pass. It assumes closed GOPs without intra refresh.
+//
+// Every mode takes -threads N (0 for one per core) and
+// -thread_type frame|slice|both to set up the decoder's own threads.
+//
+// tutorial01 -benchthreads [-threads N] myvideofile.mpg [frames]
+//
+// decodes the file once single-threaded and once in each threading mode
+// and prints the frames per second of each run.
+//
+// Every mode also takes -scale_threads N to split the RGB conversion into
+// N horizontal bands converted in parallel (one per core by default, one
+// per worker in -batch and -gop), and
+//
+// tutorial01 -benchscale myvideofile.mpg [conversions]
+//
+// converts the first frame over and over with 1, 2, 4... threads and
+// prints the milliseconds per frame of each.
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libavutil/cpu.h>
+#include <libavutil/avstring.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "fast_convert.h"
 
-void saveFrame(AVFrame *pFrame, int width, int height, int iFrame)
+#define WRITER_THREADS 4
+#define WRITER_QUEUE_SIZE 8
+#define MAX_SCALE_THREADS 16
+#ifndef IOV_MAX
+#define IOV_MAX 1024 /* the usual limit where <limits.h> doesn't say */
+#endif
+
+// Output buffers for converted frames, reused from one frame to the next
+// and only reallocated when the size or pixel format changes.
+typedef struct FramePool
+{
+  AVBufferPool *pool;
+  int width, height;
+  enum AVPixelFormat pix_fmt;
+} FramePool;
+
+// Point frame at a pooled buffer for a width x height image in pix_fmt.
+// av_frame_unref() on the frame gives the buffer back to the pool.
+int framePoolGet(FramePool *fp, AVFrame *frame, int width, int height, enum AVPixelFormat pix_fmt)
+{
+  if (!fp->pool || fp->width != width || fp->height != height || fp->pix_fmt != pix_fmt)
+  {
+    int size = av_image_get_buffer_size(pix_fmt, width, height, 32);
+    if (size < 0)
+      return size;
+    // Buffers still held by frames are freed when they are released
+    av_buffer_pool_uninit(&fp->pool);
+    fp->pool = av_buffer_pool_init(size, NULL);
+    if (!fp->pool)
+      return AVERROR(ENOMEM);
+    fp->width = width;
+    fp->height = height;
+    fp->pix_fmt = pix_fmt;
+  }
+
+  av_frame_unref(frame);
+  frame->buf[0] = av_buffer_pool_get(fp->pool);
+  if (!frame->buf[0])
+    return AVERROR(ENOMEM);
+  frame->width = width;
+  frame->height = height;
+  frame->format = pix_fmt;
+  return av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, pix_fmt, width, height, 32);
+}
+
+void framePoolUninit(FramePool *fp)
 {
-  FILE *pFile;
-  char szFilename[32];
+  av_buffer_pool_uninit(&fp->pool);
+}
+
+// Peak resident set size of the process so far, in kilobytes
+long peakRSS(void)
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return -1;
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024; // bytes on macOS
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+// writev() everything in iov, going around again on short writes
+int writeAll(int fd, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0)
+  {
+    int n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+    ssize_t written = writev(fd, iov, n);
+    if (written < 0)
+      return -1;
+    while (n > 0 && written >= (ssize_t)iov->iov_len)
+    {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+      n--;
+    }
+    if (n > 0)
+    {
+      iov->iov_base = (uint8_t *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+void saveFrame(AVFrame *pFrame, int width, int height, int iFile, int iFrame)
+{
+  char szFilename[64];
+  char szHeader[32];
+  struct iovec *iov;
+  int fd;
   int  y;
   
   // Open file
-  sprintf(szFilename, "frame%d.ppm", iFrame);
-  pFile = fopen(szFilename, "wb");
-  if(pFile == NULL)
+  if (iFile < 0)
+    sprintf(szFilename, "frame%d.ppm", iFrame);
+  else
+    sprintf(szFilename, "file%d-frame%d.ppm", iFile, iFrame);
+  fd = open(szFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
   {
     fprintf(stderr, "Cannot open file");
     return;
   }
   
-  // Write header
-  fprintf(pFile, "P6\n%d %d\n%d\n", width, height, 255);
+  iov = av_malloc_array(height + 1, sizeof(struct iovec));
+  if(iov == NULL)
+  {
+    close(fd);
+    return;
+  }
+
+  // Header
+  iov[0].iov_base = szHeader;
+  iov[0].iov_len = sprintf(szHeader, "P6\n%d %d\n%d\n", width, height, 255);
   
-  // Write pixel data
+  // Pixel data, one entry per row, all written in a single writev
   for(y = 0; y < height; y++)
-    fwrite(pFrame->data[0] + y * pFrame->linesize[0], 1, width * 3, pFile);
+  {
+    iov[y + 1].iov_base = pFrame->data[0] + y * pFrame->linesize[0];
+    iov[y + 1].iov_len = width * 3;
+  }
+  if(writeAll(fd, iov, height + 1) < 0)
+    fprintf(stderr, "Cannot write %s", szFilename);
   
   // Close file
-  fclose(pFile);
+  av_free(iov);
+  close(fd);
 }
 
-int main(int argc, char *argv[])
-{  
-  if (argc < 2)
+// A frame waiting to be written out by the writer pool
+typedef struct WriteJob
+{
+  AVFrame *frame;
+  int width, height;
+  int file; // batch input number, -1 outside batch mode
+  int index;
+} WriteJob;
+
+// A fixed set of threads that write frames to disk so that the decode
+// loop never waits on the file system. At most WRITER_QUEUE_SIZE frames
+// are queued; past that writerPoolSubmit() waits for a free slot.
+typedef struct WriterPool
+{
+  pthread_t threads[WRITER_THREADS];
+  WriteJob jobs[WRITER_QUEUE_SIZE];
+  int head, count;
+  int done;
+  pthread_mutex_t mutex;
+  pthread_cond_t notEmpty, notFull;
+} WriterPool;
+
+void *writerThread(void *arg)
+{
+  WriterPool *pool = (WriterPool *)arg;
+  WriteJob job;
+
+  for (;;)
   {
-    printf("Please provide a movie file\n");
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->count == 0 && !pool->done)
+      pthread_cond_wait(&pool->notEmpty, &pool->mutex);
+    if (pool->count == 0)
+    {
+      // done and nothing left to write
+      pthread_mutex_unlock(&pool->mutex);
+      return NULL;
+    }
+    job = pool->jobs[pool->head];
+    pool->head = (pool->head + 1) % WRITER_QUEUE_SIZE;
+    pool->count--;
+    pthread_cond_signal(&pool->notFull);
+    pthread_mutex_unlock(&pool->mutex);
+
+    saveFrame(job.frame, job.width, job.height, job.file, job.index);
+    av_frame_free(&job.frame);
+  }
+}
+
+int writerPoolInit(WriterPool *pool)
+{
+  int i;
+
+  memset(pool, 0, sizeof(WriterPool));
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->notEmpty, NULL);
+  pthread_cond_init(&pool->notFull, NULL);
+  for (i = 0; i < WRITER_THREADS; i++)
+  {
+    if (pthread_create(&pool->threads[i], NULL, writerThread, pool) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Queue pFrame to be saved as frame number iFrame of input iFile. The pool
+// takes over the frame's reference, leaving pFrame blank for the caller.
+int writerPoolSubmit(WriterPool *pool, AVFrame *pFrame, int width, int height, int iFile, int iFrame)
+{
+  AVFrame *frame = av_frame_alloc();
+  if (frame == NULL)
+    return -1;
+  av_frame_move_ref(frame, pFrame);
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->count == WRITER_QUEUE_SIZE)
+    pthread_cond_wait(&pool->notFull, &pool->mutex);
+  WriteJob *job = &pool->jobs[(pool->head + pool->count) % WRITER_QUEUE_SIZE];
+  job->frame = frame;
+  job->width = width;
+  job->height = height;
+  job->file = iFile;
+  job->index = iFrame;
+  pool->count++;
+  pthread_cond_signal(&pool->notEmpty);
+  pthread_mutex_unlock(&pool->mutex);
+  return 0;
+}
+
+// Write out whatever is still queued and stop the threads
+void writerPoolDestroy(WriterPool *pool)
+{
+  int i;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->done = 1;
+  pthread_cond_broadcast(&pool->notEmpty);
+  pthread_mutex_unlock(&pool->mutex);
+  for (i = 0; i < WRITER_THREADS; i++)
+    pthread_join(pool->threads[i], NULL);
+  pthread_cond_destroy(&pool->notFull);
+  pthread_cond_destroy(&pool->notEmpty);
+  pthread_mutex_destroy(&pool->mutex);
+}
+
+// Bands are whole multiples of 16 rows so chroma rows never straddle two
+// bands, and no band is shorter than this
+#define SCALE_MIN_BAND_ROWS 64
+
+typedef struct ParallelScaler ParallelScaler;
+
+// One thread of a ParallelScaler. Each keeps its own converter, cached by
+// sws_getCachedContext() on the band geometry, formats and flags, so
+// frames of the same shape never set one up again.
+typedef struct ScaleWorker
+{
+  ParallelScaler *scaler;
+  pthread_t thread;
+  struct SwsContext *swsCtx;
+  int index;
+  int y, h; // this worker's band of the current frame
+} ScaleWorker;
+
+// Converts frames in horizontal bands, one per thread. The caller's thread
+// converts band 0 itself and waits for the others, so nbThreads - 1
+// threads are started.
+struct ParallelScaler
+{
+  ScaleWorker workers[MAX_SCALE_THREADS];
+  int nbThreads;
+  pthread_mutex_t mutex;
+  pthread_cond_t start, done;
+  unsigned generation; // bumped for every frame handed to the workers
+  int pending;         // bands of the current frame not yet converted
+  int quit;
+  int failed;
+  int nbBands;
+  const AVFrame *src;
+  AVFrame *dst;
+  int flags;
+  int64_t frames, totalTime; // for scalerMsPerFrame()
+};
+
+// Convert rows y to y + h of src into the same rows of dst, treating the
+// band as an image of its own. yuv420p to rgb24 at the same size, the
+// usual case, skips swscale for the kernels in fast_convert.h.
+int scaleBand(struct SwsContext **ctx, const AVFrame *src, AVFrame *dst, int y, int srcH, int dstH, int flags)
+{
+  const AVPixFmtDescriptor *srcDesc = av_pix_fmt_desc_get(src->format);
+  const AVPixFmtDescriptor *dstDesc = av_pix_fmt_desc_get(dst->format);
+  const uint8_t *srcData[4];
+  uint8_t *dstData[4];
+  int i;
+
+  if (fast_convert_supported(src, dst))
+  {
+    fast_convert_frame(src, dst, y, srcH);
+    return 0;
+  }
+
+  *ctx = sws_getCachedContext(*ctx, src->width, srcH, src->format,
+                              dst->width, dstH, dst->format,
+                              flags, NULL, NULL, NULL);
+  if (*ctx == NULL || srcDesc == NULL || dstDesc == NULL)
     return -1;
+  for (i = 0; i < 4; i++)
+  {
+    srcData[i] = src->data[i] ? src->data[i] +
+      (i == 1 || i == 2 ? y >> srcDesc->log2_chroma_h : y) * src->linesize[i] : NULL;
+    dstData[i] = dst->data[i] ? dst->data[i] +
+      (i == 1 || i == 2 ? y >> dstDesc->log2_chroma_h : y) * dst->linesize[i] : NULL;
   }
+  sws_scale(*ctx, srcData, src->linesize, 0, srcH, dstData, dst->linesize);
+  return 0;
+}
+
+void *scaleWorkerThread(void *arg)
+{
+  ScaleWorker *w = (ScaleWorker *)arg;
+  ParallelScaler *s = w->scaler;
+  unsigned seen = 0;
+  int ret;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&s->mutex);
+    while (s->generation == seen && !s->quit)
+      pthread_cond_wait(&s->start, &s->mutex);
+    if (s->quit)
+    {
+      pthread_mutex_unlock(&s->mutex);
+      return NULL;
+    }
+    seen = s->generation;
+    if (w->index >= s->nbBands)
+    {
+      // the frame was too short to give this thread a band
+      pthread_mutex_unlock(&s->mutex);
+      continue;
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    ret = scaleBand(&w->swsCtx, s->src, s->dst, w->y, w->h, w->h, s->flags);
+
+    pthread_mutex_lock(&s->mutex);
+    if (ret < 0)
+      s->failed = 1;
+    if (--s->pending == 0)
+      pthread_cond_signal(&s->done);
+    pthread_mutex_unlock(&s->mutex);
+  }
+}
+
+// Start a scaler with nbThreads bands, at most MAX_SCALE_THREADS
+void parallelScalerInit(ParallelScaler *s, int nbThreads)
+{
+  int i;
+
+  memset(s, 0, sizeof(ParallelScaler));
+  s->nbThreads = FFMIN(FFMAX(nbThreads, 1), MAX_SCALE_THREADS);
+  pthread_mutex_init(&s->mutex, NULL);
+  pthread_cond_init(&s->start, NULL);
+  pthread_cond_init(&s->done, NULL);
+  for (i = 0; i < s->nbThreads; i++)
+  {
+    s->workers[i].scaler = s;
+    s->workers[i].index = i;
+    if (i > 0 && pthread_create(&s->workers[i].thread, NULL, scaleWorkerThread, &s->workers[i]) != 0)
+    {
+      // run with the threads that did start
+      s->nbThreads = i;
+      break;
+    }
+  }
+}
+
+// Convert src into dst, which must already have its buffers. Only
+// conversions that keep the height are split; anything else, palettised
+// input or a frame too short for two bands goes through in one piece on
+// the calling thread.
+int parallelScale(ParallelScaler *s, const AVFrame *src, AVFrame *dst, int flags)
+{
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src->format);
+  int64_t start = av_gettime_relative();
+  int nbBands, rows, y, i, ret;
+
+  nbBands = FFMIN(s->nbThreads, src->height / SCALE_MIN_BAND_ROWS);
+  if (nbBands <= 1 || src->height != dst->height || desc == NULL ||
+      (desc->flags & AV_PIX_FMT_FLAG_PAL))
+  {
+    ret = scaleBand(&s->workers[0].swsCtx, src, dst, 0, src->height, dst->height, flags);
+  }
+  else
+  {
+    rows = (src->height / nbBands) & ~15;
+    pthread_mutex_lock(&s->mutex);
+    for (i = 0, y = 0; i < nbBands; i++, y += rows)
+    {
+      s->workers[i].y = y;
+      s->workers[i].h = i == nbBands - 1 ? src->height - y : rows;
+    }
+    s->src = src;
+    s->dst = dst;
+    s->flags = flags;
+    s->nbBands = nbBands;
+    s->pending = nbBands - 1;
+    s->failed = 0;
+    s->generation++;
+    pthread_cond_broadcast(&s->start);
+    pthread_mutex_unlock(&s->mutex);
+
+    ret = scaleBand(&s->workers[0].swsCtx, src, dst, 0, s->workers[0].h, s->workers[0].h, flags);
+
+    pthread_mutex_lock(&s->mutex);
+    while (s->pending > 0)
+      pthread_cond_wait(&s->done, &s->mutex);
+    if (s->failed)
+      ret = -1;
+    pthread_mutex_unlock(&s->mutex);
+  }
+
+  s->totalTime += av_gettime_relative() - start;
+  s->frames++;
+  return ret;
+}
+
+// Average milliseconds parallelScale() took per frame so far
+double scalerMsPerFrame(const ParallelScaler *s)
+{
+  return s->frames ? s->totalTime / 1000.0 / s->frames : 0.0;
+}
+
+// Stop the threads and free every worker's converter
+void parallelScalerDestroy(ParallelScaler *s)
+{
+  int i;
+
+  pthread_mutex_lock(&s->mutex);
+  s->quit = 1;
+  pthread_cond_broadcast(&s->start);
+  pthread_mutex_unlock(&s->mutex);
+  for (i = 0; i < s->nbThreads; i++)
+  {
+    if (i > 0)
+      pthread_join(s->workers[i].thread, NULL);
+    sws_freeContext(s->workers[i].swsCtx);
+    s->workers[i].swsCtx = NULL;
+  }
+  pthread_cond_destroy(&s->done);
+  pthread_cond_destroy(&s->start);
+  pthread_mutex_destroy(&s->mutex);
+  // Extractors are reused across files; a later extractorClose() must
+  // not find this scaler still running
+  s->nbThreads = 0;
+}
+
+// Which frames to pull out of each file
+typedef struct ExtractOptions
+{
+  int frames;       // how many frames at most
+  int thumbnails;   // -thumbs N
+  int keyframeStep; // -keyframes K
+  int threads;      // decoder threads, 0 lets libavcodec pick
+  int threadType;   // FF_THREAD_FRAME and/or FF_THREAD_SLICE
+  int scaleThreads; // bands the RGB conversion is split into
+} ExtractOptions;
+
+// Everything the extraction modes need to decode, convert and save frames
+typedef struct Extractor
+{
+  AVFormatContext *pFormatCtx;
+  AVCodecContext *pCodecCtx;
+  int videoStream;
+  ParallelScaler scaler;
+  AVPacket *pPacket;
+  AVFrame *pFrame;
+  AVFrame *pFrameRGB;
+  FramePool rgbPool;
+  WriterPool *writers;
+  int file; // batch input number, -1 outside batch mode
+} Extractor;
+
+// Open filename and set up its decoder, converter and frames. On failure
+// whatever was set up is released again by extractorClose().
+int extractorOpen(Extractor *ex, const char *filename, const ExtractOptions *opts)
+{
+  AVCodecParameters *pCodecParams = NULL;
+  AVCodec *pCodec = NULL;
+  int i;
 
-  // Register all formats and codecs
-  // Now not useful anymore since version 4.0
-  //av_register_all();
-  
   // Open video file
-  AVFormatContext *pFormatCtx = avformat_alloc_context();
-  if (!pFormatCtx) {
-    fprintf(stderr, "Could not allocate memory for format context");
+  ex->pFormatCtx = avformat_alloc_context();
+  if (!ex->pFormatCtx)
+  {
+    fprintf(stderr, "Could not allocate memory for format context\n");
     return -1;
   }
 
-  if (avformat_open_input(&pFormatCtx, argv[1], NULL, NULL) != 0)
+  if (avformat_open_input(&ex->pFormatCtx, filename, NULL, NULL) != 0)
   {
-    fprintf(stderr, "Cannot open file");
+    fprintf(stderr, "Cannot open %s\n", filename);
     return -1; // Couldn't open file
   }
-  
+
   // Retrieve stream information
-  if (avformat_find_stream_info(pFormatCtx, NULL) < 0)
+  if (avformat_find_stream_info(ex->pFormatCtx, NULL) < 0)
   {
-    fprintf(stderr, "Could not find stream information");
+    fprintf(stderr, "Could not find stream information in %s\n", filename);
     return -1; // Couldn't find stream information
   }
 
-  AVCodec *pCodec = NULL;
-  AVCodecParameters *pCodecParams = NULL;
-  
   // Find the first video stream
-  int videoStream = -1;
-  int i;
-
-  for (i = 0; i < pFormatCtx->nb_streams; i++)
+  ex->videoStream = -1;
+  for (i = 0; i < ex->pFormatCtx->nb_streams; i++)
   {
-    if (pFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+    if (ex->pFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
     {
-      videoStream = i;
-      pCodecParams = pFormatCtx->streams[i]->codecpar;
+      ex->videoStream = i;
+      pCodecParams = ex->pFormatCtx->streams[i]->codecpar;
       pCodec = avcodec_find_decoder(pCodecParams->codec_id);
       break; // We want only the first video stream, the leave the other stream that might be present in the file
     }
   }
 
-  if (videoStream == -1)
+  if (ex->videoStream == -1)
   {
-    fprintf(stderr, "Did not find a video stream");
+    fprintf(stderr, "Did not find a video stream in %s\n", filename);
     return -1;
   }
 
   // Get a pointer to the codec context for the video stream
-  AVCodecContext *pCodecCtx = avcodec_alloc_context3(pCodec);
-  if (pCodecCtx == NULL)
+  ex->pCodecCtx = avcodec_alloc_context3(pCodec);
+  if (ex->pCodecCtx == NULL)
   {
-    fprintf(stderr, "Could not allocate video codec context");
+    fprintf(stderr, "Could not allocate video codec context\n");
     return -1;
   }
 
   // Fill the codec context from the codec parameters values
-  if (avcodec_parameters_to_context(pCodecCtx, pCodecParams) < 0)
+  if (avcodec_parameters_to_context(ex->pCodecCtx, pCodecParams) < 0)
   {
-    fprintf(stderr, "Failed to copy codec params to codec context");
+    fprintf(stderr, "Failed to copy codec params to codec context\n");
     return -1;
   }
 
-  if (avcodec_open2(pCodecCtx, pCodec, NULL) < 0)
+  ex->pCodecCtx->thread_count = opts->threads;
+  ex->pCodecCtx->thread_type = opts->threadType;
+  if (avcodec_open2(ex->pCodecCtx, pCodec, NULL) < 0)
   {
-    fprintf(stderr, "failed to open codec");
+    fprintf(stderr, "failed to open codec for %s\n", filename);
     return -1;
   }
 
   // Allocate video frame
-  AVFrame *pFrame = av_frame_alloc();
-  if (pFrame == NULL)
+  ex->pFrame = av_frame_alloc();
+  ex->pPacket = av_packet_alloc();
+  // Allocate an AVFrame structure
+  ex->pFrameRGB = av_frame_alloc();
+  if (ex->pFrame == NULL || ex->pPacket == NULL || ex->pFrameRGB == NULL)
   {
-    fprintf(stderr, "Could not allocate video frame");
+    fprintf(stderr, "Could not allocate frames and packet\n");
     return -1;
   }
 
-  AVPacket *pPacket = av_packet_alloc();
-  if (pPacket == NULL)
+  // The converters themselves are set up by the first frame
+  parallelScalerInit(&ex->scaler, opts->scaleThreads);
+  return 0;
+}
+
+void extractorClose(Extractor *ex)
+{
+  if (ex->scaler.nbThreads > 0)
+    parallelScalerDestroy(&ex->scaler);
+
+  // Free the packet
+  av_packet_free(&ex->pPacket);
+
+  // Free the YUV frame
+  av_frame_free(&ex->pFrame);
+
+  // Free the RGB image
+  av_frame_free(&ex->pFrameRGB);
+
+  // Close the codec
+  avcodec_free_context(&ex->pCodecCtx);
+
+  // Close the video file
+  avformat_close_input(&ex->pFormatCtx);
+}
+
+// Convert the decoded frame to RGB in a pooled buffer and queue it to be
+// saved as frame number iFrame. The writer hands the buffer back to the
+// pool once it is on disk.
+int saveDecodedFrame(Extractor *ex, int iFrame)
+{
+  AVCodecContext *pCodecCtx = ex->pCodecCtx;
+
+  if (framePoolGet(&ex->rgbPool, ex->pFrameRGB, pCodecCtx->width, pCodecCtx->height, AV_PIX_FMT_RGB24) < 0)
   {
-    fprintf(stderr, "Failed to allocate memory for AVPacket");
+    fprintf(stderr, "Could not allocate output frame");
     return -1;
   }
 
-  // Allocate an AVFrame structure
-  AVFrame *pFrameRGB = av_frame_alloc();
-  if(pFrameRGB == NULL)
-  {
-    fprintf(stderr, "Could not allocate output video frame");
-    return -1;
-  }
-
-  struct SwsContext *swsCtx =
-    sws_getContext
-    (
-        pCodecCtx->width,
-        pCodecCtx->height,
-        pCodecCtx->pix_fmt,
-        pCodecCtx->width,
-        pCodecCtx->height,
-        AV_PIX_FMT_RGB24,
-        SWS_BILINEAR,
-        NULL,
-        NULL,
-        NULL
-    );
-
-  int frames_to_process = 5;
-  i = 0;
-  
-  // Read frames and save first five frames to disk
-  while (av_read_frame(pFormatCtx, pPacket) >= 0 && i < frames_to_process)
+  // Convert the image from its native format to RGB
+  if (parallelScale(&ex->scaler, ex->pFrame, ex->pFrameRGB, SWS_BILINEAR) < 0)
+  {
+    fprintf(stderr, "Could not initialize the conversion context\n");
+    return -1;
+  }
+
+  // Save the frame to disk
+  if (writerPoolSubmit(ex->writers, ex->pFrameRGB, pCodecCtx->width, pCodecCtx->height, ex->file, iFrame) < 0)
+  {
+    fprintf(stderr, "Could not queue frame for writing");
+    return -1;
+  }
+  return 0;
+}
+
+// Read and decode packets until the decoder hands out a frame.
+// Returns 0 with the frame in ex->pFrame, AVERROR_EOF once the file
+// and the decoder are both drained.
+int decodeNextFrame(Extractor *ex)
+{
+  int ret;
+
+  for (;;)
   {
-    // Is this a packet from the video stream?
-    if (pPacket->stream_index == videoStream)
+    ret = avcodec_receive_frame(ex->pCodecCtx, ex->pFrame);
+    if (ret != AVERROR(EAGAIN))
+      return ret;
+
+    if (av_read_frame(ex->pFormatCtx, ex->pPacket) < 0)
     {
-      // Decode video frame  
-      if (avcodec_send_packet(pCodecCtx, pPacket) < 0)
-      {
-        fprintf(stderr, "Error while sending packet to decoder.");
+      // End of file: let the decoder give up what it still holds
+      ret = avcodec_send_packet(ex->pCodecCtx, NULL);
+      if (ret < 0)
+        return ret;
+      continue;
+    }
+    ret = 0;
+    if (ex->pPacket->stream_index == ex->videoStream)
+      ret = avcodec_send_packet(ex->pCodecCtx, ex->pPacket);
+    av_packet_unref(ex->pPacket);
+    if (ret < 0)
+      return ret;
+  }
+}
+
+// Save the first count frames of the file
+int extractFrames(Extractor *ex, int count)
+{
+  int i = 0;
+
+  while (i < count && decodeNextFrame(ex) == 0)
+  {
+    if (saveDecodedFrame(ex, ++i) < 0)
+      return -1;
+    if (i % 500 == 0 && ex->file < 0)
+      fprintf(stderr, "%d frames, peak RSS %ld KB\n", i, peakRSS());
+  }
+  return i;
+}
+
+// Seek to count evenly spaced points in the file and save the keyframe
+// found at each one. Non-key frames are never decoded.
+int extractThumbnails(Extractor *ex, int count)
+{
+  AVFormatContext *pFormatCtx = ex->pFormatCtx;
+  int64_t start = pFormatCtx->start_time != AV_NOPTS_VALUE ? pFormatCtx->start_time : 0;
+  int64_t ts, t0;
+  int i;
+
+  if (pFormatCtx->duration <= 0)
+  {
+    fprintf(stderr, "Unknown duration, cannot space thumbnails\n");
+    return -1;
+  }
+  ex->pCodecCtx->skip_frame = AVDISCARD_NONKEY;
+
+  for (i = 0; i < count; i++)
+  {
+    ts = start + pFormatCtx->duration * i / count;
+    t0 = av_gettime_relative();
+    // Timestamps in AV_TIME_BASE units since no stream is given
+    if (av_seek_frame(pFormatCtx, -1, ts, AVSEEK_FLAG_BACKWARD) < 0)
+    {
+      fprintf(stderr, "Could not seek to %.2fs\n", ts / (double)AV_TIME_BASE);
+      continue;
+    }
+    avcodec_flush_buffers(ex->pCodecCtx);
+    if (decodeNextFrame(ex) < 0)
+      break;
+    if (saveDecodedFrame(ex, i + 1) < 0)
+      return -1;
+    if (ex->file < 0)
+      fprintf(stderr, "thumbnail %d at %.2fs: %.1f ms\n",
+              i + 1, ts / (double)AV_TIME_BASE, (av_gettime_relative() - t0) / 1000.0);
+  }
+  return i;
+}
+
+// Save every step-th keyframe, up to count of them. Only the packets of
+// those keyframes are sent to the decoder.
+int extractKeyframes(Extractor *ex, int step, int count)
+{
+  int keyframes = 0;
+  int saved = 0;
+  int ret = 0;
+  int64_t t0 = av_gettime_relative();
+
+  ex->pCodecCtx->skip_frame = AVDISCARD_NONKEY;
+
+  while (saved < count)
+  {
+    if (av_read_frame(ex->pFormatCtx, ex->pPacket) < 0)
+    {
+      // End of file: collect what the decoder still holds
+      avcodec_send_packet(ex->pCodecCtx, NULL);
+    }
+    else
+    {
+      ret = 0;
+      if (ex->pPacket->stream_index == ex->videoStream &&
+          (ex->pPacket->flags & AV_PKT_FLAG_KEY) &&
+          keyframes++ % step == 0)
+        ret = avcodec_send_packet(ex->pCodecCtx, ex->pPacket);
+      av_packet_unref(ex->pPacket);
+      if (ret < 0)
+        return ret;
+    }
+
+    while (saved < count && (ret = avcodec_receive_frame(ex->pCodecCtx, ex->pFrame)) == 0)
+    {
+      if (saveDecodedFrame(ex, ++saved) < 0)
         return -1;
+      if (ex->file < 0)
+        fprintf(stderr, "thumbnail %d (keyframe %d): %.1f ms\n",
+                saved, (saved - 1) * step + 1, (av_gettime_relative() - t0) / 1000.0);
+      t0 = av_gettime_relative();
+    }
+    if (ret == AVERROR_EOF)
+      break;
+  }
+  return saved;
+}
+
+// Pull frames out of an opened file the way opts asks for
+int runExtraction(Extractor *ex, const ExtractOptions *opts)
+{
+  if (opts->thumbnails)
+    return extractThumbnails(ex, opts->thumbnails);
+  if (opts->keyframeStep)
+    return extractKeyframes(ex, opts->keyframeStep, opts->frames);
+  // Read frames and save the first opts->frames frames to disk
+  return extractFrames(ex, opts->frames);
+}
+
+// One worker's share of a batch: the input numbers items[top..bottom).
+// The owner takes from the bottom, idle workers steal from the top.
+typedef struct WorkDeque
+{
+  int *items;
+  int top, bottom;
+  pthread_mutex_t mutex;
+} WorkDeque;
+
+typedef struct Batch
+{
+  char **inputs;
+  int nbInputs;
+  WorkDeque *deques;
+  int nbWorkers;
+  const ExtractOptions *opts;
+  WriterPool *writers;
+} Batch;
+
+typedef struct BatchWorker
+{
+  Batch *batch;
+  int id;
+  pthread_t thread;
+  Extractor ex; // its own codec and sws contexts, reopened per file
+  int files, failed;
+  long frames;
+} BatchWorker;
+
+int workDequePop(WorkDeque *dq)
+{
+  int item = -1;
+
+  pthread_mutex_lock(&dq->mutex);
+  if (dq->bottom > dq->top)
+    item = dq->items[--dq->bottom];
+  pthread_mutex_unlock(&dq->mutex);
+  return item;
+}
+
+int workDequeSteal(WorkDeque *dq)
+{
+  int item = -1;
+
+  pthread_mutex_lock(&dq->mutex);
+  if (dq->bottom > dq->top)
+    item = dq->items[dq->top++];
+  pthread_mutex_unlock(&dq->mutex);
+  return item;
+}
+
+// The next input for worker id: its own first, then anyone else's.
+// No work is added once the batch starts, so -1 means everything is taken.
+int batchNextInput(Batch *batch, int id)
+{
+  int item = workDequePop(&batch->deques[id]);
+  int i;
+
+  for (i = 1; item < 0 && i < batch->nbWorkers; i++)
+    item = workDequeSteal(&batch->deques[(id + i) % batch->nbWorkers]);
+  return item;
+}
+
+void *batchWorkerThread(void *arg)
+{
+  BatchWorker *w = (BatchWorker *)arg;
+  Batch *batch = w->batch;
+  int item, n;
+
+  w->ex.writers = batch->writers;
+  while ((item = batchNextInput(batch, w->id)) >= 0)
+  {
+    w->ex.file = item;
+    n = -1;
+    if (extractorOpen(&w->ex, batch->inputs[item], batch->opts) == 0)
+      n = runExtraction(&w->ex, batch->opts);
+    extractorClose(&w->ex);
+    if (n < 0)
+    {
+      w->failed++;
+      continue;
+    }
+    w->files++;
+    w->frames += n;
+  }
+  return NULL;
+}
+
+// Add path to the batch: a directory adds the files in it, "@list" adds
+// every line of list, anything else is taken to be a movie.
+int addBatchInput(char ***inputs, int *nbInputs, const char *path)
+{
+  char line[4096];
+  struct dirent *entry;
+  struct stat st;
+  DIR *dir;
+  FILE *list;
+
+  if (path[0] == '@')
+  {
+    list = fopen(path + 1, "r");
+    if (list == NULL)
+    {
+      fprintf(stderr, "Cannot open list %s\n", path + 1);
+      return -1;
+    }
+    while (fgets(line, sizeof(line), list))
+    {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] != '\0')
+        av_dynarray_add(inputs, nbInputs, av_strdup(line));
+    }
+    fclose(list);
+    return 0;
+  }
+
+  if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+  {
+    dir = opendir(path);
+    if (dir == NULL)
+    {
+      fprintf(stderr, "Cannot open directory %s\n", path);
+      return -1;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+      if (entry->d_name[0] == '.')
+        continue;
+      snprintf(line, sizeof(line), "%s/%s", path, entry->d_name);
+      if (stat(line, &st) == 0 && S_ISREG(st.st_mode))
+        av_dynarray_add(inputs, nbInputs, av_strdup(line));
+    }
+    closedir(dir);
+    return 0;
+  }
+
+  av_dynarray_add(inputs, nbInputs, av_strdup(path));
+  return 0;
+}
+
+// Extract from every input on nbWorkers threads and report the throughput
+int runBatch(char **inputs, int nbInputs, int nbWorkers, const ExtractOptions *opts)
+{
+  WriterPool writers;
+  Batch batch;
+  BatchWorker *workers;
+  int *items;
+  int files = 0, failed = 0;
+  long frames = 0;
+  int64_t start;
+  double elapsed;
+  int i;
+
+  if (nbWorkers > nbInputs)
+    nbWorkers = nbInputs;
+  workers = av_mallocz_array(nbWorkers, sizeof(BatchWorker));
+  batch.deques = av_mallocz_array(nbWorkers, sizeof(WorkDeque));
+  items = av_malloc_array(nbInputs, sizeof(int));
+  if (workers == NULL || batch.deques == NULL || items == NULL)
+  {
+    fprintf(stderr, "Could not allocate the batch\n");
+    return -1;
+  }
+  if (writerPoolInit(&writers) < 0)
+  {
+    fprintf(stderr, "Could not start the writer threads\n");
+    return -1;
+  }
+
+  batch.inputs = inputs;
+  batch.nbInputs = nbInputs;
+  batch.nbWorkers = nbWorkers;
+  batch.opts = opts;
+  batch.writers = &writers;
+
+  // Deal out consecutive runs of inputs; stealing evens out the rest
+  for (i = 0; i < nbInputs; i++)
+    items[i] = i;
+  for (i = 0; i < nbWorkers; i++)
+  {
+    WorkDeque *dq = &batch.deques[i];
+    dq->items = items;
+    dq->top = (int)((int64_t)nbInputs * i / nbWorkers);
+    dq->bottom = (int)((int64_t)nbInputs * (i + 1) / nbWorkers);
+    pthread_mutex_init(&dq->mutex, NULL);
+  }
+
+  start = av_gettime_relative();
+  for (i = 0; i < nbWorkers; i++)
+  {
+    workers[i].batch = &batch;
+    workers[i].id = i;
+    if (pthread_create(&workers[i].thread, NULL, batchWorkerThread, &workers[i]) != 0)
+    {
+      fprintf(stderr, "Could not start batch worker %d\n", i);
+      return -1;
+    }
+  }
+  for (i = 0; i < nbWorkers; i++)
+  {
+    pthread_join(workers[i].thread, NULL);
+    files += workers[i].files;
+    failed += workers[i].failed;
+    frames += workers[i].frames;
+    framePoolUninit(&workers[i].ex.rgbPool);
+    pthread_mutex_destroy(&batch.deques[i].mutex);
+  }
+  writerPoolDestroy(&writers);
+  elapsed = (av_gettime_relative() - start) / 1000000.0;
+
+  fprintf(stderr, "%d files (%d failed), %ld frames in %.2fs on %d workers: %.1f files/sec, %.1f frames/sec\n",
+          files, failed, frames, elapsed, nbWorkers,
+          elapsed > 0 ? files / elapsed : 0, elapsed > 0 ? frames / elapsed : 0);
+  fprintf(stderr, "peak RSS %ld KB\n", peakRSS());
+
+  av_free(items);
+  av_free(batch.deques);
+  av_free(workers);
+  return failed ? 1 : 0;
+}
+
+// A run of whole GOPs that the GOP-parallel mode decodes on its own
+typedef struct Segment
+{
+  int64_t keyframe;   // pts of its first keyframe, where decoding starts
+  int64_t start, end; // the frames it owns have start <= pts < end
+  int firstFrame;     // number of frames before it in pts order
+} Segment;
+
+typedef struct GopJob
+{
+  const char *filename;
+  const ExtractOptions *opts;
+  Segment *segments;
+  int nbSegments;
+  int next; // next segment to hand out
+  pthread_mutex_t mutex;
+  WriterPool *writers;
+} GopJob;
+
+typedef struct GopWorker
+{
+  GopJob *job;
+  pthread_t thread;
+  Extractor ex; // its own AVFormatContext and AVCodecContext
+  long frames;
+  int failed;
+} GopWorker;
+
+int compareTimestamps(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+int appendTimestamp(int64_t **array, int *count, int *allocated, int64_t ts)
+{
+  if (*count == *allocated)
+  {
+    int64_t *grown = av_realloc_array(*array, *allocated ? *allocated * 2 : 1024, sizeof(int64_t));
+    if (grown == NULL)
+      return AVERROR(ENOMEM);
+    *array = grown;
+    *allocated = *allocated ? *allocated * 2 : 1024;
+  }
+  (*array)[(*count)++] = ts;
+  return 0;
+}
+
+// Read every video packet without decoding it and cut the file at
+// keyframes into about wanted segments holding the same number of frames.
+// Each segment's first frame number is the prefix sum of the frames of
+// the segments before it.
+int scanSegments(Extractor *ex, int wanted, Segment **segments, int *nbSegments)
+{
+  int64_t *keys = NULL, *pts = NULL;
+  int nbKeys = 0, keysAllocated = 0, nbPts = 0, ptsAllocated = 0;
+  int *counts;
+  int i, j, k, n, ret = 0;
+
+  while (ret >= 0 && av_read_frame(ex->pFormatCtx, ex->pPacket) >= 0)
+  {
+    if (ex->pPacket->stream_index == ex->videoStream && ex->pPacket->pts != AV_NOPTS_VALUE)
+    {
+      ret = appendTimestamp(&pts, &nbPts, &ptsAllocated, ex->pPacket->pts);
+      if (ret >= 0 && (ex->pPacket->flags & AV_PKT_FLAG_KEY))
+        ret = appendTimestamp(&keys, &nbKeys, &keysAllocated, ex->pPacket->pts);
+    }
+    av_packet_unref(ex->pPacket);
+  }
+  if (ret < 0 || nbKeys == 0)
+  {
+    fprintf(stderr, ret < 0 ? "Out of memory while scanning\n" : "No keyframes with timestamps found\n");
+    av_free(keys);
+    av_free(pts);
+    return -1;
+  }
+
+  qsort(keys, nbKeys, sizeof(int64_t), compareTimestamps);
+  qsort(pts, nbPts, sizeof(int64_t), compareTimestamps);
+  for (i = 1, k = 1; i < nbKeys; i++)
+    if (keys[i] != keys[k - 1])
+      keys[k++] = keys[i];
+  nbKeys = k;
+
+  // Frames of each GOP, counting any before the first keyframe in GOP 0
+  counts = av_mallocz_array(nbKeys, sizeof(int));
+  *segments = av_malloc_array(wanted < nbKeys ? wanted : nbKeys, sizeof(Segment));
+  if (counts == NULL || *segments == NULL)
+  {
+    av_freep(segments);
+    av_free(counts);
+    av_free(keys);
+    av_free(pts);
+    return -1;
+  }
+  for (i = 0, j = 0; j < nbPts; j++)
+  {
+    while (i + 1 < nbKeys && pts[j] >= keys[i + 1])
+      i++;
+    counts[i]++;
+  }
+
+  // Walk the GOPs in order, closing a segment once it has its share
+  n = 0;
+  j = 0; // frames in the segments so far
+  for (i = 0; i < nbKeys; i = k)
+  {
+    int first = j;
+    int target = (int)((int64_t)nbPts * (n + 1) / wanted);
+
+    k = i;
+    do
+      j += counts[k++];
+    while (k < nbKeys && j < target);
+
+    (*segments)[n].keyframe = keys[i];
+    (*segments)[n].start = n == 0 ? INT64_MIN : keys[i];
+    (*segments)[n].end = k < nbKeys ? keys[k] : INT64_MAX;
+    (*segments)[n].firstFrame = first;
+    n++;
+  }
+  *nbSegments = n;
+
+  av_free(counts);
+  av_free(keys);
+  av_free(pts);
+  return 0;
+}
+
+Segment *gopNextSegment(GopJob *job)
+{
+  Segment *seg = NULL;
+
+  pthread_mutex_lock(&job->mutex);
+  if (job->next < job->nbSegments)
+    seg = &job->segments[job->next++];
+  pthread_mutex_unlock(&job->mutex);
+  return seg;
+}
+
+void *gopWorkerThread(void *arg)
+{
+  GopWorker *w = (GopWorker *)arg;
+  GopJob *job = w->job;
+  Extractor *ex = &w->ex;
+  Segment *seg;
+  int64_t pts;
+  int iFrame;
+
+  ex->writers = job->writers;
+  ex->file = -1;
+  if (extractorOpen(ex, job->filename, job->opts) < 0)
+  {
+    w->failed = 1;
+    extractorClose(ex);
+    return NULL;
+  }
+
+  while ((seg = gopNextSegment(job)) != NULL)
+  {
+    if (seg->firstFrame >= job->opts->frames)
+      continue;
+    if (av_seek_frame(ex->pFormatCtx, ex->videoStream, seg->keyframe, AVSEEK_FLAG_BACKWARD) < 0)
+    {
+      fprintf(stderr, "Could not seek to segment at %" PRId64 "\n", seg->keyframe);
+      w->failed = 1;
+      continue;
+    }
+    avcodec_flush_buffers(ex->pCodecCtx);
+
+    // Frames come out in pts order, so the first one past the end means
+    // the rest belong to the next segment
+    iFrame = seg->firstFrame;
+    while (iFrame < job->opts->frames && decodeNextFrame(ex) == 0)
+    {
+      pts = ex->pFrame->best_effort_timestamp;
+      if (pts != AV_NOPTS_VALUE && pts < seg->start)
+        continue;
+      if (pts != AV_NOPTS_VALUE && pts >= seg->end)
+        break;
+      if (saveDecodedFrame(ex, ++iFrame) < 0)
+      {
+        w->failed = 1;
+        break;
       }
-      
-      int frameFinished = 1;
-      // Did we get a video frame?
-      while (frameFinished >= 0 && i < frames_to_process) 
+      w->frames++;
+    }
+  }
+  extractorClose(ex);
+  return NULL;
+}
+
+// Decode filename GOP-parallel on nbWorkers threads and report the throughput
+int runGopParallel(const char *filename, int nbWorkers, const ExtractOptions *opts)
+{
+  Extractor scan;
+  WriterPool writers;
+  GopJob job;
+  GopWorker *workers;
+  long frames = 0;
+  int failed = 0;
+  int64_t start, scanned;
+  double elapsed;
+  int i;
+
+  memset(&scan, 0, sizeof(scan));
+  memset(&job, 0, sizeof(job));
+  start = av_gettime_relative();
+  if (extractorOpen(&scan, filename, opts) < 0 ||
+      scanSegments(&scan, nbWorkers * 4, &job.segments, &job.nbSegments) < 0)
+  {
+    extractorClose(&scan);
+    return -1;
+  }
+  extractorClose(&scan);
+  scanned = av_gettime_relative();
+
+  workers = av_mallocz_array(nbWorkers, sizeof(GopWorker));
+  if (workers == NULL || writerPoolInit(&writers) < 0)
+  {
+    fprintf(stderr, "Could not start the GOP workers\n");
+    return -1;
+  }
+  job.filename = filename;
+  job.opts = opts;
+  job.writers = &writers;
+  pthread_mutex_init(&job.mutex, NULL);
+
+  for (i = 0; i < nbWorkers; i++)
+  {
+    workers[i].job = &job;
+    if (pthread_create(&workers[i].thread, NULL, gopWorkerThread, &workers[i]) != 0)
+    {
+      fprintf(stderr, "Could not start GOP worker %d\n", i);
+      return -1;
+    }
+  }
+  for (i = 0; i < nbWorkers; i++)
+  {
+    pthread_join(workers[i].thread, NULL);
+    frames += workers[i].frames;
+    failed |= workers[i].failed;
+    framePoolUninit(&workers[i].ex.rgbPool);
+  }
+  writerPoolDestroy(&writers);
+  elapsed = (av_gettime_relative() - start) / 1000000.0;
+
+  fprintf(stderr, "%ld frames from %d segments in %.2fs (scan %.2fs) on %d workers: %.1f frames/sec\n",
+          frames, job.nbSegments, elapsed, (scanned - start) / 1000000.0, nbWorkers,
+          elapsed > 0 ? frames / elapsed : 0);
+  fprintf(stderr, "peak RSS %ld KB\n", peakRSS());
+
+  pthread_mutex_destroy(&job.mutex);
+  av_free(job.segments);
+  av_free(workers);
+  return failed ? 1 : 0;
+}
+
+// Map a -thread_type argument to FF_THREAD_* flags, or -1 if unknown
+int parseThreadType(const char *name)
+{
+  if (!strcmp(name, "frame"))
+    return FF_THREAD_FRAME;
+  if (!strcmp(name, "slice"))
+    return FF_THREAD_SLICE;
+  if (!strcmp(name, "both"))
+    return FF_THREAD_FRAME | FF_THREAD_SLICE;
+  return -1;
+}
+
+// Decode the first opts->frames frames of filename without saving them,
+// once per threading mode, and print how fast each mode went
+int benchThreading(const char *filename, const ExtractOptions *opts)
+{
+  static const struct
+  {
+    const char *name;
+    int type;
+  } modes[] =
+  {
+    { "single", 0 },
+    { "slice", FF_THREAD_SLICE },
+    { "frame", FF_THREAD_FRAME },
+    { "both", FF_THREAD_FRAME | FF_THREAD_SLICE },
+  };
+  ExtractOptions modeOpts = *opts;
+  Extractor ex;
+  int64_t start, elapsed;
+  int frames;
+  int m;
+
+  for (m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++)
+  {
+    modeOpts.threads = modes[m].type ? opts->threads : 1;
+    modeOpts.threadType = modes[m].type ? modes[m].type : FF_THREAD_SLICE;
+
+    memset(&ex, 0, sizeof(ex));
+    ex.file = -1;
+    if (extractorOpen(&ex, filename, &modeOpts) < 0)
+    {
+      extractorClose(&ex);
+      return -1;
+    }
+
+    frames = 0;
+    start = av_gettime_relative();
+    while (frames < opts->frames && decodeNextFrame(&ex) == 0)
+      frames++;
+    elapsed = av_gettime_relative() - start;
+
+    // What the decoder actually did, which may be less than was asked for
+    printf("%-6s %3d threads, %-5s active: %6d frames, %8.1f fps\n",
+           modes[m].name, ex.pCodecCtx->thread_count,
+           (ex.pCodecCtx->active_thread_type & FF_THREAD_FRAME) ? "frame" :
+           (ex.pCodecCtx->active_thread_type & FF_THREAD_SLICE) ? "slice" : "none",
+           frames, elapsed > 0 ? frames * 1000000.0 / elapsed : 0.0);
+    extractorClose(&ex);
+  }
+  return 0;
+}
+
+// Decode one frame of filename and convert it to RGB opts->frames times
+// with 1, 2, 4... bands up to one per core, printing the time each
+// conversion took
+int benchScaling(const char *filename, const ExtractOptions *opts)
+{
+  Extractor ex;
+  FramePool pool;
+  AVFrame *rgb;
+  double single = 0, ms;
+  int maxThreads = FFMIN(av_cpu_count(), MAX_SCALE_THREADS);
+  int nbThreads, n, ret = 0;
+
+  memset(&ex, 0, sizeof(ex));
+  memset(&pool, 0, sizeof(pool));
+  ex.file = -1;
+  rgb = av_frame_alloc();
+  if (rgb == NULL || extractorOpen(&ex, filename, opts) < 0 || decodeNextFrame(&ex) < 0 ||
+      framePoolGet(&pool, rgb, ex.pFrame->width, ex.pFrame->height, AV_PIX_FMT_RGB24) < 0)
+  {
+    fprintf(stderr, "Could not decode a frame of %s to convert\n", filename);
+    ret = -1;
+    goto end;
+  }
+
+  printf("%dx%d %s -> rgb24, %d conversions per run\n", ex.pFrame->width, ex.pFrame->height,
+         av_get_pix_fmt_name(ex.pFrame->format), opts->frames);
+  for (nbThreads = 1; ; nbThreads = FFMIN(nbThreads * 2, maxThreads))
+  {
+    // A fresh scaler per run, so the first conversion pays for setting
+    // up the contexts just like the first frame of a file does
+    parallelScalerDestroy(&ex.scaler);
+    parallelScalerInit(&ex.scaler, nbThreads);
+    for (n = 0; n < opts->frames; n++)
+    {
+      if (parallelScale(&ex.scaler, ex.pFrame, rgb, SWS_BILINEAR) < 0)
       {
-        frameFinished = avcodec_receive_frame(pCodecCtx, pFrame);
-        // These two return values are special and mean there is no output
-        // frame available, but there were no errors during decoding
-        if (frameFinished == AVERROR(EAGAIN) || frameFinished == AVERROR_EOF)
-        {
-          break;
-        }
-        else if (frameFinished < 0)
-        {
-          fprintf(stderr, "Error during decoding");
-          return -1;
-        }
-
-        if (frameFinished >= 0)
-        {
-          if (av_image_alloc(pFrameRGB->data, pFrameRGB->linesize, pCodecCtx->width, pCodecCtx->height, AV_PIX_FMT_RGB24, 1) < 0)
-          {
-            fprintf(stderr, "Could not allocate output frame");
-            return -1;
-          }
-
-          // Convert the image from its native format to RGB
-          sws_scale
-          (
-              swsCtx,
-              pFrame->data,
-              pFrame->linesize,
-              0,
-              pCodecCtx->height,
-              pFrameRGB->data,
-              pFrameRGB->linesize
-          );
-          
-	        // Save the frame to disk
-	        saveFrame(pFrameRGB, pCodecCtx->width, pCodecCtx->height, ++i);
-        }
+        fprintf(stderr, "Could not initialize the conversion context\n");
+        ret = -1;
+        goto end;
       }
     }
+    ms = scalerMsPerFrame(&ex.scaler);
+    if (nbThreads == 1)
+      single = ms;
+    printf("%3d threads: %8.3f ms/frame, %5.2fx\n", ex.scaler.nbThreads, ms, ms > 0 ? single / ms : 0.0);
+    if (nbThreads == maxThreads)
+      break;
+  }
 
-    // Free the packet that was allocated by av_read_frame
-    av_packet_unref(pPacket);
+end:
+  av_frame_free(&rgb);
+  extractorClose(&ex);
+  framePoolUninit(&pool);
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{  
+  // threads < 0 means not given: batch and GOP modes then run one
+  // single-threaded decoder per worker, the rest use one thread per core.
+  // scaleThreads follows the same rule.
+  ExtractOptions opts = { -1, 0, 0, -1, FF_THREAD_FRAME | FF_THREAD_SLICE, -1 };
+  char **positional = NULL;
+  int nbPositional = 0;
+  int batch = 0;
+  int gop = 0;
+  int bench = 0;
+  int benchScale = 0;
+  int nbWorkers = 0;
+  int i;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "-thumbs") && i + 1 < argc)
+      opts.thumbnails = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-keyframes") && i + 1 < argc)
+      opts.keyframeStep = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-frames") && i + 1 < argc)
+      opts.frames = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+      nbWorkers = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-batch"))
+      batch = 1;
+    else if (!strcmp(argv[i], "-gop"))
+      gop = 1;
+    else if (!strcmp(argv[i], "-benchthreads"))
+      bench = 1;
+    else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+      opts.threads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-thread_type") && i + 1 < argc)
+      opts.threadType = parseThreadType(argv[++i]);
+    else if (!strcmp(argv[i], "-benchscale"))
+      benchScale = 1;
+    else if (!strcmp(argv[i], "-scale_threads") && i + 1 < argc)
+      opts.scaleThreads = atoi(argv[++i]);
+    else
+      av_dynarray_add(&positional, &nbPositional, argv[i]);
   }
+  if (nbPositional == 0 || (!batch && nbPositional > 2) || (batch + gop + bench + benchScale > 1) ||
+      opts.thumbnails < 0 || opts.keyframeStep < 0 || nbWorkers < 0 || opts.threadType < 0)
+  {
+    printf("Usage: %s [-thumbs N | -keyframes K] movie [frames]\n"
+           "       %s -batch [-j workers] [-frames N] [-thumbs N | -keyframes K] input...\n"
+           "       %s -gop [-j workers] movie [frames]\n"
+           "       %s -benchthreads movie [frames]\n"
+           "       %s -benchscale movie [conversions]\n"
+           "Decoder threading in every mode: [-threads N] [-thread_type frame|slice|both]\n"
+           "RGB conversion threads in every mode: [-scale_threads N]\n",
+           argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return -1;
+  }
+  if (!batch && nbPositional > 1)
+    opts.frames = atoi(positional[1]);
 
-  sws_freeContext(swsCtx);
+  // Five frames unless told otherwise; every Kth keyframe, or every frame
+  // when benchmarking, to the end. The scaling benchmark converts one
+  // frame a hundred times.
+  if (opts.frames < 0)
+    opts.frames = benchScale ? 100 : (opts.keyframeStep || bench) ? 0 : 5;
+  if (opts.frames == 0)
+    opts.frames = INT_MAX;
 
-  // Free the YUV frame
-  av_frame_free(&pFrame);
+  // Register all formats and codecs
+  // Now not useful anymore since version 4.0
+  //av_register_all();
 
-  // Free the RGB image
-  av_frame_free(&pFrameRGB);
+  // Before any thread converts a frame
+  fast_convert_init(av_get_cpu_flags());
 
-  // Close the codec
-  avcodec_free_context(&pCodecCtx);
+  if (batch)
+  {
+    char **inputs = NULL;
+    int nbInputs = 0;
+    int ret;
 
-  // Close the video file
-  avformat_close_input(&pFormatCtx);
+    for (i = 0; i < nbPositional; i++)
+      addBatchInput(&inputs, &nbInputs, positional[i]);
+    if (nbInputs == 0)
+    {
+      fprintf(stderr, "No inputs to process\n");
+      return -1;
+    }
+    // One single-threaded decoder per core rather than threads on threads
+    if (nbWorkers == 0)
+      nbWorkers = av_cpu_count();
+    if (opts.threads < 0)
+      opts.threads = 1;
+    if (opts.scaleThreads < 0)
+      opts.scaleThreads = 1;
+
+    ret = runBatch(inputs, nbInputs, nbWorkers, &opts);
+    for (i = 0; i < nbInputs; i++)
+      av_free(inputs[i]);
+    av_free(inputs);
+    av_free(positional);
+    return ret;
+  }
+
+  if (gop)
+  {
+    int ret;
+
+    if (nbWorkers == 0)
+      nbWorkers = av_cpu_count();
+    if (opts.threads < 0)
+      opts.threads = 1;
+    if (opts.scaleThreads < 0)
+      opts.scaleThreads = 1;
+    ret = runGopParallel(positional[0], nbWorkers, &opts);
+    av_free(positional);
+    return ret;
+  }
+
+  if (opts.threads < 0)
+    opts.threads = 0;
+  if (opts.scaleThreads <= 0)
+    opts.scaleThreads = av_cpu_count();
+
+  if (bench || benchScale)
+  {
+    int ret = bench ? benchThreading(positional[0], &opts) : benchScaling(positional[0], &opts);
+    av_free(positional);
+    return ret;
+  }
+
+  Extractor ex;
+  memset(&ex, 0, sizeof(ex));
+  ex.file = -1;
+  if (extractorOpen(&ex, positional[0], &opts) < 0)
+  {
+    extractorClose(&ex);
+    return -1;
+  }
+
+  WriterPool writers;
+  if (writerPoolInit(&writers) < 0)
+  {
+    fprintf(stderr, "Could not start the writer threads");
+    extractorClose(&ex);
+    return -1;
+  }
+  ex.writers = &writers;
+
+  i = runExtraction(&ex, &opts);
+
+  writerPoolDestroy(&writers);
+  fprintf(stderr, "%d frames processed, peak RSS %ld KB, %.3f ms/frame converting on %d threads\n",
+          i, peakRSS(), scalerMsPerFrame(&ex.scaler), ex.scaler.nbThreads);
+
+  extractorClose(&ex);
+  framePoolUninit(&ex.rgbPool);
+  av_free(positional);
   
   return 0;
-}
\ No newline at end of file
+}
@@ -17,6 +17,7 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
+#include <libavutil/imgutils.h>
 
 #include <SDL.h>
 #include <SDL_thread.h>
@@ -26,16 +27,133 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "fast_convert.h"
+
+// The SDL texture format that can take the planes of a decoded frame as
+// they are, or SDL_PIXELFORMAT_UNKNOWN if the frame has to be converted.
+Uint32 sdl_texture_format(int pix_fmt)
+{
+  switch (pix_fmt)
+  {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+      return SDL_PIXELFORMAT_IYUV;
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+    case AV_PIX_FMT_NV12:
+      return SDL_PIXELFORMAT_NV12;
+#endif
+    default:
+      return SDL_PIXELFORMAT_UNKNOWN;
+  }
+}
+
+// Upload every plane of the frame into a texture of the given format
+int upload_frame(SDL_Texture *texture, Uint32 format, AVFrame *pFrame)
+{
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+  if (format == SDL_PIXELFORMAT_NV12)
+  {
+    return SDL_UpdateNVTexture(texture, NULL,
+                               pFrame->data[0], pFrame->linesize[0],
+                               pFrame->data[1], pFrame->linesize[1]);
+  }
+#endif
+  return SDL_UpdateYUVTexture(texture, NULL,
+                              pFrame->data[0], pFrame->linesize[0],
+                              pFrame->data[1], pFrame->linesize[1],
+                              pFrame->data[2], pFrame->linesize[2]);
+}
+
+// Output buffers for converted frames, reused from one frame to the next
+// and only reallocated when the size or pixel format changes.
+typedef struct FramePool
+{
+  AVBufferPool *pool;
+  int width, height;
+  enum AVPixelFormat pix_fmt;
+} FramePool;
+
+// Point frame at a pooled buffer for a width x height image in pix_fmt.
+// av_frame_unref() on the frame gives the buffer back to the pool.
+int frame_pool_get(FramePool *fp, AVFrame *frame, int width, int height, enum AVPixelFormat pix_fmt)
+{
+  if (!fp->pool || fp->width != width || fp->height != height || fp->pix_fmt != pix_fmt)
+  {
+    int size = av_image_get_buffer_size(pix_fmt, width, height, 32);
+    if (size < 0)
+      return size;
+    // Buffers still held by frames are freed when they are released
+    av_buffer_pool_uninit(&fp->pool);
+    fp->pool = av_buffer_pool_init(size, NULL);
+    if (!fp->pool)
+      return AVERROR(ENOMEM);
+    fp->width = width;
+    fp->height = height;
+    fp->pix_fmt = pix_fmt;
+  }
+
+  av_frame_unref(frame);
+  frame->buf[0] = av_buffer_pool_get(fp->pool);
+  if (!frame->buf[0])
+    return AVERROR(ENOMEM);
+  frame->width = width;
+  frame->height = height;
+  frame->format = pix_fmt;
+  return av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, pix_fmt, width, height, 32);
+}
+
+// Peak resident set size of the process so far, in kilobytes
+long peak_rss(void)
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return -1;
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024; // bytes on macOS
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+// Map a -thread_type argument to FF_THREAD_* flags, or -1 if unknown
+int parse_thread_type(const char *name)
+{
+  if (strcmp(name, "frame") == 0)
+    return FF_THREAD_FRAME;
+  if (strcmp(name, "slice") == 0)
+    return FF_THREAD_SLICE;
+  if (strcmp(name, "both") == 0)
+    return FF_THREAD_FRAME | FF_THREAD_SLICE;
+  return -1;
+}
 
 #undef main
 int main(int argc, char *argv[])
 {
-  if (argc < 2)
+  const char *filename = NULL;
+  int threadCount = 0; // 0 lets libavcodec pick one thread per core
+  int threadType = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+  for (int arg = 1; arg < argc; arg++)
   {
-      fprintf(stderr, "Please provide a movie file\n");
+    if (strcmp(argv[arg], "-threads") == 0 && arg + 1 < argc)
+      threadCount = atoi(argv[++arg]);
+    else if (strcmp(argv[arg], "-thread_type") == 0 && arg + 1 < argc)
+      threadType = parse_thread_type(argv[++arg]);
+    else
+      filename = argv[arg];
+  }
+  if (!filename || threadCount < 0 || threadType < 0)
+  {
+      fprintf(stderr, "Usage: %s [-threads N] [-thread_type frame|slice|both] <file>\n", argv[0]);
       exit(1);
   }
 
+  fast_convert_init(av_get_cpu_flags());
+
   if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER))
   {
       fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
@@ -50,7 +168,7 @@ int main(int argc, char *argv[])
       return -1;
   }
 
-  if (avformat_open_input(&pFormatCtx, argv[1], NULL, NULL) != 0)
+  if (avformat_open_input(&pFormatCtx, filename, NULL, NULL) != 0)
   {
       fprintf(stderr, "Cannot open file");
       return -1;
@@ -96,6 +214,8 @@ int main(int argc, char *argv[])
     return -1;
   }
 
+  pCodecCtx->thread_count = threadCount;
+  pCodecCtx->thread_type = threadType;
   if (avcodec_open2(pCodecCtx, pCodec, NULL) < 0)
   {
     fprintf(stderr, "Failed to open codec");
@@ -123,6 +243,8 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Could not allocate output video frame");
     return -1;
   }
+  FramePool yuvPool = { NULL };
+  int frames = 0;
 
   // Make a screen to put our video
   // #ifndef __DARWIN__
@@ -145,24 +267,13 @@ int main(int argc, char *argv[])
   }
 
   SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
-  SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_IYUV, SDL_TEXTUREACCESS_STREAMING, pCodecCtx->width, pCodecCtx->height);
+  SDL_Texture *texture = NULL;
+  Uint32 textureFormat = SDL_PIXELFORMAT_UNKNOWN;
   SDL_Rect rect;
   SDL_Event event;
 
-  struct SwsContext *swsCtx =
-      sws_getContext
-      (
-          pCodecCtx->width,
-          pCodecCtx->height,
-          pCodecCtx->pix_fmt,
-          pCodecCtx->width,
-          pCodecCtx->height,
-          AV_PIX_FMT_YUV420P,
-          SWS_BILINEAR,
-          NULL,
-          NULL,
-          NULL
-      );
+  // Only used when the decoder outputs a format SDL can't take directly
+  struct SwsContext *swsCtx = NULL;
 
   while(av_read_frame(pFormatCtx, pPacket) >=0 )
   {
@@ -178,7 +289,7 @@ int main(int argc, char *argv[])
 
       int frameFinished = 1;
       // Did we get a video frame?
-      if (frameFinished >= 0)
+      while (frameFinished >= 0)
       {
         frameFinished = avcodec_receive_frame(pCodecCtx, pFrame);
         // These two return values are special and mean there is no output
@@ -193,26 +304,63 @@ int main(int argc, char *argv[])
           return -1;
         }
 
-        // Convert the image into YUV format that SDL uses
         if (frameFinished >= 0)
         {
-          if (av_image_alloc(pFrameYUV->data, pFrameYUV->linesize, pCodecCtx->width, pCodecCtx->height, AV_PIX_FMT_YUV420P, 1) < 0)
+          // yuv420p and nv12 go to the texture straight from the decoder
+          AVFrame *pShown = pFrame;
+          Uint32 format = sdl_texture_format(pFrame->format);
+          if (format == SDL_PIXELFORMAT_UNKNOWN)
           {
-            fprintf(stderr, "Could not allocate output frame");
-            return -1;
+            // Anything else is converted into YUV format that SDL uses.
+            // nv12, which only gets here on SDL before 2.0.16, has a
+            // kernel of its own.
+            format = SDL_PIXELFORMAT_IYUV;
+            if (frame_pool_get(&yuvPool, pFrameYUV, pFrame->width, pFrame->height, AV_PIX_FMT_YUV420P) < 0)
+            {
+              fprintf(stderr, "Could not allocate output frame");
+              return -1;
+            }
+            if (fast_convert_supported(pFrame, pFrameYUV))
+            {
+              fast_convert_frame(pFrame, pFrameYUV, 0, pFrame->height);
+            }
+            else
+            {
+              swsCtx = sws_getCachedContext(swsCtx,
+                                            pFrame->width, pFrame->height, pFrame->format,
+                                            pFrame->width, pFrame->height, AV_PIX_FMT_YUV420P,
+                                            SWS_BILINEAR, NULL, NULL, NULL);
+              if (!swsCtx)
+              {
+                fprintf(stderr, "Could not initialize the conversion context");
+                return -1;
+              }
+              sws_scale
+              (
+                  swsCtx,
+                  (uint8_t const * const *)pFrame->data,
+                  pFrame->linesize,
+                  0,
+                  pFrame->height,
+                  pFrameYUV->data,
+                  pFrameYUV->linesize
+              );
+            }
+            pShown = pFrameYUV;
           }
 
-          // Convert the image from its native format to RGB
-          sws_scale
-          (
-              swsCtx,
-              pFrame->data,
-              pFrame->linesize,
-              0,
-              pCodecCtx->height,
-              pFrameYUV->data,
-              pFrameYUV->linesize
-          );
+          if (!texture || format != textureFormat)
+          {
+            if (texture)
+              SDL_DestroyTexture(texture);
+            texture = SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STREAMING, pCodecCtx->width, pCodecCtx->height);
+            if (!texture)
+            {
+              fprintf(stderr, "SDL: could not create SDL texture - %s\n", SDL_GetError());
+              return -1;
+            }
+            textureFormat = format;
+          }
 
          // SDL_UnlockYUVOverlay(bmp);
 
@@ -222,10 +370,15 @@ int main(int argc, char *argv[])
           rect.h = pCodecCtx->height;
           // SDL_DisplayYUVOverlay(bmp, &rect);
 
-          SDL_UpdateTexture(texture, NULL, pFrameYUV->data[0], pFrameYUV->linesize[0]);
+          upload_frame(texture, textureFormat, pShown);
           SDL_RenderClear(renderer);
           SDL_RenderCopy(renderer, texture, NULL, &rect);
           SDL_RenderPresent(renderer);
+
+          // Hand the buffer back to the pool for the next frame
+          av_frame_unref(pFrameYUV);
+          if (++frames % 500 == 0)
+            fprintf(stderr, "%d frames, peak RSS %ld KB\n", frames, peak_rss());
         }
       }
 
@@ -244,11 +397,16 @@ int main(int argc, char *argv[])
     }
   }
 
+  fprintf(stderr, "%d frames processed, peak RSS %ld KB\n", frames, peak_rss());
+
   sws_freeContext(swsCtx);
+  if (texture)
+    SDL_DestroyTexture(texture);
 
   // Free the YUV frame
   av_frame_free(&pFrame);
   av_frame_free(&pFrameYUV);
+  av_buffer_pool_uninit(&yuvPool.pool);
 
   // Close the codec
   avcodec_free_context(&pCodecCtx);
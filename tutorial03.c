@@ -54,14 +54,25 @@ int packet_queue_put(PacketQueue *q, AVPacket *pkt)
 {
 
   AVPacketList *pkt1;
-  if (av_dup_packet(pkt) < 0)
-  {
-    return -1;
-  }
   pkt1 = av_malloc(sizeof(AVPacketList));
   if (!pkt1)
     return -1;
-  pkt1->pkt = *pkt;
+  // Take over the caller's reference, leaving pkt blank, so the payload
+  // goes on to the decoder as it is. Only a payload the demuxer still
+  // owns has to be copied.
+  if (pkt->buf || !pkt->data)
+  {
+    av_packet_move_ref(&pkt1->pkt, pkt);
+  }
+  else
+  {
+    if (av_packet_ref(&pkt1->pkt, pkt) < 0)
+    {
+      av_free(pkt1);
+      return -1;
+    }
+    av_packet_unref(pkt);
+  }
   pkt1->next = NULL;
 
   SDL_LockMutex(q->mutex);
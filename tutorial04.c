@@ -29,13 +29,27 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "fast_convert.h"
 
 #define SDL_AUDIO_BUFFER_SIZE 1024
 #define MAX_AUDIO_FRAME_SIZE 192000
 
-#define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
-#define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
+/* Each packet queue holds up to this much playing time. The byte limit
+   only matters for streams whose packets carry no duration. */
+#define MAX_QUEUE_DURATION (2 * AV_TIME_BASE)
+#define MAX_QUEUE_SIZE (16 * 1024 * 1024)
+/* Packets go through the queues in batches of up to this many, one lock
+   per batch; the demuxer holds back at most PACKET_BATCH_DURATION of
+   each stream to make up a batch. */
+#define PACKET_BATCH_SIZE 16
+#define PACKET_BATCH_DURATION (AV_TIME_BASE / 5)
 
 #define FF_ALLOC_EVENT (SDL_USEREVENT)
 #define FF_REFRESH_EVENT (SDL_USEREVENT + 1)
@@ -43,23 +57,62 @@
 
 #define VIDEO_PICTURE_QUEUE_SIZE 1
 
+#define WRITER_THREADS 4
+#define WRITER_QUEUE_SIZE 8
+#ifndef IOV_MAX
+#define IOV_MAX 1024 /* the usual limit where <limits.h> doesn't say */
+#endif
+
 typedef struct PacketQueue
 {
   AVPacketList *first_pkt, *last_pkt;
   int nb_packets;
   int size;
+  int64_t duration; /* of the queued packets, in AV_TIME_BASE units */
+  AVRational time_base; /* of the packets' timestamps and durations */
   SDL_mutex *mutex;
   SDL_cond *cond;
+  SDL_cond *not_full; /* signalled when a get makes room */
 } PacketQueue;
 
+/* Packets the demuxer has read for one queue but not put yet */
+typedef struct PacketBatch
+{
+  AVPacket pkts[PACKET_BATCH_SIZE];
+  int nb_packets;
+  int64_t duration; /* in AV_TIME_BASE units */
+} PacketBatch;
+
 typedef struct VideoPicture
 {
   //   SDL_Overlay *bmp;
   AVFrame *pFrameYUV;
+  AVFrame *frame;    /* decoded frame held by reference when SDL can show it as is */
+  int direct;        /* 1 if frame is shown, 0 if pFrameYUV is */
   int width, height; /* source height & width */
   int allocated;
 } VideoPicture;
 
+/* A frame waiting to be written out by the writer pool, in whatever
+   format it was shown in */
+typedef struct WriteJob
+{
+  AVFrame *frame;
+  int index;
+} WriteJob;
+
+/* Threads that save frames to disk off the display thread. At most
+   WRITER_QUEUE_SIZE frames wait; past that writer_pool_submit blocks. */
+typedef struct WriterPool
+{
+  SDL_Thread *threads[WRITER_THREADS];
+  WriteJob jobs[WRITER_QUEUE_SIZE];
+  int head, count;
+  int done;
+  SDL_mutex *mutex;
+  SDL_cond *not_empty, *not_full;
+} WriterPool;
+
 typedef struct VideoState
 {
 
@@ -71,9 +124,8 @@ typedef struct VideoState
   unsigned int audio_buf_size;
   unsigned int audio_buf_index;
   AVFrame audio_frame;
-  AVPacket audio_pkt;
-  uint8_t *audio_pkt_data;
-  int audio_pkt_size;
+  AVPacket audio_pkts[PACKET_BATCH_SIZE]; /* taken off audioq, not decoded yet */
+  int audio_pkts_nb, audio_pkts_index;
   AVStream *video_st;
   PacketQueue videoq;
 
@@ -88,6 +140,8 @@ typedef struct VideoState
   SDL_Renderer *renderer;
   SDL_Texture *texture;
 
+  WriterPool writers;
+
   char filename[1024];
   int quit;
 
@@ -102,41 +156,116 @@ SDL_Window *screen;
    can be global in case we need it. */
 VideoState *global_video_state;
 
-void packet_queue_init(PacketQueue *q)
+/* Decoder threading from -threads/-thread_type. 0 threads means one
+   per core; the type is any mix of FF_THREAD_FRAME and FF_THREAD_SLICE. */
+int decoder_thread_count = 0;
+int decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+void packet_queue_init(PacketQueue *q, AVRational time_base)
 {
   memset(q, 0, sizeof(PacketQueue));
+  q->time_base = time_base;
   q->mutex = SDL_CreateMutex();
   q->cond = SDL_CreateCond();
+  q->not_full = SDL_CreateCond();
 }
-int packet_queue_put(PacketQueue *q, AVPacket *pkt)
+/* pkt's duration in AV_TIME_BASE units */
+int64_t packet_queue_pkt_duration(PacketQueue *q, AVPacket *pkt)
 {
-
-  AVPacketList *pkt1;
-  if (av_dup_packet(pkt) < 0)
+  return av_rescale_q(pkt->duration, q->time_base, AV_TIME_BASE_Q);
+}
+/* Whether the demuxer should stop reading for now. Called with q->mutex
+   held. */
+int packet_queue_full(PacketQueue *q)
+{
+  return q->duration > MAX_QUEUE_DURATION || q->size > MAX_QUEUE_SIZE;
+}
+/* Take over pkt's reference, leaving pkt blank, so the payload goes on
+   to the decoder as it is; only a payload the demuxer still owns has
+   to be copied. */
+int packet_take_ref(AVPacket *dst, AVPacket *pkt)
+{
+  if (pkt->buf || !pkt->data)
   {
-    return -1;
+    av_packet_move_ref(dst, pkt);
+    return 0;
   }
-  pkt1 = av_malloc(sizeof(AVPacketList));
-  if (!pkt1)
+  if (av_packet_ref(dst, pkt) < 0)
+  {
     return -1;
-  pkt1->pkt = *pkt;
-  pkt1->next = NULL;
+  }
+  av_packet_unref(pkt);
+  return 0;
+}
+/* Move pkts[0..n-1] into q under one lock, leaving them blank. On
+   failure the caller still has to unref them. */
+int packet_queue_put_batch(PacketQueue *q, AVPacket *pkts, int n)
+{
+
+  AVPacketList *first = NULL, *last = NULL, *pkt1;
+  int64_t duration = 0;
+  int i, size = 0;
+
+  /* build the chain before taking the lock */
+  for (i = 0; i < n; i++)
+  {
+    pkt1 = av_malloc(sizeof(AVPacketList));
+    if (!pkt1)
+      goto fail;
+    if (packet_take_ref(&pkt1->pkt, &pkts[i]) < 0)
+    {
+      av_free(pkt1);
+      goto fail;
+    }
+    pkt1->next = NULL;
+    if (!last)
+      first = pkt1;
+    else
+      last->next = pkt1;
+    last = pkt1;
+    size += pkt1->pkt.size;
+    duration += packet_queue_pkt_duration(q, &pkt1->pkt);
+  }
+  if (!first)
+  {
+    return 0;
+  }
 
   SDL_LockMutex(q->mutex);
 
   if (!q->last_pkt)
-    q->first_pkt = pkt1;
+    q->first_pkt = first;
   else
-    q->last_pkt->next = pkt1;
-  q->last_pkt = pkt1;
-  q->nb_packets++;
-  q->size += pkt1->pkt.size;
+    q->last_pkt->next = first;
+  q->last_pkt = last;
+  q->nb_packets += n;
+  q->size += size;
+  q->duration += duration;
+  /* the only consumer waits for the queue to be non-empty, under the
+     mutex, so one signal for the whole batch can't be lost */
   SDL_CondSignal(q->cond);
 
   SDL_UnlockMutex(q->mutex);
   return 0;
+
+fail:
+  while (first)
+  {
+    pkt1 = first;
+    first = first->next;
+    av_packet_unref(&pkt1->pkt);
+    av_free(pkt1);
+  }
+  return -1;
 }
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
+int packet_queue_put(PacketQueue *q, AVPacket *pkt)
+{
+  return packet_queue_put_batch(q, pkt, 1);
+}
+/* Move up to max packets out of q under one lock. If block is set,
+   waits until there is at least one, but never for more. Returns the
+   number of packets, 0 if there were none, or -1 when quitting. */
+static int packet_queue_get_batch(PacketQueue *q, AVPacket *pkts, int max, int block)
 {
   AVPacketList *pkt1;
   int ret;
@@ -152,17 +281,24 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
       break;
     }
 
-    pkt1 = q->first_pkt;
-    if (pkt1)
+    if (q->first_pkt)
     {
-      q->first_pkt = pkt1->next;
+      for (ret = 0; ret < max && q->first_pkt; ret++)
+      {
+        pkt1 = q->first_pkt;
+        q->first_pkt = pkt1->next;
+        q->nb_packets--;
+        q->size -= pkt1->pkt.size;
+        q->duration -= packet_queue_pkt_duration(q, &pkt1->pkt);
+        pkts[ret] = pkt1->pkt;
+        av_free(pkt1);
+      }
       if (!q->first_pkt)
         q->last_pkt = NULL;
-      q->nb_packets--;
-      q->size -= pkt1->pkt.size;
-      *pkt = pkt1->pkt;
-      av_free(pkt1);
-      ret = 1;
+      /* the demuxer checks packet_queue_full under the mutex before it
+         sleeps, so one signal for the whole batch can't be lost */
+      if (!packet_queue_full(q))
+        SDL_CondSignal(q->not_full);
       break;
     }
     else if (!block)
@@ -179,58 +315,133 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
   return ret;
 }
 
+/* Block the demuxer until q has room, without polling. Returns -1 when
+   quitting. */
+int packet_queue_wait_space(PacketQueue *q)
+{
+  SDL_LockMutex(q->mutex);
+  while (packet_queue_full(q) && !global_video_state->quit)
+  {
+    SDL_CondWait(q->not_full, q->mutex);
+  }
+  SDL_UnlockMutex(q->mutex);
+  return global_video_state->quit ? -1 : 0;
+}
+
+/* Wake up both sides when quitting. The mutex is held so that a thread
+   between checking quit and waiting can't miss the wakeup. */
+void packet_queue_abort(PacketQueue *q)
+{
+  SDL_LockMutex(q->mutex);
+  SDL_CondBroadcast(q->cond);
+  SDL_CondBroadcast(q->not_full);
+  SDL_UnlockMutex(q->mutex);
+}
+
+/* Queue an empty packet, which tells the decoder reading q that the
+   file has ended and it should hand out the frames it is still holding. */
+int packet_queue_put_nullpacket(PacketQueue *q, int stream_index)
+{
+  AVPacket pkt1, *pkt = &pkt1;
+
+  av_init_packet(pkt);
+  pkt->data = NULL;
+  pkt->size = 0;
+  pkt->stream_index = stream_index;
+  return packet_queue_put(q, pkt);
+}
+
+/* Hold pkt back for q until packet_batch_flush, taking over its
+   reference. The batch must not be full. */
+int packet_batch_add(PacketQueue *q, PacketBatch *b, AVPacket *pkt)
+{
+  AVPacket *dst = &b->pkts[b->nb_packets];
+
+  /* a payload the demuxer still owns would not survive the next read */
+  if (packet_take_ref(dst, pkt) < 0)
+  {
+    av_packet_unref(pkt);
+    return -1;
+  }
+  b->nb_packets++;
+  b->duration += packet_queue_pkt_duration(q, dst);
+  return 0;
+}
+
+/* Whether b should go into its queue before another packet is read */
+int packet_batch_due(PacketBatch *b)
+{
+  return b->nb_packets == PACKET_BATCH_SIZE ||
+         b->duration >= PACKET_BATCH_DURATION;
+}
+
+int packet_batch_flush(PacketQueue *q, PacketBatch *b)
+{
+  int i, ret;
+
+  ret = packet_queue_put_batch(q, b->pkts, b->nb_packets);
+  if (ret < 0)
+  {
+    for (i = 0; i < b->nb_packets; i++)
+    {
+      av_packet_unref(&b->pkts[i]);
+    }
+  }
+  b->nb_packets = 0;
+  b->duration = 0;
+  return ret;
+}
+
 int audio_decode_frame(VideoState *is)
 {
-  int len1, data_size = 0;
-  AVPacket *pkt = &is->audio_pkt;
+  int data_size;
+  AVPacket *pkt;
+  AVCodecContext *codecCtx = is->audio_st->codec;
 
   for (;;)
   {
-    while (is->audio_pkt_size > 0)
+    /* a packet can hold several frames: hand them all out before
+       sending the decoder another one */
+    while (avcodec_receive_frame(codecCtx, &is->audio_frame) == 0)
     {
-      int got_frame = 0;
-      len1 = avcodec_decode_audio4(is->audio_st->codec, &is->audio_frame, &got_frame, pkt);
-      if (len1 < 0)
-      {
-        /* if error, skip frame */
-        is->audio_pkt_size = 0;
-        break;
-      }
-      if (got_frame)
-      {
-        data_size =
-            av_samples_get_buffer_size(
-                NULL,
-                is->audio_st->codec->channels,
-                is->audio_frame.nb_samples,
-                is->audio_st->codec->sample_fmt,
-                1);
-        memcpy(is->audio_buf, is->audio_frame.data[0], data_size);
-      }
-      is->audio_pkt_data += len1;
-      is->audio_pkt_size -= len1;
+      data_size =
+          av_samples_get_buffer_size(
+              NULL,
+              codecCtx->channels,
+              is->audio_frame.nb_samples,
+              codecCtx->sample_fmt,
+              1);
       if (data_size <= 0)
       {
         /* No data yet, get more frames */
         continue;
       }
+      memcpy(is->audio_buf, is->audio_frame.data[0], data_size);
       /* We have data, return it and come back for more later */
       return data_size;
     }
-    if (pkt->data)
-      av_free_packet(pkt);
 
     if (is->quit)
     {
       return -1;
     }
-    /* next packet */
-    if (packet_queue_get(&is->audioq, pkt, 1) < 0)
+    /* next packet, taking a new batch when the last one is used up */
+    if (is->audio_pkts_index == is->audio_pkts_nb)
     {
-      return -1;
+      is->audio_pkts_nb = packet_queue_get_batch(&is->audioq, is->audio_pkts,
+                                                 PACKET_BATCH_SIZE, 1);
+      is->audio_pkts_index = 0;
+      if (is->audio_pkts_nb < 0)
+      {
+        is->audio_pkts_nb = 0;
+        return -1;
+      }
     }
-    is->audio_pkt_data = pkt->data;
-    is->audio_pkt_size = pkt->size;
+    pkt = &is->audio_pkts[is->audio_pkts_index++];
+    /* an empty packet means end of file: drain the decoder. A packet the
+       decoder rejects is skipped. */
+    avcodec_send_packet(codecCtx, pkt->data ? pkt : NULL);
+    av_free_packet(pkt);
   }
 }
 
@@ -284,6 +495,260 @@ static void schedule_refresh(VideoState *is, int delay)
   SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
 }
 
+/* writev() everything in iov, going around again on short writes */
+int write_all(int fd, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0)
+  {
+    int n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+    ssize_t written = writev(fd, iov, n);
+    if (written < 0)
+      return -1;
+    while (n > 0 && written >= (ssize_t)iov->iov_len)
+    {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+      n--;
+    }
+    if (n > 0)
+    {
+      iov->iov_base = (uint8_t *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+void SaveFrame(AVFrame *pFrame, int width, int height, int iFrame)
+{
+  char szFilename[32];
+  char szHeader[32];
+  struct iovec *iov;
+  int fd;
+  int y;
+
+  // Open file
+  sprintf(szFilename, "pic/frame%d.ppm", iFrame);
+  fd = open(szFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return;
+
+  iov = av_malloc_array(height + 1, sizeof(struct iovec));
+  if (iov == NULL)
+  {
+    close(fd);
+    return;
+  }
+
+  // Header
+  iov[0].iov_base = szHeader;
+  iov[0].iov_len = sprintf(szHeader, "P6\n%d %d\n255\n", width, height);
+
+  // Pixel data, one entry per row, all written in a single writev
+  for (y = 0; y < height; y++)
+  {
+    iov[y + 1].iov_base = pFrame->data[0] + y * pFrame->linesize[0];
+    iov[y + 1].iov_len = width * 3;
+  }
+  write_all(fd, iov, height + 1);
+
+  // Close file
+  av_free(iov);
+  close(fd);
+}
+
+/* Convert frame to RGB24 at its own size into rgb, which is only
+   reallocated when that size changes */
+int frame_to_rgb(struct SwsContext **sws_ctx, AVFrame *frame, AVFrame *rgb)
+{
+  if (rgb->width != frame->width || rgb->height != frame->height)
+  {
+    av_frame_unref(rgb);
+    rgb->format = AV_PIX_FMT_RGB24;
+    rgb->width = frame->width;
+    rgb->height = frame->height;
+    if (av_frame_get_buffer(rgb, 32) < 0)
+    {
+      return -1;
+    }
+  }
+  *sws_ctx = sws_getCachedContext(*sws_ctx, frame->width, frame->height, frame->format,
+                                  frame->width, frame->height, AV_PIX_FMT_RGB24,
+                                  SWS_BILINEAR, NULL, NULL, NULL);
+  if (!*sws_ctx)
+  {
+    return -1;
+  }
+  sws_scale(*sws_ctx, (uint8_t const *const *)frame->data, frame->linesize,
+            0, frame->height, rgb->data, rgb->linesize);
+  return 0;
+}
+
+int writer_thread(void *arg)
+{
+  WriterPool *pool = (WriterPool *)arg;
+  WriteJob job;
+  /* each writer converts to RGB with its own context and buffer */
+  struct SwsContext *sws_ctx = NULL;
+  AVFrame *rgb = av_frame_alloc();
+
+  for (;;)
+  {
+    SDL_LockMutex(pool->mutex);
+    while (pool->count == 0 && !pool->done)
+    {
+      SDL_CondWait(pool->not_empty, pool->mutex);
+    }
+    if (pool->count == 0)
+    {
+      /* done and nothing left to write */
+      SDL_UnlockMutex(pool->mutex);
+      break;
+    }
+    job = pool->jobs[pool->head];
+    pool->head = (pool->head + 1) % WRITER_QUEUE_SIZE;
+    pool->count--;
+    SDL_CondSignal(pool->not_full);
+    SDL_UnlockMutex(pool->mutex);
+
+    if (rgb && frame_to_rgb(&sws_ctx, job.frame, rgb) == 0)
+    {
+      SaveFrame(rgb, rgb->width, rgb->height, job.index);
+    }
+    av_frame_free(&job.frame);
+  }
+  av_frame_free(&rgb);
+  sws_freeContext(sws_ctx);
+  return 0;
+}
+
+int writer_pool_init(WriterPool *pool)
+{
+  int i;
+
+  memset(pool, 0, sizeof(WriterPool));
+  pool->mutex = SDL_CreateMutex();
+  pool->not_empty = SDL_CreateCond();
+  pool->not_full = SDL_CreateCond();
+  for (i = 0; i < WRITER_THREADS; i++)
+  {
+    pool->threads[i] = SDL_CreateThread(writer_thread, "Writer Thread", pool);
+    if (!pool->threads[i])
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Queue a new reference to pFrame to be saved as frame number iFrame.
+   The caller keeps its own reference. pFrame has to be refcounted so
+   that this never copies the picture on the display thread. */
+int writer_pool_submit(WriterPool *pool, AVFrame *pFrame, int iFrame)
+{
+  WriteJob *job;
+  AVFrame *frame;
+
+  if (!pFrame->buf[0])
+  {
+    return -1;
+  }
+  frame = av_frame_clone(pFrame);
+  if (!frame)
+  {
+    return -1;
+  }
+  SDL_LockMutex(pool->mutex);
+  while (pool->count == WRITER_QUEUE_SIZE)
+  {
+    SDL_CondWait(pool->not_full, pool->mutex);
+  }
+  job = &pool->jobs[(pool->head + pool->count) % WRITER_QUEUE_SIZE];
+  job->frame = frame;
+  job->index = iFrame;
+  pool->count++;
+  SDL_CondSignal(pool->not_empty);
+  SDL_UnlockMutex(pool->mutex);
+  return 0;
+}
+
+/* Write out whatever is still queued and stop the threads */
+void writer_pool_destroy(WriterPool *pool)
+{
+  int i;
+
+  SDL_LockMutex(pool->mutex);
+  pool->done = 1;
+  SDL_CondBroadcast(pool->not_empty);
+  SDL_UnlockMutex(pool->mutex);
+  for (i = 0; i < WRITER_THREADS; i++)
+  {
+    if (pool->threads[i])
+    {
+      SDL_WaitThread(pool->threads[i], NULL);
+    }
+  }
+  SDL_DestroyCond(pool->not_full);
+  SDL_DestroyCond(pool->not_empty);
+  SDL_DestroyMutex(pool->mutex);
+}
+
+/* The SDL texture format that can take the planes of a decoded frame
+   as they are, or SDL_PIXELFORMAT_UNKNOWN if it has to be converted. */
+Uint32 sdl_texture_format(int pix_fmt)
+{
+  switch (pix_fmt)
+  {
+  case AV_PIX_FMT_YUV420P:
+  case AV_PIX_FMT_YUVJ420P:
+    return SDL_PIXELFORMAT_IYUV;
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+  case AV_PIX_FMT_NV12:
+    return SDL_PIXELFORMAT_NV12;
+#endif
+  default:
+    return SDL_PIXELFORMAT_UNKNOWN;
+  }
+}
+
+/* Upload every plane of the frame, recreating the texture first if the
+   format changed. Called from the main thread only. */
+int upload_frame(VideoState *is, AVFrame *frame, Uint32 format)
+{
+  Uint32 texture_format = SDL_PIXELFORMAT_UNKNOWN;
+
+  if (is->texture)
+  {
+    SDL_QueryTexture(is->texture, &texture_format, NULL, NULL, NULL);
+  }
+  if (texture_format != format)
+  {
+    if (is->texture)
+    {
+      SDL_DestroyTexture(is->texture);
+    }
+    is->texture = SDL_CreateTexture(is->renderer, format, SDL_TEXTUREACCESS_STREAMING,
+                                    is->video_st->codec->width, is->video_st->codec->height);
+    if (!is->texture)
+    {
+      return -1;
+    }
+  }
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+  if (format == SDL_PIXELFORMAT_NV12)
+  {
+    return SDL_UpdateNVTexture(is->texture, NULL,
+                               frame->data[0], frame->linesize[0],
+                               frame->data[1], frame->linesize[1]);
+  }
+#endif
+  return SDL_UpdateYUVTexture(is->texture, NULL,
+                              frame->data[0], frame->linesize[0],
+                              frame->data[1], frame->linesize[1],
+                              frame->data[2], frame->linesize[2]);
+}
+
 int i = 0;
 void video_display(VideoState *is)
 {
@@ -291,12 +756,24 @@ void video_display(VideoState *is)
   SDL_Rect rect;
   VideoPicture *vp;
   // AVPicture pict;
+  AVFrame *frame;
+  Uint32 format;
   float aspect_ratio;
   int w, h, x, y;
   // int i;
 
   vp = &is->pictq[is->pictq_rindex];
-  if (vp->pFrameYUV)
+  if (vp->direct)
+  {
+    frame = vp->frame;
+    format = sdl_texture_format(frame->format);
+  }
+  else
+  {
+    frame = vp->pFrameYUV;
+    format = SDL_PIXELFORMAT_IYUV;
+  }
+  if (frame)
   {
     if (is->video_st->codec->sample_aspect_ratio.num == 0)
     {
@@ -314,7 +791,7 @@ void video_display(VideoState *is)
     }
     SDL_GetWindowSize(screen, &w, &h);
     if (++i < 1000)
-      SaveFrame(vp->pFrameYUV, w, h, i);
+      writer_pool_submit(&is->writers, frame, i);
     // h = screen->h;
     w = ((int)rint(h * aspect_ratio)) & -3;
     // if(w > screen->w) {
@@ -332,10 +809,10 @@ void video_display(VideoState *is)
     rect.h = h;
     // SDL_DisplayYUVOverlay(vp->bmp, &rect);
     int ret;
-    ret = SDL_UpdateTexture(is->texture, NULL, vp->pFrameYUV->data[0], vp->pFrameYUV->linesize[0]);
+    ret = upload_frame(is, frame, format);
     if (ret < 0)
     {
-      printf("++++ SDL_UpdateTexture failed : - %s\n", SDL_GetError());
+      printf("++++ upload_frame failed : - %s\n", SDL_GetError());
     }
     ret = SDL_RenderClear(is->renderer);
     if (ret < 0)
@@ -396,6 +873,17 @@ void video_refresh_timer(void *userdata)
   }
 }
 
+/* Give vp->pFrameYUV buffers of its own. They are refcounted so that
+   the writer pool can hold on to a picture with just a reference. */
+int picture_buffer_alloc(VideoPicture *vp)
+{
+  av_frame_unref(vp->pFrameYUV);
+  vp->pFrameYUV->format = AV_PIX_FMT_YUV420P;
+  vp->pFrameYUV->width = vp->width;
+  vp->pFrameYUV->height = vp->height;
+  return av_frame_get_buffer(vp->pFrameYUV, 32);
+}
+
 void alloc_picture(void *userdata)
 {
 
@@ -407,7 +895,7 @@ void alloc_picture(void *userdata)
   {
     // we already have one make another, bigger/smaller
     // SDL_FreeYUVOverlay(vp->bmp);
-    av_frame_free(vp->pFrameYUV);
+    av_frame_free(&vp->pFrameYUV);
   }
   // Allocate a place to put our YUV image on that screen
   //   vp->bmp = SDL_CreateYUVOverlay(is->video_st->codec->width,
@@ -418,14 +906,11 @@ void alloc_picture(void *userdata)
   vp->width = is->video_st->codec->width;
   vp->height = is->video_st->codec->height;
   vp->pFrameYUV = av_frame_alloc();
-  av_image_fill_arrays(
-      vp->pFrameYUV->data,
-      vp->pFrameYUV->linesize,
-      (uint8_t const *const *)av_malloc(av_image_get_buffer_size(AV_PIX_FMT_YUV420P, vp->width, vp->height, 1)),
-      AV_PIX_FMT_YUV420P,
-      vp->width,
-      vp->height,
-      1);
+  if (vp->pFrameYUV && picture_buffer_alloc(vp) < 0)
+  {
+    fprintf(stderr, "Could not allocate picture\n");
+    av_frame_free(&vp->pFrameYUV);
+  }
 
   SDL_LockMutex(is->pictq_mutex);
   vp->allocated = 1;
@@ -454,6 +939,31 @@ int queue_picture(VideoState *is, AVFrame *pFrame)
   // windex is set to 0 initially
   vp = &is->pictq[is->pictq_windex];
 
+  /* yuv420p and nv12 are handed to the display as they came out of the
+     decoder: no conversion and no copy, just a reference to the frame */
+  if (sdl_texture_format(pFrame->format) != SDL_PIXELFORMAT_UNKNOWN)
+  {
+    if (!vp->frame)
+    {
+      vp->frame = av_frame_alloc();
+      if (!vp->frame)
+      {
+        return -1;
+      }
+    }
+    av_frame_unref(vp->frame);
+    av_frame_move_ref(vp->frame, pFrame);
+    vp->direct = 1;
+    if (++is->pictq_windex == VIDEO_PICTURE_QUEUE_SIZE)
+    {
+      is->pictq_windex = 0;
+    }
+    SDL_LockMutex(is->pictq_mutex);
+    is->pictq_size++;
+    SDL_UnlockMutex(is->pictq_mutex);
+    return 0;
+  }
+
   /* allocate or resize the buffer! */
   if (!vp->pFrameYUV ||
       vp->width != is->video_st->codec->width ||
@@ -496,15 +1006,50 @@ int queue_picture(VideoState *is, AVFrame *pFrame)
     // pict.linesize[1] = vp->bmp->pitches[2];
     // pict.linesize[2] = vp->bmp->pitches[1];
 
-    // Convert the image into YUV format that SDL uses
-    sws_scale(
-        is->sws_ctx,
-        (uint8_t const *const *)pFrame->data,
-        pFrame->linesize,
-        0,
-        is->video_st->codec->height,
-        vp->pFrameYUV->data,
-        vp->pFrameYUV->linesize);
+    /* the writer pool may still hold the last picture converted into
+       these buffers: leave that one to it and convert into new ones */
+    if (!av_frame_is_writable(vp->pFrameYUV) && picture_buffer_alloc(vp) < 0)
+    {
+      fprintf(stderr, "Could not allocate picture\n");
+      return -1;
+    }
+
+    // Convert the image into YUV format that SDL uses. nv12, which only
+    // gets here on SDL before 2.0.16, has a kernel of its own.
+    if (fast_convert_supported(pFrame, vp->pFrameYUV))
+    {
+      fast_convert_frame(pFrame, vp->pFrameYUV, 0, pFrame->height);
+    }
+    else
+    {
+      is->sws_ctx =
+          sws_getCachedContext(
+              is->sws_ctx,
+              pFrame->width,
+              pFrame->height,
+              pFrame->format,
+              is->video_st->codec->width,
+              is->video_st->codec->height,
+              AV_PIX_FMT_YUV420P,
+              SWS_BILINEAR,
+              NULL,
+              NULL,
+              NULL);
+      if (!is->sws_ctx)
+      {
+        fprintf(stderr, "Could not initialize the conversion context\n");
+        return -1;
+      }
+      sws_scale(
+          is->sws_ctx,
+          (uint8_t const *const *)pFrame->data,
+          pFrame->linesize,
+          0,
+          is->video_st->codec->height,
+          vp->pFrameYUV->data,
+          vp->pFrameYUV->linesize);
+    }
+    vp->direct = 0;
 
     // SDL_UnlockYUVOverlay(vp->bmp);
     /* now we inform our display thread that we have a pic ready */
@@ -522,34 +1067,49 @@ int queue_picture(VideoState *is, AVFrame *pFrame)
 int video_thread(void *arg)
 {
   VideoState *is = (VideoState *)arg;
-  AVPacket pkt1, *packet = &pkt1;
-  int frameFinished;
+  AVPacket pkts[PACKET_BATCH_SIZE], *packet;
+  AVCodecContext *codecCtx = is->video_st->codec;
   AVFrame *pFrame;
+  int nb_pkts = 0, i = 0;
 
   pFrame = av_frame_alloc();
 
   for (;;)
   {
-    if (packet_queue_get(&is->videoq, packet, 1) < 0)
+    // Take every packet waiting, up to a batch, and then decode them
+    if (i == nb_pkts)
     {
-      // means we quit getting packets
-      break;
+      nb_pkts = packet_queue_get_batch(&is->videoq, pkts, PACKET_BATCH_SIZE, 1);
+      i = 0;
+      if (nb_pkts < 0)
+      {
+        // means we quit getting packets
+        break;
+      }
     }
-    // Decode video frame
-    avcodec_decode_video2(is->video_st->codec, pFrame, &frameFinished,
-                          packet);
+    packet = &pkts[i++];
+    // Decode video frame; an empty packet means end of file and drains
+    // the decoder
+    avcodec_send_packet(codecCtx, packet->data ? packet : NULL);
+    av_free_packet(packet);
 
-    // Did we get a video frame?
-    if (frameFinished)
+    // Take every frame the decoder has ready
+    while (avcodec_receive_frame(codecCtx, pFrame) == 0)
     {
       if (queue_picture(is, pFrame) < 0)
       {
-        break;
+        goto quit;
       }
+      /* drop our reference unless the queue took it */
+      av_frame_unref(pFrame);
     }
-    av_free_packet(packet);
   }
-  av_free(pFrame);
+quit:
+  while (i < nb_pkts)
+  {
+    av_free_packet(&pkts[i++]);
+  }
+  av_frame_free(&pFrame);
   return 0;
 }
 
@@ -587,6 +1147,11 @@ int stream_component_open(VideoState *is, int stream_index)
       return -1;
     }
   }
+  if (codecCtx->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    codecCtx->thread_count = decoder_thread_count;
+    codecCtx->thread_type = decoder_thread_type;
+  }
   codec = avcodec_find_decoder(codecCtx->codec_id);
   if (!codec || (avcodec_open2(codecCtx, codec, &optionsDict) < 0))
   {
@@ -601,28 +1166,17 @@ int stream_component_open(VideoState *is, int stream_index)
     is->audio_st = pFormatCtx->streams[stream_index];
     is->audio_buf_size = 0;
     is->audio_buf_index = 0;
-    memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
-    packet_queue_init(&is->audioq);
+    is->audio_pkts_nb = 0;
+    is->audio_pkts_index = 0;
+    packet_queue_init(&is->audioq, is->audio_st->time_base);
     SDL_PauseAudio(0);
     break;
   case AVMEDIA_TYPE_VIDEO:
     is->videoStream = stream_index;
     is->video_st = pFormatCtx->streams[stream_index];
 
-    packet_queue_init(&is->videoq);
+    packet_queue_init(&is->videoq, is->video_st->time_base);
     is->video_tid = SDL_CreateThread(video_thread, "Video Thread", is);
-    is->sws_ctx =
-        sws_getContext(
-            is->video_st->codec->width,
-            is->video_st->codec->height,
-            is->video_st->codec->pix_fmt,
-            is->video_st->codec->width,
-            is->video_st->codec->height,
-            AV_PIX_FMT_YUV420P,
-            SWS_BILINEAR,
-            NULL,
-            NULL,
-            NULL);
     screen = SDL_CreateWindow("tutorial04", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, codecCtx->width, codecCtx->height, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
     if (!screen)
     {
@@ -659,11 +1213,16 @@ int decode_thread(void *arg)
   VideoState *is = (VideoState *)arg;
   AVFormatContext *pFormatCtx = NULL;
   AVPacket pkt1, *packet = &pkt1;
+  PacketBatch audio_batch, video_batch; /* read but not queued yet */
 
   int video_index = -1;
   int audio_index = -1;
+  int eof = 0; /* end of file reached and the decoders told so */
   int i;
 
+  memset(&audio_batch, 0, sizeof(audio_batch));
+  memset(&video_batch, 0, sizeof(video_batch));
+
   AVDictionary *io_dict = NULL;
   AVIOInterruptCB callback;
 
@@ -732,16 +1291,31 @@ int decode_thread(void *arg)
       break;
     }
     // seek stuff goes here
-    if (is->audioq.size > MAX_AUDIOQ_SIZE ||
-        is->videoq.size > MAX_VIDEOQ_SIZE)
+    if (packet_batch_due(&audio_batch) || packet_batch_due(&video_batch))
     {
-      SDL_Delay(10);
-      continue;
+      /* queue what is held back of both streams, so neither decoder
+         runs dry while we sleep, then sleep until both queues have
+         room; the decoders wake us */
+      packet_batch_flush(&is->audioq, &audio_batch);
+      packet_batch_flush(&is->videoq, &video_batch);
+      if (packet_queue_wait_space(&is->audioq) < 0 ||
+          packet_queue_wait_space(&is->videoq) < 0)
+      {
+        break;
+      }
     }
     if (av_read_frame(is->pFormatCtx, packet) < 0)
     {
       if (is->pFormatCtx->pb->error == 0)
       {
+        if (!eof)
+        {
+          packet_batch_flush(&is->audioq, &audio_batch);
+          packet_batch_flush(&is->videoq, &video_batch);
+          packet_queue_put_nullpacket(&is->videoq, is->videoStream);
+          packet_queue_put_nullpacket(&is->audioq, is->audioStream);
+          eof = 1;
+        }
         SDL_Delay(100); /* no error; wait for user input */
         continue;
       }
@@ -753,11 +1327,11 @@ int decode_thread(void *arg)
     // Is this a packet from the video stream?
     if (packet->stream_index == is->videoStream)
     {
-      packet_queue_put(&is->videoq, packet);
+      packet_batch_add(&is->videoq, &video_batch, packet);
     }
     else if (packet->stream_index == is->audioStream)
     {
-      packet_queue_put(&is->audioq, packet);
+      packet_batch_add(&is->audioq, &audio_batch, packet);
     }
     else
     {
@@ -781,27 +1355,15 @@ fail:
   return 0;
 }
 
-void SaveFrame(AVFrame *pFrame, int width, int height, int iFrame)
+int parse_thread_type(const char *name)
 {
-  FILE *pFile;
-  char szFilename[32];
-  int y;
-
-  // Open file
-  sprintf(szFilename, "pic/frame%d.ppm", iFrame);
-  pFile = fopen(szFilename, "wb");
-  if (pFile == NULL)
-    return;
-
-  // Write header
-  fprintf(pFile, "P6\n%d %d\n255\n", width, height);
-
-  // Write pixel data
-  for (y = 0; y < height; y++)
-    fwrite(pFrame->data[0] + y * pFrame->linesize[0], 1, width * 3, pFile);
-
-  // Close file
-  fclose(pFile);
+  if (!strcmp(name, "frame"))
+    return FF_THREAD_FRAME;
+  else if (!strcmp(name, "slice"))
+    return FF_THREAD_SLICE;
+  else if (!strcmp(name, "both"))
+    return FF_THREAD_FRAME | FF_THREAD_SLICE;
+  return -1;
 }
 
 int main(int argc, char *argv[])
@@ -810,16 +1372,28 @@ int main(int argc, char *argv[])
   SDL_Event event;
 
   VideoState *is;
+  const char *filename = NULL;
+  int i;
 
   is = av_mallocz(sizeof(VideoState));
 
-  if (argc < 2)
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+      decoder_thread_count = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-thread_type") && i + 1 < argc)
+      decoder_thread_type = parse_thread_type(argv[++i]);
+    else
+      filename = argv[i];
+  }
+  if (!filename || decoder_thread_count < 0 || decoder_thread_type < 0)
   {
-    fprintf(stderr, "Usage: test <file>\n");
+    fprintf(stderr, "Usage: test [-threads N] [-thread_type frame|slice|both] <file>\n");
     exit(1);
   }
   // Register all formats and codecs
   av_register_all();
+  fast_convert_init(av_get_cpu_flags());
 
   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER))
   {
@@ -838,11 +1412,17 @@ int main(int argc, char *argv[])
   //     exit(1);
   //   }
 
-  av_strlcpy(is->filename, argv[1], 1024);
+  av_strlcpy(is->filename, filename, 1024);
 
   is->pictq_mutex = SDL_CreateMutex();
   is->pictq_cond = SDL_CreateCond();
 
+  if (writer_pool_init(&is->writers) < 0)
+  {
+    fprintf(stderr, "Could not start the writer threads\n");
+    exit(1);
+  }
+
   schedule_refresh(is, 40);
 
   is->parse_tid = SDL_CreateThread(decode_thread, "Decode Thread", is);
@@ -865,8 +1445,9 @@ int main(int argc, char *argv[])
        * audio queues are waiting for more data.  Make them stop
        * waiting and terminate normally.
        */
-      SDL_CondSignal(is->audioq.cond);
-      SDL_CondSignal(is->videoq.cond);
+      packet_queue_abort(&is->audioq);
+      packet_queue_abort(&is->videoq);
+      writer_pool_destroy(&is->writers);
       SDL_Quit();
       return 0;
       break;
@@ -20,6 +20,7 @@
 #include <libswscale/swscale.h>
 #include <libavutil/avstring.h>
 #include <libavutil/time.h>
+#include <libavutil/imgutils.h>
 
 #include <SDL.h>
 #include <SDL_thread.h>
@@ -31,11 +32,20 @@
 #include <stdio.h>
 #include <math.h>
 
+#include "frame_pool.h"
+
 #define SDL_AUDIO_BUFFER_SIZE 1024
 #define MAX_AUDIO_FRAME_SIZE 192000
 
-#define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
-#define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
+/* Each packet queue holds up to this much playing time. The byte limit
+   only matters for streams whose packets carry no duration. */
+#define MAX_QUEUE_DURATION (2 * AV_TIME_BASE)
+#define MAX_QUEUE_SIZE (16 * 1024 * 1024)
+/* Packets go through the queues in batches of up to this many, one lock
+   per batch; the demuxer holds back at most PACKET_BATCH_DURATION of
+   each stream to make up a batch. */
+#define PACKET_BATCH_SIZE 16
+#define PACKET_BATCH_DURATION (AV_TIME_BASE / 5)
 
 #define AV_SYNC_THRESHOLD 0.01
 #define AV_NOSYNC_THRESHOLD 10.0
@@ -50,9 +60,18 @@ typedef struct PacketQueue {
   AVPacketList *first_pkt, *last_pkt;
   int nb_packets;
   int size;
+  int64_t duration; /* of the queued packets, in AV_TIME_BASE units */
+  AVRational time_base; /* of the packets' timestamps and durations */
   SDL_mutex *mutex;
   SDL_cond *cond;
+  SDL_cond *not_full; /* signalled when a get makes room */
 } PacketQueue;
+/* Packets the demuxer has read for one queue but not put yet */
+typedef struct PacketBatch {
+  AVPacket pkts[PACKET_BATCH_SIZE];
+  int nb_packets;
+  int64_t duration; /* in AV_TIME_BASE units */
+} PacketBatch;
 
 
 typedef struct VideoPicture {
@@ -74,9 +93,8 @@ typedef struct VideoState {
   uint8_t         audio_buf[(MAX_AUDIO_FRAME_SIZE * 3) / 2];
   unsigned int    audio_buf_size;
   unsigned int    audio_buf_index;
-  AVPacket        audio_pkt;
-  uint8_t         *audio_pkt_data;
-  int             audio_pkt_size;
+  AVPacket        audio_pkts[PACKET_BATCH_SIZE]; /* taken off audioq, not decoded yet */
+  int             audio_pkts_nb, audio_pkts_index;
   int             audio_hw_buf_size;  
   double          frame_timer;
   double          frame_last_pts;
@@ -84,6 +102,7 @@ typedef struct VideoState {
   double          video_clock; ///<pts of last decoded frame / predicted pts of next decoded frame
   AVStream        *video_st;
   PacketQueue     videoq;
+  FrameBufferPool frame_pool;
 
   VideoPicture    pictq[VIDEO_PICTURE_QUEUE_SIZE];
   int             pictq_size, pictq_rindex, pictq_windex;
@@ -106,38 +125,104 @@ SDL_Surface     *screen;
    can be global in case we need it. */
 VideoState *global_video_state;
 
-void packet_queue_init(PacketQueue *q) {
+/* Decoder threading from -threads/-thread_type. 0 threads means one
+   per core; the type is any mix of FF_THREAD_FRAME and FF_THREAD_SLICE. */
+int decoder_thread_count = 0;
+int decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+void packet_queue_init(PacketQueue *q, AVRational time_base) {
   memset(q, 0, sizeof(PacketQueue));
+  q->time_base = time_base;
   q->mutex = SDL_CreateMutex();
   q->cond = SDL_CreateCond();
+  q->not_full = SDL_CreateCond();
 }
-int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
-
-  AVPacketList *pkt1;
-  if(av_dup_packet(pkt) < 0) {
-    return -1;
+/* pkt's duration in AV_TIME_BASE units */
+int64_t packet_queue_pkt_duration(PacketQueue *q, AVPacket *pkt) {
+  return av_rescale_q(pkt->duration, q->time_base, AV_TIME_BASE_Q);
+}
+/* Whether the demuxer should stop reading for now. Called with q->mutex
+   held. */
+int packet_queue_full(PacketQueue *q) {
+  return q->duration > MAX_QUEUE_DURATION || q->size > MAX_QUEUE_SIZE;
+}
+/* Take over pkt's reference, leaving pkt blank, so the payload goes on
+   to the decoder as it is; only a payload the demuxer still owns has
+   to be copied. */
+int packet_take_ref(AVPacket *dst, AVPacket *pkt) {
+  if(pkt->buf || !pkt->data) {
+    av_packet_move_ref(dst, pkt);
+    return 0;
   }
-  pkt1 = av_malloc(sizeof(AVPacketList));
-  if (!pkt1)
+  if(av_packet_ref(dst, pkt) < 0) {
     return -1;
-  pkt1->pkt = *pkt;
-  pkt1->next = NULL;
+  }
+  av_packet_unref(pkt);
+  return 0;
+}
+/* Move pkts[0..n-1] into q under one lock, leaving them blank. On
+   failure the caller still has to unref them. */
+int packet_queue_put_batch(PacketQueue *q, AVPacket *pkts, int n) {
+
+  AVPacketList *first = NULL, *last = NULL, *pkt1;
+  int64_t duration = 0;
+  int i, size = 0;
+
+  /* build the chain before taking the lock */
+  for(i = 0; i < n; i++) {
+    pkt1 = av_malloc(sizeof(AVPacketList));
+    if (!pkt1)
+      goto fail;
+    if(packet_take_ref(&pkt1->pkt, &pkts[i]) < 0) {
+      av_free(pkt1);
+      goto fail;
+    }
+    pkt1->next = NULL;
+    if (!last)
+      first = pkt1;
+    else
+      last->next = pkt1;
+    last = pkt1;
+    size += pkt1->pkt.size;
+    duration += packet_queue_pkt_duration(q, &pkt1->pkt);
+  }
+  if(!first) {
+    return 0;
+  }
   
   SDL_LockMutex(q->mutex);
 
   if (!q->last_pkt)
-    q->first_pkt = pkt1;
+    q->first_pkt = first;
   else
-    q->last_pkt->next = pkt1;
-  q->last_pkt = pkt1;
-  q->nb_packets++;
-  q->size += pkt1->pkt.size;
+    q->last_pkt->next = first;
+  q->last_pkt = last;
+  q->nb_packets += n;
+  q->size += size;
+  q->duration += duration;
+  /* the only consumer waits for the queue to be non-empty, under the
+     mutex, so one signal for the whole batch can't be lost */
   SDL_CondSignal(q->cond);
   
   SDL_UnlockMutex(q->mutex);
   return 0;
+
+ fail:
+  while(first) {
+    pkt1 = first;
+    first = first->next;
+    av_packet_unref(&pkt1->pkt);
+    av_free(pkt1);
+  }
+  return -1;
+}
+int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
+  return packet_queue_put_batch(q, pkt, 1);
 }
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
+/* Move up to max packets out of q under one lock. If block is set,
+   waits until there is at least one, but never for more. Returns the
+   number of packets, 0 if there were none, or -1 when quitting. */
+static int packet_queue_get_batch(PacketQueue *q, AVPacket *pkts, int max, int block)
 {
   AVPacketList *pkt1;
   int ret;
@@ -151,16 +236,23 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
       break;
     }
 
-    pkt1 = q->first_pkt;
-    if (pkt1) {
-      q->first_pkt = pkt1->next;
+    if (q->first_pkt) {
+      for(ret = 0; ret < max && q->first_pkt; ret++) {
+	pkt1 = q->first_pkt;
+	q->first_pkt = pkt1->next;
+	q->nb_packets--;
+	q->size -= pkt1->pkt.size;
+	q->duration -= packet_queue_pkt_duration(q, &pkt1->pkt);
+	pkts[ret] = pkt1->pkt;
+	av_free(pkt1);
+      }
       if (!q->first_pkt)
 	q->last_pkt = NULL;
-      q->nb_packets--;
-      q->size -= pkt1->pkt.size;
-      *pkt = pkt1->pkt;
-      av_free(pkt1);
-      ret = 1;
+      /* the demuxer checks packet_queue_full under the mutex before it
+	 sleeps, so one signal for the whole batch can't be lost */
+      if(!packet_queue_full(q)) {
+	SDL_CondSignal(q->not_full);
+      }
       break;
     } else if (!block) {
       ret = 0;
@@ -172,6 +264,24 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
   SDL_UnlockMutex(q->mutex);
   return ret;
 }
+/* Block the demuxer until q has room, without polling. Returns -1 when
+   quitting. */
+int packet_queue_wait_space(PacketQueue *q) {
+  SDL_LockMutex(q->mutex);
+  while(packet_queue_full(q) && !global_video_state->quit) {
+    SDL_CondWait(q->not_full, q->mutex);
+  }
+  SDL_UnlockMutex(q->mutex);
+  return global_video_state->quit ? -1 : 0;
+}
+/* Wake up both sides when quitting. The mutex is held so that a thread
+   between checking quit and waiting can't miss the wakeup. */
+void packet_queue_abort(PacketQueue *q) {
+  SDL_LockMutex(q->mutex);
+  SDL_CondBroadcast(q->cond);
+  SDL_CondBroadcast(q->not_full);
+  SDL_UnlockMutex(q->mutex);
+}
 double get_audio_clock(VideoState *is) {
   double pts;
   int hw_buf_size, bytes_per_sec, n;
@@ -189,65 +299,108 @@ double get_audio_clock(VideoState *is) {
   return pts;
 }
 
+/* Queue an empty packet, which tells the decoder reading q that the
+   file has ended and it should hand out the frames it is still holding. */
+int packet_queue_put_nullpacket(PacketQueue *q, int stream_index) {
+  AVPacket pkt1, *pkt = &pkt1;
+
+  av_init_packet(pkt);
+  pkt->data = NULL;
+  pkt->size = 0;
+  pkt->stream_index = stream_index;
+  return packet_queue_put(q, pkt);
+}
+/* Hold pkt back for q until packet_batch_flush, taking over its
+   reference. The batch must not be full. */
+int packet_batch_add(PacketQueue *q, PacketBatch *b, AVPacket *pkt) {
+  AVPacket *dst = &b->pkts[b->nb_packets];
+
+  /* a payload the demuxer still owns would not survive the next read */
+  if(packet_take_ref(dst, pkt) < 0) {
+    av_packet_unref(pkt);
+    return -1;
+  }
+  b->nb_packets++;
+  b->duration += packet_queue_pkt_duration(q, dst);
+  return 0;
+}
+/* Whether b should go into its queue before another packet is read */
+int packet_batch_due(PacketBatch *b) {
+  return b->nb_packets == PACKET_BATCH_SIZE ||
+    b->duration >= PACKET_BATCH_DURATION;
+}
+int packet_batch_flush(PacketQueue *q, PacketBatch *b) {
+  int i, ret;
+
+  ret = packet_queue_put_batch(q, b->pkts, b->nb_packets);
+  if(ret < 0) {
+    for(i = 0; i < b->nb_packets; i++) {
+      av_packet_unref(&b->pkts[i]);
+    }
+  }
+  b->nb_packets = 0;
+  b->duration = 0;
+  return ret;
+}
+
 int audio_decode_frame(VideoState *is, double *pts_ptr) {
-  int len1, data_size = 0, n;
-  AVPacket *pkt = &is->audio_pkt;
+  int data_size, n;
+  AVPacket *pkt;
+  AVCodecContext *codecCtx = is->audio_st->codec;
   double pts;
 
   for(;;) {
-    while(is->audio_pkt_size > 0) {
-      int got_frame;
-      len1 = avcodec_decode_audio4(is->audio_st->codec, &is->audio_frame, &got_frame, pkt);
-      if(len1 < 0) {
-	/* if error, skip frame */
-	is->audio_pkt_size = 0;
-	break;
-      }
-      if (got_frame)
-      {
-          data_size = 
-            av_samples_get_buffer_size
-            (
-                NULL, 
-                is->audio_st->codec->channels,
-                is->audio_frame.nb_samples,
-                is->audio_st->codec->sample_fmt,
-                1
-            );
-          memcpy(is->audio_buf, is->audio_frame.data[0], data_size);
-      }
-      is->audio_pkt_data += len1;
-      is->audio_pkt_size -= len1;
+    /* a packet can hold several frames: hand them all out before
+       sending the decoder another one */
+    while(avcodec_receive_frame(codecCtx, &is->audio_frame) == 0) {
+      data_size = 
+        av_samples_get_buffer_size
+        (
+            NULL, 
+            codecCtx->channels,
+            is->audio_frame.nb_samples,
+            codecCtx->sample_fmt,
+            1
+        );
       if(data_size <= 0) {
 	/* No data yet, get more frames */
 	continue;
       }
+      memcpy(is->audio_buf, is->audio_frame.data[0], data_size);
+      /* if update, update the audio clock w/pts; frames after the first
+	 in a packet have none and just carry on from the last one */
+      if(is->audio_frame.best_effort_timestamp != AV_NOPTS_VALUE) {
+	is->audio_clock = av_q2d(is->audio_st->time_base) *
+	  is->audio_frame.best_effort_timestamp;
+      }
       pts = is->audio_clock;
       *pts_ptr = pts;
-      n = 2 * is->audio_st->codec->channels;
+      n = 2 * codecCtx->channels;
       is->audio_clock += (double)data_size /
-	(double)(n * is->audio_st->codec->sample_rate);
+	(double)(n * codecCtx->sample_rate);
 
       /* We have data, return it and come back for more later */
       return data_size;
     }
-    if(pkt->data)
-      av_free_packet(pkt);
 
     if(is->quit) {
       return -1;
     }
-    /* next packet */
-    if(packet_queue_get(&is->audioq, pkt, 1) < 0) {
-      return -1;
-    }
-    is->audio_pkt_data = pkt->data;
-    is->audio_pkt_size = pkt->size;
-    /* if update, update the audio clock w/pts */
-    if(pkt->pts != AV_NOPTS_VALUE) {
-      is->audio_clock = av_q2d(is->audio_st->time_base)*pkt->pts;
+    /* next packet, taking a new batch when the last one is used up */
+    if(is->audio_pkts_index == is->audio_pkts_nb) {
+      is->audio_pkts_nb = packet_queue_get_batch(&is->audioq, is->audio_pkts,
+						 PACKET_BATCH_SIZE, 1);
+      is->audio_pkts_index = 0;
+      if(is->audio_pkts_nb < 0) {
+	is->audio_pkts_nb = 0;
+	return -1;
+      }
     }
-
+    pkt = &is->audio_pkts[is->audio_pkts_index++];
+    /* an empty packet means end of file: drain the decoder. A packet the
+       decoder rejects is skipped. */
+    avcodec_send_packet(codecCtx, pkt->data ? pkt : NULL);
+    av_free_packet(pkt);
   }
 }
 
@@ -520,65 +673,51 @@ double synchronize_video(VideoState *is, AVFrame *src_frame, double pts) {
   is->video_clock += frame_delay;
   return pts;
 }
-uint64_t global_video_pkt_pts = AV_NOPTS_VALUE;
-
-/* These are called whenever we allocate a frame
- * buffer. We use this to store the global_pts in
- * a frame at the time it is allocated.
- */
-int our_get_buffer(struct AVCodecContext *c, AVFrame *pic) {
-  int ret = avcodec_default_get_buffer(c, pic);
-  uint64_t *pts = av_malloc(sizeof(uint64_t));
-  *pts = global_video_pkt_pts;
-  pic->opaque = pts;
-  return ret;
-}
-void our_release_buffer(struct AVCodecContext *c, AVFrame *pic) {
-  if(pic) av_freep(&pic->opaque);
-  avcodec_default_release_buffer(c, pic);
-}
-
 int video_thread(void *arg) {
   VideoState *is = (VideoState *)arg;
-  AVPacket pkt1, *packet = &pkt1;
-  int frameFinished;
+  AVPacket pkts[PACKET_BATCH_SIZE], *packet;
+  AVCodecContext *codecCtx = is->video_st->codec;
   AVFrame *pFrame;
   double pts;
+  int nb_pkts = 0, i = 0;
 
   pFrame = av_frame_alloc();
 
   for(;;) {
-    if(packet_queue_get(&is->videoq, packet, 1) < 0) {
-      // means we quit getting packets
-      break;
-    }
-    pts = 0;
-
-    // Save global pts to be stored in pFrame in first call
-    global_video_pkt_pts = packet->pts;
-    // Decode video frame
-    avcodec_decode_video2(is->video_st->codec, pFrame, &frameFinished, 
-				packet);
-    if(packet->dts == AV_NOPTS_VALUE 
-       && pFrame->opaque && *(uint64_t*)pFrame->opaque != AV_NOPTS_VALUE) {
-      pts = *(uint64_t *)pFrame->opaque;
-    } else if(packet->dts != AV_NOPTS_VALUE) {
-      pts = packet->dts;
-    } else {
-      pts = 0;
+    // Take every packet waiting, up to a batch, and then decode them
+    if(i == nb_pkts) {
+      nb_pkts = packet_queue_get_batch(&is->videoq, pkts, PACKET_BATCH_SIZE, 1);
+      i = 0;
+      if(nb_pkts < 0) {
+	// means we quit getting packets
+	break;
+      }
     }
-    pts *= av_q2d(is->video_st->time_base);
+    packet = &pkts[i++];
+    // Decode video frame; an empty packet means end of file and drains
+    // the decoder
+    avcodec_send_packet(codecCtx, packet->data ? packet : NULL);
+    av_free_packet(packet);
+
+    // Take every frame the decoder has ready
+    while(avcodec_receive_frame(codecCtx, pFrame) == 0) {
+      /* frames come out in display order, often several packets after
+	 their own, so only the frame's timestamp can be trusted */
+      pts = pFrame->best_effort_timestamp != AV_NOPTS_VALUE ?
+	pFrame->best_effort_timestamp : 0;
+      pts *= av_q2d(is->video_st->time_base);
 
-    // Did we get a video frame?
-    if(frameFinished) {
       pts = synchronize_video(is, pFrame, pts);
       if(queue_picture(is, pFrame, pts) < 0) {
-	break;
+	goto quit;
       }
     }
-    av_free_packet(packet);
   }
-  av_free(pFrame);
+ quit:
+  while(i < nb_pkts) {
+    av_free_packet(&pkts[i++]);
+  }
+  av_frame_free(&pFrame);
   return 0;
 }
 
@@ -614,6 +753,16 @@ int stream_component_open(VideoState *is, int stream_index) {
     is->audio_hw_buf_size = spec.size;
   }
   codec = avcodec_find_decoder(codecCtx->codec_id);
+  if(codecCtx->codec_type == AVMEDIA_TYPE_VIDEO) {
+    codecCtx->thread_count = decoder_thread_count;
+    codecCtx->thread_type = decoder_thread_type;
+    /* serve the decoder's frames from our own pool */
+    if(frame_pool_init(&is->frame_pool) < 0) {
+      fprintf(stderr, "Could not create the frame pool\n");
+      return -1;
+    }
+    frame_pool_attach(&is->frame_pool, codecCtx);
+  }
 
   if(!codec || (avcodec_open2(codecCtx, codec, &optionsDict) < 0)) {
     fprintf(stderr, "Unsupported codec!\n");
@@ -626,8 +775,9 @@ int stream_component_open(VideoState *is, int stream_index) {
     is->audio_st = pFormatCtx->streams[stream_index];
     is->audio_buf_size = 0;
     is->audio_buf_index = 0;
-    memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
-    packet_queue_init(&is->audioq);
+    is->audio_pkts_nb = 0;
+    is->audio_pkts_index = 0;
+    packet_queue_init(&is->audioq, is->audio_st->time_base);
     SDL_PauseAudio(0);
     break;
   case AVMEDIA_TYPE_VIDEO:
@@ -637,7 +787,7 @@ int stream_component_open(VideoState *is, int stream_index) {
     is->frame_timer = (double)av_gettime() / 1000000.0;
     is->frame_last_delay = 40e-3;
 
-    packet_queue_init(&is->videoq);
+    packet_queue_init(&is->videoq, is->video_st->time_base);
     is->video_tid = SDL_CreateThread(video_thread, is);
     is->sws_ctx =
         sws_getContext
@@ -653,8 +803,6 @@ int stream_component_open(VideoState *is, int stream_index) {
             NULL, 
             NULL
         );
-    codecCtx->get_buffer2 = our_get_buffer;
-    codecCtx->release_buffer = our_release_buffer;
     break;
   default:
     break;
@@ -672,14 +820,18 @@ int decode_thread(void *arg) {
   VideoState *is = (VideoState *)arg;
   AVFormatContext *pFormatCtx = NULL;
   AVPacket pkt1, *packet = &pkt1;
+  PacketBatch audio_batch, video_batch; /* read but not queued yet */
 
   AVDictionary *io_dict = NULL;
   AVIOInterruptCB callback;
 
   int video_index = -1;
   int audio_index = -1;
+  int eof = 0; /* end of file reached and the decoders told so */
   int i;
 
+  memset(&audio_batch, 0, sizeof(audio_batch));
+  memset(&video_batch, 0, sizeof(video_batch));
   is->videoStream=-1;
   is->audioStream=-1;
 
@@ -737,13 +889,26 @@ int decode_thread(void *arg) {
       break;
     }
     // seek stuff goes here
-    if(is->audioq.size > MAX_AUDIOQ_SIZE ||
-       is->videoq.size > MAX_VIDEOQ_SIZE) {
-      SDL_Delay(10);
-      continue;
+    if(packet_batch_due(&audio_batch) || packet_batch_due(&video_batch)) {
+      /* queue what is held back of both streams, so neither decoder
+	 runs dry while we sleep, then sleep until both queues have
+	 room; the decoders wake us */
+      packet_batch_flush(&is->audioq, &audio_batch);
+      packet_batch_flush(&is->videoq, &video_batch);
+      if(packet_queue_wait_space(&is->audioq) < 0 ||
+	 packet_queue_wait_space(&is->videoq) < 0) {
+	break;
+      }
     }
     if(av_read_frame(is->pFormatCtx, packet) < 0) {
       if(is->pFormatCtx->pb->error == 0) {
+	if(!eof) {
+	  packet_batch_flush(&is->audioq, &audio_batch);
+	  packet_batch_flush(&is->videoq, &video_batch);
+	  packet_queue_put_nullpacket(&is->videoq, is->videoStream);
+	  packet_queue_put_nullpacket(&is->audioq, is->audioStream);
+	  eof = 1;
+	}
 	SDL_Delay(100); /* no error; wait for user input */
 	continue;
       } else {
@@ -752,9 +917,9 @@ int decode_thread(void *arg) {
     }
     // Is this a packet from the video stream?
     if(packet->stream_index == is->videoStream) {
-      packet_queue_put(&is->videoq, packet);
+      packet_batch_add(&is->videoq, &video_batch, packet);
     } else if(packet->stream_index == is->audioStream) {
-      packet_queue_put(&is->audioq, packet);
+      packet_batch_add(&is->audioq, &audio_batch, packet);
     } else {
       av_free_packet(packet);
     }
@@ -774,16 +939,39 @@ int decode_thread(void *arg) {
   return 0;
 }
 
+/* "frame", "slice" or "both" as FF_THREAD_* flags, -1 if unknown */
+int parse_thread_type(const char *name) {
+  if(!strcmp(name, "frame")) {
+    return FF_THREAD_FRAME;
+  } else if(!strcmp(name, "slice")) {
+    return FF_THREAD_SLICE;
+  } else if(!strcmp(name, "both")) {
+    return FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
+  return -1;
+}
+
 int main(int argc, char *argv[]) {
 
   SDL_Event       event;
 
   VideoState      *is;
+  const char      *filename = NULL;
+  int             i;
 
   is = av_mallocz(sizeof(VideoState));
 
-  if(argc < 2) {
-    fprintf(stderr, "Usage: test <file>\n");
+  for(i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "-threads") && i + 1 < argc) {
+      decoder_thread_count = atoi(argv[++i]);
+    } else if(!strcmp(argv[i], "-thread_type") && i + 1 < argc) {
+      decoder_thread_type = parse_thread_type(argv[++i]);
+    } else {
+      filename = argv[i];
+    }
+  }
+  if(!filename || decoder_thread_count < 0 || decoder_thread_type < 0) {
+    fprintf(stderr, "Usage: test [-threads N] [-thread_type frame|slice|both] <file>\n");
     exit(1);
   }
   // Register all formats and codecs
@@ -805,7 +993,7 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
-  av_strlcpy(is->filename, argv[1], 1024);
+  av_strlcpy(is->filename, filename, 1024);
 
   is->pictq_mutex = SDL_CreateMutex();
   is->pictq_cond = SDL_CreateCond();
@@ -829,8 +1017,11 @@ int main(int argc, char *argv[]) {
        * audio queues are waiting for more data.  Make them stop
        * waiting and terminate normally.
        */
-      SDL_CondSignal(is->audioq.cond);
-      SDL_CondSignal(is->videoq.cond);
+      packet_queue_abort(&is->audioq);
+      packet_queue_abort(&is->videoq);
+      fprintf(stderr, "video: %d decoder buffers, %d frame-sized allocations, %d of them after the first %d frames\n",
+	      is->frame_pool.frames, is->frame_pool.allocs,
+	      is->frame_pool.steady_allocs, FRAME_POOL_WARMUP);
       SDL_Quit();
       exit(0);
       break;
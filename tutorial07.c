@@ -12,7 +12,11 @@
 // Run using
 // tutorial07 myvideofile.mpg
 //
-// to play the video.
+// to play the video, or
+// tutorial07 -bench myvideofile.mpg
+//
+// to decode it as fast as possible without a window or sound card and
+// print how fast each stage went.
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -22,6 +26,9 @@
 #include <libavutil/avstring.h>
 #include <libavutil/opt.h>
 #include <libavutil/time.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/cpu.h>
 
 #include <SDL.h>
 #include <SDL_thread.h>
@@ -30,35 +37,150 @@
 #endif
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
+
+#include "frame_pool.h"
+#include "trace.h"
 
 #define SDL_AUDIO_BUFFER_SIZE 1024
 #define MAX_AUDIO_FRAME_SIZE 192000
-#define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
-#define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
+/* Each packet queue holds up to this much playing time. The byte limit
+   only matters for streams whose packets carry no duration. */
+#define MAX_QUEUE_DURATION (2 * AV_TIME_BASE)
+#define MAX_QUEUE_SIZE (16 * 1024 * 1024)
+#define PACKET_QUEUE_CAPACITY 1024
+#define PCM_RING_SIZE (1 << 16) /* bytes of decoded audio ahead of the device */
 #define AV_SYNC_THRESHOLD 0.01
 #define AV_NOSYNC_THRESHOLD 10.0
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
 #define AUDIO_DIFF_AVG_NB 20
-#define FF_ALLOC_EVENT   (SDL_USEREVENT)
 #define FF_REFRESH_EVENT (SDL_USEREVENT + 1)
 #define FF_QUIT_EVENT (SDL_USEREVENT + 2)
-#define VIDEO_PICTURE_QUEUE_SIZE 1
+#define FF_EOF_EVENT (SDL_USEREVENT + 3) /* -bench: the demuxer got to the end */
+#define VIDEO_PICTURE_QUEUE_SIZE 3 /* default, see -pictq */
+#define MAX_PICTURE_QUEUE_SIZE 32
+#define MAX_CONVERT_THREADS 16
+#define CONVERT_MIN_BAND_ROWS 128 /* shorter frames are not split */
 #define DEFAULT_AV_SYNC_TYPE AV_SYNC_VIDEO_MASTER
-
+#define LATENCY_BUCKETS 12 /* under 1, 2, 4 ... 1024 ms, and the rest */
+
+/* What one queue has been through. Every field is written by one side
+   only, so none needs a lock; reading them while playing gives a
+   slightly stale but usable picture. Times are in microseconds. */
+typedef struct QueueStats {
+  /* written by the producer */
+  int64_t puts;
+  int max_items; /* highest occupancy seen after a put */
+  int64_t max_bytes;
+  int64_t max_duration;
+  int producer_waits; /* puts that found the queue full */
+  int64_t producer_wait_time;
+  /* written by the consumer */
+  int64_t gets;
+  int consumer_waits; /* gets that found the queue empty */
+  int64_t consumer_wait_time;
+  int latency[LATENCY_BUCKETS]; /* time from put to get */
+  int64_t max_latency;
+  int64_t total_latency; /* for the mean */
+} QueueStats;
+
+/* A queued packet and the serial of the playback it belongs to */
+typedef struct QueuedPacket {
+  AVPacket pkt;
+  int serial;
+  int64_t queued_time; /* av_gettime() at the put */
+} QueuedPacket;
+/* Single-producer/single-consumer ring of packet slots. The demux thread
+   is the only writer and the decoder the only reader, so head and tail
+   are published with atomics and the mutex/conds are only touched when
+   the ring is full or empty. */
 typedef struct PacketQueue {
-  AVPacketList *first_pkt, *last_pkt;
-  int nb_packets;
-  int size;
+  QueuedPacket *pkts;
+  int capacity; /* number of slots, a power of two */
+  SDL_atomic_t head; /* next slot to read, advanced by the consumer */
+  SDL_atomic_t tail; /* next slot to write, advanced by the producer */
+  SDL_atomic_t size; /* payload bytes currently queued */
+  SDL_atomic_t duration; /* of the queued packets, in AV_TIME_BASE units */
+  AVRational time_base; /* of the packets' timestamps and durations */
+  SDL_atomic_t serial; /* bumped by the producer on every seek */
+  /* producer only */
+  int64_t put_duration; /* of every packet put, in AV_TIME_BASE units */
+  int64_t copied_bytes; /* payload that had to be copied on the way in */
+  QueueStats stats;
+  /* consumer only */
+  int64_t last_queued_time; /* of the packet got last */
+  SDL_atomic_t producer_waiting;
+  SDL_atomic_t consumer_waiting;
   SDL_mutex *mutex;
-  SDL_cond *cond;
+  SDL_cond *not_empty;
+  SDL_cond *not_full;
 } PacketQueue;
+/* Decoded S16 samples on their way to the audio device. The audio thread
+   is the only writer and audio_callback the only reader; the callback
+   never blocks, it plays silence and counts an underrun instead. */
+typedef struct PcmRing {
+  uint8_t *buf;
+  int capacity; /* bytes, a power of two */
+  SDL_atomic_t read_pos; /* total bytes handed to the device */
+  SDL_atomic_t write_pos; /* total bytes written by the audio thread */
+  SDL_atomic_t writer_waiting;
+  SDL_atomic_t data_serial; /* serial of the samples written last */
+  SDL_atomic_t data_start; /* write_pos where samples of data_serial begin */
+  SDL_sem *space; /* posted by the callback when a waiting writer can go on */
+  SDL_atomic_t reader_waiting;
+  SDL_sem *data; /* posted by the writer when a waiting reader can go on */
+  /* counters, readable at any time */
+  SDL_atomic_t underruns; /* callbacks that could not be filled completely */
+  SDL_atomic_t silence_bytes; /* bytes of silence played because of them */
+  SDL_atomic_t fill_low; /* lowest fill level seen by the callback */
+} PcmRing;
+
 typedef struct VideoPicture {
-  SDL_Overlay *bmp;
+  AVFrame *frame; /* reference to the decoded frame, converted only when shown */
   int width, height; /* source height & width */
-  int allocated;
   double pts;
+  int serial; /* of the packet it was decoded from */
+  int bytes; /* of the frame's buffers */
+  int64_t duration; /* in AV_TIME_BASE units */
+  int64_t queued_time; /* av_gettime() in queue_picture */
+  int64_t demux_time; /* when its packet was queued, or AV_NOPTS_VALUE */
 } VideoPicture;
 
+/* Rows y..y+h of the picture being converted. Band 0 is done by the
+   display thread itself, the others by helper threads. A SwsContext
+   can't be shared between threads, so each band has its own. */
+typedef struct ConvertBand {
+  struct VideoState *is;
+  int index;
+  SDL_Thread *tid;
+  struct SwsContext *sws_ctx;
+  int y, h;
+  int64_t busy_time; /* us spent converting, helpers only */
+  int64_t cpu_time; /* us of CPU, helpers with -bench only */
+} ConvertBand;
+
+/* -bench: what stands in for the screen and the sound card */
+enum {
+  BENCH_OFF,
+  BENCH_UNTHROTTLED, /* everything as soon as it is decoded */
+  BENCH_REALTIME, /* at the pace playback would go */
+};
+
+/* Threads whose CPU time -bench reports on. The convert band helpers
+   keep theirs in ConvertBand. */
+enum {
+  STAGE_DEMUX,
+  STAGE_VIDEO_DECODE,
+  STAGE_AUDIO_DECODE,
+  STAGE_DISPLAY, /* the main thread: refresh, band 0 of the conversion */
+  STAGE_AUDIO_SINK,
+  NB_STAGES
+};
+
+static const char *stage_names[NB_STAGES] = {
+  "demux", "video decode", "audio decode", "display", "audio sink"
+};
+
 typedef struct VideoState {
   AVFormatContext *pFormatCtx;
   int             videoStream, audioStream;
@@ -78,8 +200,9 @@ typedef struct VideoState {
   unsigned int    audio_buf_size;
   unsigned int    audio_buf_index;
   AVPacket        audio_pkt;
-  uint8_t         *audio_pkt_data;
-  int             audio_pkt_size;
+  int             audio_pkt_serial; /* of the last packet sent to the decoder */
+  int             audio_drained; /* the decoder gave out everything up to end of file */
+  PcmRing         audio_ring;
   int             audio_hw_buf_size;
   double          audio_diff_cum; /* used for AV difference average computation */
   double          audio_diff_avg_coef;
@@ -88,24 +211,71 @@ typedef struct VideoState {
   double          frame_timer;
   double          frame_last_pts;
   double          frame_last_delay;
+  int             frame_serial; /* of the last picture shown */
   double          video_clock; ///<pts of last decoded frame / predicted pts of next decoded frame
   double          video_current_pts; ///<current displayed pts (different from video_clock if frame fifos are used)
   int64_t         video_current_pts_time;  ///<time (av_gettime) at which we updated video_current_pts - used to have running video pts
   AVStream        *video_st;
   PacketQueue     videoq;
-  VideoPicture    pictq[VIDEO_PICTURE_QUEUE_SIZE];
+  int             video_pkt_serial; /* of the last packet sent to the decoder */
+  int             video_drained; /* the decoder gave out everything up to end of file */
+  int             frames_decoded;
+  VideoPicture    *pictq;
+  int             pictq_capacity; /* number of slots, set at startup */
   int             pictq_size, pictq_rindex, pictq_windex;
+  int64_t         pictq_bytes, pictq_duration; /* of the queued pictures */
+  QueueStats      pictq_stats; /* producer is video_thread, consumer the refresh timer */
+  int64_t         pictq_empty_since; /* when the refresh timer found it empty, or 0 */
   SDL_mutex       *pictq_mutex;
   SDL_cond        *pictq_cond;
+  int64_t         video_decode_time; /* us spent decoding */
+  int64_t         video_overlap_time; /* part of it with pictures still queued for display */
+
+  /* conversion of the shown pictures, in video_display */
+  AVFrame         *display_frame; /* YUV420P for pictures SDL can't take as they are */
+  int             convert_threads; /* bands per picture, set with -convert_threads */
+  ConvertBand     convert_bands[MAX_CONVERT_THREADS];
+  AVFrame         *convert_src; /* the picture the bands are working on */
+  AVFrame         *convert_dst;
+  int             convert_nb_bands;
+  int             convert_generation; /* bumped for every split picture */
+  int             convert_pending; /* helper bands not finished yet */
+  SDL_mutex       *convert_mutex;
+  SDL_cond        *convert_start;
+  SDL_cond        *convert_done;
+  int64_t         convert_time; /* us video_display spent converting */
+  int             pictures_shown;
+  int             pictures_converted; /* shown pictures that needed converting */
+  int             framedrop; /* drop late frames, off with -noframedrop */
+  int             frames_dropped_early; /* late, never queued */
+  int             frames_dropped_late; /* skipped in the picture queue */
+  QueueStats      pipeline_stats; /* demux to display, only the get side is used */
+  FrameBufferPool frame_pool;
   SDL_Thread      *parse_tid;
   SDL_Thread      *video_tid;
+  SDL_Thread      *audio_tid;
+  SDL_Thread      *audio_sink_tid; /* -bench only */
+
+  /* -bench */
+  int             bench; /* BENCH_*, no window or audio device unless off */
+  int64_t         start_time; /* when the demuxer started reading */
+  int             demux_eof; /* set by the main thread on FF_EOF_EVENT */
+  int64_t         cpu_time[NB_STAGES]; /* us of CPU each stage's thread used so far */
+
+  SDL_Renderer    *renderer;
+  SDL_Texture     *texture;
 
   char            filename[1024];
+  const char      *stats_file; /* -stats: queue statistics go here on exit */
   int             quit;
 
   AVIOContext     *io_context;
   struct SwsContext *sws_ctx;
-  struct SwsContext *sws_ctx_audio;
+  struct SwrContext *sws_ctx_audio;
+  int             audio_swr_configured;
+  int64_t         audio_src_ch_layout; /* input the resampler is set up for */
+  int             audio_src_rate;
+  enum AVSampleFormat audio_src_fmt;
 } VideoState;
 
 enum {
@@ -114,100 +284,420 @@ enum {
   AV_SYNC_EXTERNAL_MASTER,
 };
 
-SDL_Surface     *screen;
+SDL_Window      *screen;
 
 /* Since we only have one decoding thread, the Big Struct
    can be global in case we need it. */
 VideoState *global_video_state;
-AVPacket flush_pkt;
 
-void packet_queue_init(PacketQueue *q) {
-  memset(q, 0, sizeof(PacketQueue));
-  q->mutex = SDL_CreateMutex();
-  q->cond = SDL_CreateCond();
+/* Decoder threading from -threads/-thread_type. 0 threads means one
+   per core; the type is any mix of FF_THREAD_FRAME and FF_THREAD_SLICE. */
+int decoder_thread_count = 0;
+int decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+/* Producer side, after a put: items, bytes and duration are what the
+   queue holds now. */
+void queue_stats_put(QueueStats *s, int items, int64_t bytes, int64_t duration) {
+  s->puts++;
+  s->max_items = FFMAX(s->max_items, items);
+  s->max_bytes = FFMAX(s->max_bytes, bytes);
+  s->max_duration = FFMAX(s->max_duration, duration);
 }
-int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
+/* Consumer side, for an item put at queued_time */
+void queue_stats_get(QueueStats *s, int64_t queued_time) {
+  int64_t latency = av_gettime() - queued_time;
+  int64_t ms = latency / 1000;
+  int bucket = 0;
+
+  while(ms > 0 && bucket < LATENCY_BUCKETS - 1) {
+    ms >>= 1;
+    bucket++;
+  }
+  s->gets++;
+  s->latency[bucket]++;
+  s->max_latency = FFMAX(s->max_latency, latency);
+  s->total_latency += latency;
+}
+/* The bucket bound in ms that fraction of the latencies were under, or
+   -1 when that is past the last bound */
+int queue_stats_percentile(QueueStats *s, double fraction) {
+  int64_t count = 0;
+  int i;
 
-  AVPacketList *pkt1;
-  if(pkt != &flush_pkt && av_dup_packet(pkt) < 0) {
-    return -1;
+  for(i = 0; i < LATENCY_BUCKETS - 1; i++) {
+    count += s->latency[i];
+    if(count >= fraction * s->gets) {
+      return 1 << i;
+    }
   }
-  pkt1 = av_malloc(sizeof(AVPacketList));
-  if (!pkt1)
-    return -1;
-  pkt1->pkt = *pkt;
-  pkt1->next = NULL;
+  return -1;
+}
+/* One queue as a JSON object; items, bytes and duration are what it
+   holds right now. */
+void queue_stats_json(FILE *f, const char *name, QueueStats *s,
+		      int items, int64_t bytes, int64_t duration) {
+  int i;
+
+  fprintf(f, "  \"%s\": {\n", name);
+  fprintf(f, "    \"items\": %d, \"bytes\": %" PRId64 ", \"duration_us\": %" PRId64 ",\n",
+	  items, bytes, duration);
+  fprintf(f, "    \"max_items\": %d, \"max_bytes\": %" PRId64 ", \"max_duration_us\": %" PRId64 ",\n",
+	  s->max_items, s->max_bytes, s->max_duration);
+  fprintf(f, "    \"puts\": %" PRId64 ", \"gets\": %" PRId64 ",\n", s->puts, s->gets);
+  fprintf(f, "    \"producer_waits\": %d, \"producer_wait_us\": %" PRId64 ",\n",
+	  s->producer_waits, s->producer_wait_time);
+  fprintf(f, "    \"consumer_waits\": %d, \"consumer_wait_us\": %" PRId64 ",\n",
+	  s->consumer_waits, s->consumer_wait_time);
+  fprintf(f, "    \"latency_max_us\": %" PRId64 ", \"latency_mean_us\": %" PRId64 ",\n",
+	  s->max_latency, s->gets ? s->total_latency / s->gets : 0);
+  /* counts[i] is for latencies under bounds_ms[i], the last one for the rest */
+  fprintf(f, "    \"latency_hist\": {\"bounds_ms\": [");
+  for(i = 0; i < LATENCY_BUCKETS - 1; i++) {
+    fprintf(f, "%s%d", i ? ", " : "", 1 << i);
+  }
+  fprintf(f, "], \"counts\": [");
+  for(i = 0; i < LATENCY_BUCKETS; i++) {
+    fprintf(f, "%s%d", i ? ", " : "", s->latency[i]);
+  }
+  fprintf(f, "]}\n  }");
+}
+/* CPU time in us: of the calling thread for CLOCK_THREAD_CPUTIME_ID, of
+   all of them for CLOCK_PROCESS_CPUTIME_ID */
+int64_t cpu_time_us(clockid_t clock) {
+  struct timespec ts;
 
+  if(clock_gettime(clock, &ts) < 0) {
+    return 0;
+  }
+  return ts.tv_sec * (int64_t)1000000 + ts.tv_nsec / 1000;
+}
+/* With -bench, keep the CPU time the calling thread has used so far in
+   *slot. Threads do this after every packet or picture, so what the
+   report reads at quit is at most one of them behind. */
+void bench_cpu_mark(VideoState *is, int64_t *slot) {
+  if(is->bench) {
+    *slot = cpu_time_us(CLOCK_THREAD_CPUTIME_ID);
+  }
+}
+void packet_queue_init(PacketQueue *q, AVRational time_base) {
+  memset(q, 0, sizeof(PacketQueue));
+  q->time_base = time_base;
+  q->capacity = PACKET_QUEUE_CAPACITY;
+  q->pkts = av_mallocz(q->capacity * sizeof(QueuedPacket));
+  q->mutex = SDL_CreateMutex();
+  q->not_empty = SDL_CreateCond();
+  q->not_full = SDL_CreateCond();
+}
+int packet_queue_nb_packets(PacketQueue *q) {
+  return (unsigned)SDL_AtomicGet(&q->tail) - (unsigned)SDL_AtomicGet(&q->head);
+}
+int packet_queue_size(PacketQueue *q) {
+  return SDL_AtomicGet(&q->size);
+}
+/* The playback the consumers should be decoding for; anything tagged
+   with an older serial was queued or decoded before a seek. */
+int packet_queue_serial(PacketQueue *q) {
+  return SDL_AtomicGet(&q->serial);
+}
+/* pkt's duration in AV_TIME_BASE units */
+int packet_queue_pkt_duration(PacketQueue *q, AVPacket *pkt) {
+  return av_rescale_q(pkt->duration, q->time_base, AV_TIME_BASE_Q);
+}
+/* Whether the demuxer should stop reading for now */
+int packet_queue_full(PacketQueue *q) {
+  return SDL_AtomicGet(&q->duration) > MAX_QUEUE_DURATION ||
+    packet_queue_size(q) > MAX_QUEUE_SIZE;
+}
+/* Wake up both sides, e.g. when quitting or seeking. */
+void packet_queue_abort(PacketQueue *q) {
   SDL_LockMutex(q->mutex);
+  SDL_CondBroadcast(q->not_empty);
+  SDL_CondBroadcast(q->not_full);
+  SDL_UnlockMutex(q->mutex);
+}
+int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
 
-  if (!q->last_pkt)
-    q->first_pkt = pkt1;
-  else
-    q->last_pkt->next = pkt1;
-  q->last_pkt = pkt1;
-  q->nb_packets++;
-  q->size += pkt1->pkt.size;
-  SDL_CondSignal(q->cond);
+  unsigned int tail;
+  QueuedPacket *slot;
+  int64_t wait_start;
+
+  if(packet_queue_nb_packets(q) >= q->capacity) {
+    /* ring is full: sleep until the consumer frees a slot */
+    wait_start = av_gettime();
+    q->stats.producer_waits++;
+    SDL_LockMutex(q->mutex);
+    SDL_AtomicSet(&q->producer_waiting, 1);
+    while(packet_queue_nb_packets(q) >= q->capacity &&
+	  !global_video_state->quit) {
+      SDL_CondWait(q->not_full, q->mutex);
+    }
+    SDL_AtomicSet(&q->producer_waiting, 0);
+    SDL_UnlockMutex(q->mutex);
+    q->stats.producer_wait_time += av_gettime() - wait_start;
+    if(global_video_state->quit) {
+      return -1;
+    }
+  }
 
-  SDL_UnlockMutex(q->mutex);
+  tail = SDL_AtomicGet(&q->tail);
+  slot = &q->pkts[tail & (q->capacity - 1)];
+  /* take over the caller's reference, leaving pkt blank, so the payload
+     goes on to the decoder as it is; only a payload the demuxer still
+     owns has to be copied */
+  if(pkt->buf || !pkt->data) {
+    av_packet_move_ref(&slot->pkt, pkt);
+  } else {
+    if(av_packet_ref(&slot->pkt, pkt) < 0) {
+      return -1;
+    }
+    q->copied_bytes += pkt->size;
+    av_packet_unref(pkt);
+  }
+  slot->serial = packet_queue_serial(q);
+  slot->queued_time = av_gettime();
+  q->put_duration += packet_queue_pkt_duration(q, &slot->pkt);
+  SDL_AtomicAdd(&q->size, slot->pkt.size);
+  SDL_AtomicAdd(&q->duration, packet_queue_pkt_duration(q, &slot->pkt));
+  /* publish the slot */
+  SDL_AtomicSet(&q->tail, tail + 1);
+  queue_stats_put(&q->stats, packet_queue_nb_packets(q), packet_queue_size(q),
+		  SDL_AtomicGet(&q->duration));
+
+  if(SDL_AtomicGet(&q->consumer_waiting)) {
+    SDL_LockMutex(q->mutex);
+    SDL_CondSignal(q->not_empty);
+    SDL_UnlockMutex(q->mutex);
+  }
   return 0;
 }
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
+/* Packets queued before the last seek are dropped here. On success
+   *serial is set to the serial of the packet returned. */
+static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *serial)
 {
-  AVPacketList *pkt1;
-  int ret;
-
-  SDL_LockMutex(q->mutex);
+  unsigned int head;
+  int64_t wait_start;
 
   for(;;) {
 
     if(global_video_state->quit) {
-      ret = -1;
-      break;
+      return -1;
     }
 
-    pkt1 = q->first_pkt;
-    if (pkt1) {
-      q->first_pkt = pkt1->next;
-      if (!q->first_pkt)
-	q->last_pkt = NULL;
-      q->nb_packets--;
-      q->size -= pkt1->pkt.size;
-      *pkt = pkt1->pkt;
-      av_free(pkt1);
-      ret = 1;
-      break;
-    } else if (!block) {
-      ret = 0;
-      break;
-    } else {
-      SDL_CondWait(q->cond, q->mutex);
+    if(packet_queue_nb_packets(q) == 0) {
+      if(!block) {
+	return 0;
+      }
+      wait_start = av_gettime();
+      q->stats.consumer_waits++;
+      SDL_LockMutex(q->mutex);
+      SDL_AtomicSet(&q->consumer_waiting, 1);
+      while(packet_queue_nb_packets(q) == 0 &&
+	    !global_video_state->quit) {
+	SDL_CondWait(q->not_empty, q->mutex);
+      }
+      SDL_AtomicSet(&q->consumer_waiting, 0);
+      SDL_UnlockMutex(q->mutex);
+      q->stats.consumer_wait_time += av_gettime() - wait_start;
+      continue;
+    }
+
+    head = SDL_AtomicGet(&q->head);
+    av_packet_move_ref(pkt, &q->pkts[head & (q->capacity - 1)].pkt);
+    *serial = q->pkts[head & (q->capacity - 1)].serial;
+    q->last_queued_time = q->pkts[head & (q->capacity - 1)].queued_time;
+    queue_stats_get(&q->stats, q->last_queued_time);
+    SDL_AtomicAdd(&q->size, -pkt->size);
+    SDL_AtomicAdd(&q->duration, -packet_queue_pkt_duration(q, pkt));
+    /* hand the slot back to the producer */
+    SDL_AtomicSet(&q->head, head + 1);
+
+    if(SDL_AtomicGet(&q->producer_waiting)) {
+      SDL_LockMutex(q->mutex);
+      SDL_CondSignal(q->not_full);
+      SDL_UnlockMutex(q->mutex);
     }
+
+    if(*serial != packet_queue_serial(q)) {
+      /* queued before a seek: drop it and keep going */
+      av_free_packet(pkt);
+      continue;
+    }
+    return 1;
   }
-  SDL_UnlockMutex(q->mutex);
-  return ret;
 }
-static void packet_queue_flush(PacketQueue *q) {
-  AVPacketList *pkt, *pkt1;
+/* Block the demuxer until q has room, or a seek or quit needs it.
+   Sleeps on not_full like a put into a full ring, so the consumer's
+   wake-up covers both. Returns -1 when quitting. */
+int packet_queue_wait_space(PacketQueue *q) {
+
+  int64_t wait_start;
 
+  if(!packet_queue_full(q)) {
+    return 0;
+  }
+  wait_start = av_gettime();
+  q->stats.producer_waits++;
   SDL_LockMutex(q->mutex);
-  for(pkt = q->first_pkt; pkt != NULL; pkt = pkt1) {
-    pkt1 = pkt->next;
-    av_free_packet(&pkt->pkt);
-    av_freep(&pkt);
-  }
-  q->last_pkt = NULL;
-  q->first_pkt = NULL;
-  q->nb_packets = 0;
-  q->size = 0;
+  SDL_AtomicSet(&q->producer_waiting, 1);
+  while(packet_queue_full(q) && !global_video_state->seek_req &&
+	!global_video_state->quit) {
+    SDL_CondWait(q->not_full, q->mutex);
+  }
+  SDL_AtomicSet(&q->producer_waiting, 0);
   SDL_UnlockMutex(q->mutex);
+  q->stats.producer_wait_time += av_gettime() - wait_start;
+  return global_video_state->quit ? -1 : 0;
+}
+/* Queue an empty packet, which tells the decoder reading q that the
+   file has ended and it should hand out the frames it is still holding. */
+int packet_queue_put_nullpacket(PacketQueue *q, int stream_index) {
+  AVPacket pkt1, *pkt = &pkt1;
+
+  av_init_packet(pkt);
+  pkt->data = NULL;
+  pkt->size = 0;
+  pkt->stream_index = stream_index;
+  return packet_queue_put(q, pkt);
+}
+/* Called by the producer only. Nothing already queued or decoded is
+   touched here; every consumer discards what carries an older serial
+   when it gets to it, and the decoders flush on the first packet with
+   the new one. */
+static void packet_queue_flush(PacketQueue *q) {
+  SDL_AtomicAdd(&q->serial, 1);
+}
+int pcm_ring_init(PcmRing *r, int capacity) {
+  memset(r, 0, sizeof(PcmRing));
+  r->buf = av_malloc(capacity);
+  r->space = SDL_CreateSemaphore(0);
+  r->data = SDL_CreateSemaphore(0);
+  if(!r->buf || !r->space || !r->data) {
+    return -1;
+  }
+  r->capacity = capacity;
+  SDL_AtomicSet(&r->fill_low, capacity);
+  return 0;
+}
+/* Wake a writer waiting for room, or a reader waiting for samples, so
+   that it sees quit */
+void pcm_ring_abort(PcmRing *r) {
+  if(r->space) {
+    SDL_SemPost(r->space);
+  }
+  if(r->data) {
+    SDL_SemPost(r->data);
+  }
+}
+int pcm_ring_fill(PcmRing *r) {
+  return (unsigned)SDL_AtomicGet(&r->write_pos) - (unsigned)SDL_AtomicGet(&r->read_pos);
+}
+/* Copy as much of data, decoded for playback serial, as fits, waiting
+   for room if the ring is full. Returns the number of bytes written, or
+   -1 when quitting. */
+int pcm_ring_write(PcmRing *r, const uint8_t *data, int len, int serial) {
+  unsigned int pos;
+  int space, off, len1;
+
+  if(serial != SDL_AtomicGet(&r->data_serial)) {
+    /* first samples after a seek: the reader skips everything before
+       them. data_start has to be visible before the serial is. */
+    SDL_AtomicSet(&r->data_start, SDL_AtomicGet(&r->write_pos));
+    SDL_AtomicSet(&r->data_serial, serial);
+  }
+  for(;;) {
+    if(global_video_state->quit) {
+      return -1;
+    }
+    space = r->capacity - pcm_ring_fill(r);
+    if(space > 0) {
+      break;
+    }
+    SDL_AtomicSet(&r->writer_waiting, 1);
+    if(r->capacity - pcm_ring_fill(r) == 0 && !global_video_state->quit) {
+      /* posted by the reader, or by pcm_ring_abort on quit */
+      SDL_SemWait(r->space);
+    }
+    SDL_AtomicSet(&r->writer_waiting, 0);
+  }
+  if(len > space) {
+    len = space;
+  }
+  pos = SDL_AtomicGet(&r->write_pos);
+  off = pos & (r->capacity - 1);
+  len1 = r->capacity - off;
+  if(len1 > len) {
+    len1 = len;
+  }
+  memcpy(r->buf + off, data, len1);
+  memcpy(r->buf, data + len1, len - len1);
+  SDL_AtomicSet(&r->write_pos, pos + len);
+
+  if(SDL_AtomicCAS(&r->reader_waiting, 1, 0)) {
+    SDL_SemPost(r->data);
+  }
+  return len;
+}
+/* Block until there are samples to read or quit. Only for a reader that
+   may wait, which audio_callback may not. */
+void pcm_ring_wait_data(PcmRing *r) {
+  SDL_AtomicSet(&r->reader_waiting, 1);
+  if(pcm_ring_fill(r) == 0 && !global_video_state->quit) {
+    SDL_SemWait(r->data);
+  }
+  SDL_AtomicSet(&r->reader_waiting, 0);
+}
+/* Never blocks. Samples written for an older playback serial than
+   serial are dropped unplayed. Returns the number of bytes copied, which
+   is less than len when the audio thread has fallen behind. */
+int pcm_ring_read(PcmRing *r, uint8_t *stream, int len, int serial) {
+  unsigned int pos, end, start;
+  int fill, off, len1;
+
+  /* write_pos is read before data_serial, so end can't include
+     samples of a serial this callback hasn't seen yet */
+  pos = SDL_AtomicGet(&r->read_pos);
+  end = SDL_AtomicGet(&r->write_pos);
+  if(SDL_AtomicGet(&r->data_serial) != serial) {
+    /* nothing written since the seek yet: all of it is stale */
+    SDL_AtomicSet(&r->read_pos, end);
+  } else {
+    start = SDL_AtomicGet(&r->data_start);
+    if((int)(start - pos) > 0) {
+      SDL_AtomicSet(&r->read_pos, start);
+    }
+  }
+
+  fill = pcm_ring_fill(r);
+  if(fill < SDL_AtomicGet(&r->fill_low)) {
+    SDL_AtomicSet(&r->fill_low, fill);
+  }
+  if(len > fill) {
+    len = fill;
+  }
+  pos = SDL_AtomicGet(&r->read_pos);
+  off = pos & (r->capacity - 1);
+  len1 = r->capacity - off;
+  if(len1 > len) {
+    len1 = len;
+  }
+  memcpy(stream, r->buf + off, len1);
+  memcpy(stream + len1, r->buf, len - len1);
+  SDL_AtomicSet(&r->read_pos, pos + len);
+
+  if(SDL_AtomicCAS(&r->writer_waiting, 1, 0)) {
+    SDL_SemPost(r->space);
+  }
+  return len;
 }
 double get_audio_clock(VideoState *is) {
   double pts;
   int hw_buf_size, bytes_per_sec, n;
 
   pts = is->audio_clock; /* maintained in the audio thread */
-  hw_buf_size = is->audio_buf_size - is->audio_buf_index;
+  /* audio_clock is the pts of the end of what the audio thread decoded;
+     whatever is still in the ring or waiting to go in has not been heard */
+  hw_buf_size = pcm_ring_fill(&is->audio_ring) +
+    is->audio_buf_size - is->audio_buf_index;
   bytes_per_sec = 0;
   n = is->audio_st->codec->channels * 2;
   if(is->audio_st) {
@@ -298,197 +788,251 @@ int synchronize_audio(VideoState *is, short *samples,
   return samples_size;
 }
 
-int decode_frame_from_packet(VideoState *is, AVFrame decoded_frame)
+/* Convert a decoded frame to packed S16 straight into is->audio_buf. The
+   resampler is configured once and only rebuilt when the frame's layout,
+   rate or format differs from what it was set up for. */
+int decode_frame_from_packet(VideoState *is, AVFrame *decoded_frame)
 {
-	int64_t src_ch_layout, dst_ch_layout;
-	int src_rate, dst_rate;
-	uint8_t **src_data = NULL, **dst_data = NULL;
-	int src_nb_channels = 0, dst_nb_channels = 0;
-	int src_linesize, dst_linesize;
-	int src_nb_samples, dst_nb_samples, max_dst_nb_samples;
-	enum AVSampleFormat src_sample_fmt, dst_sample_fmt;
+	int64_t src_ch_layout;
+	int src_rate;
+	enum AVSampleFormat src_sample_fmt;
+	uint8_t *dst_data[1];
+	int dst_nb_channels, max_dst_nb_samples;
 	int dst_bufsize;
 	int ret;
+	int64_t start;
 
-	src_nb_samples = decoded_frame.nb_samples;
-	src_linesize = (int) decoded_frame.linesize;
-	src_data = decoded_frame.data;
-
-	if (decoded_frame.channel_layout == 0) {
-		decoded_frame.channel_layout = av_get_default_channel_layout(decoded_frame.channels);
-	}
-
-	src_rate = decoded_frame.sample_rate;
-	dst_rate = decoded_frame.sample_rate;
-	src_ch_layout = decoded_frame.channel_layout;
-	dst_ch_layout = decoded_frame.channel_layout;
-	src_sample_fmt = decoded_frame.format;
-	dst_sample_fmt = AV_SAMPLE_FMT_S16;
-
-	av_opt_set_int(is->sws_ctx_audio, "in_channel_layout", src_ch_layout, 0);
-	av_opt_set_int(is->sws_ctx_audio, "out_channel_layout", dst_ch_layout,  0);
-	av_opt_set_int(is->sws_ctx_audio, "in_sample_rate", src_rate, 0);
-	av_opt_set_int(is->sws_ctx_audio, "out_sample_rate", dst_rate, 0);
-	av_opt_set_sample_fmt(is->sws_ctx_audio, "in_sample_fmt", src_sample_fmt, 0);
-	av_opt_set_sample_fmt(is->sws_ctx_audio, "out_sample_fmt", dst_sample_fmt,  0);
-
-	/* initialize the resampling context */
-	if ((ret = swr_init(is->sws_ctx_audio)) < 0) {
-		fprintf(stderr, "Failed to initialize the resampling context\n");
-		return -1;
-	}
-
-	/* allocate source and destination samples buffers */
-	src_nb_channels = av_get_channel_layout_nb_channels(src_ch_layout);
-	ret = av_samples_alloc_array_and_samples(&src_data, &src_linesize, src_nb_channels, src_nb_samples, src_sample_fmt, 0);
-	if (ret < 0) {
-		fprintf(stderr, "Could not allocate source samples\n");
-		return -1;
+	src_ch_layout = decoded_frame->channel_layout;
+	if (src_ch_layout == 0) {
+		src_ch_layout = av_get_default_channel_layout(decoded_frame->channels);
 	}
-
-	/* compute the number of converted samples: buffering is avoided
-	 * ensuring that the output buffer will contain at least all the
-	 * converted input samples */
-	max_dst_nb_samples = dst_nb_samples = av_rescale_rnd(src_nb_samples, dst_rate, src_rate, AV_ROUND_UP);
-
-	/* buffer is going to be directly written to a rawaudio file, no alignment */
-	dst_nb_channels = av_get_channel_layout_nb_channels(dst_ch_layout);
-	ret = av_samples_alloc_array_and_samples(&dst_data, &dst_linesize, dst_nb_channels, dst_nb_samples, dst_sample_fmt, 0);
-	if (ret < 0) {
-		fprintf(stderr, "Could not allocate destination samples\n");
-		return -1;
+	src_rate = decoded_frame->sample_rate;
+	src_sample_fmt = decoded_frame->format;
+
+	if (!is->audio_swr_configured ||
+	    src_ch_layout != is->audio_src_ch_layout ||
+	    src_rate != is->audio_src_rate ||
+	    src_sample_fmt != is->audio_src_fmt) {
+		/* same layout and rate out, only the sample format changes */
+		if (!swr_alloc_set_opts(is->sws_ctx_audio,
+					src_ch_layout, AV_SAMPLE_FMT_S16, src_rate,
+					src_ch_layout, src_sample_fmt, src_rate,
+					0, NULL)) {
+			fprintf(stderr, "Could not configure the resampling context\n");
+			return -1;
+		}
+		if ((ret = swr_init(is->sws_ctx_audio)) < 0) {
+			fprintf(stderr, "Failed to initialize the resampling context\n");
+			is->audio_swr_configured = 0;
+			return -1;
+		}
+		is->audio_src_ch_layout = src_ch_layout;
+		is->audio_src_rate = src_rate;
+		is->audio_src_fmt = src_sample_fmt;
+		is->audio_swr_configured = 1;
 	}
 
-	/* compute destination number of samples */
-	dst_nb_samples = av_rescale_rnd(swr_get_delay(is->sws_ctx_audio, src_rate) + src_nb_samples, dst_rate, src_rate, AV_ROUND_UP);
+	/* leave the tail of audio_buf free for synchronize_audio to stretch into */
+	dst_nb_channels = av_get_channel_layout_nb_channels(src_ch_layout);
+	max_dst_nb_samples = MAX_AUDIO_FRAME_SIZE /
+		(dst_nb_channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16));
+	dst_data[0] = is->audio_buf;
 
 	/* convert to destination format */
-	ret = swr_convert(is->sws_ctx_audio, dst_data, dst_nb_samples, (const uint8_t **)decoded_frame.data, src_nb_samples);
+	start = trace_begin();
+	ret = swr_convert(is->sws_ctx_audio, dst_data, max_dst_nb_samples,
+			  (const uint8_t **)decoded_frame->extended_data,
+			  decoded_frame->nb_samples);
+	trace_end("swr_convert", start);
 	if (ret < 0) {
 		fprintf(stderr, "Error while converting\n");
 		return -1;
 	}
 
-	dst_bufsize = av_samples_get_buffer_size(&dst_linesize, dst_nb_channels, ret, dst_sample_fmt, 1);
+	dst_bufsize = av_samples_get_buffer_size(NULL, dst_nb_channels, ret, AV_SAMPLE_FMT_S16, 1);
 	if (dst_bufsize < 0) {
 		fprintf(stderr, "Could not get sample buffer size\n");
 		return -1;
 	}
 
-	memcpy(is->audio_buf, dst_data[0], dst_bufsize);
-
-	if (src_data) {
-		av_freep(&src_data[0]);
-	}
-	av_freep(&src_data);
+	return dst_bufsize;
+}
 
-	if (dst_data) {
-		av_freep(&dst_data[0]);
-	}
-	av_freep(&dst_data);
+/* avcodec_receive_frame as a trace span */
+int receive_frame_traced(AVCodecContext *codecCtx, AVFrame *frame, const char *span) {
+  int64_t start = trace_begin();
+  int ret = avcodec_receive_frame(codecCtx, frame);
 
-	return dst_bufsize;
+  trace_end(span, start);
+  return ret;
 }
 
 int audio_decode_frame(VideoState *is, double *pts_ptr) {
 
-  int len1, data_size = 0, n;
+  int data_size, n, serial, ret;
   AVPacket *pkt = &is->audio_pkt;
+  AVCodecContext *codecCtx = is->audio_st->codec;
   double pts;
+  int64_t start;
 
   for(;;) {
-    while(is->audio_pkt_size > 0) {
-      int got_frame = 0;
-      len1 = avcodec_decode_audio4(is->audio_st->codec, &is->audio_frame, &got_frame, pkt);
-      if(len1 < 0) {
-	/* if error, skip frame */
-	is->audio_pkt_size = 0;
-	break;
-      }
-      if (got_frame)
-      {
-    	  if (is->audio_frame.format != AV_SAMPLE_FMT_S16) {
-    		  data_size = decode_frame_from_packet(is, is->audio_frame);
-    	  } else {
-            data_size =
-              av_samples_get_buffer_size
-              (
-                  NULL,
-                  is->audio_st->codec->channels,
-                  is->audio_frame.nb_samples,
-                  is->audio_st->codec->sample_fmt,
-                  1
-              );
-            memcpy(is->audio_buf, is->audio_frame.data[0], data_size);
-    	  }
+    /* a packet can hold several frames: hand them all out before
+       sending the decoder another one */
+    while((ret = receive_frame_traced(codecCtx, &is->audio_frame, "decode audio")) == 0) {
+      if (is->audio_frame.format != AV_SAMPLE_FMT_S16) {
+	data_size = decode_frame_from_packet(is, &is->audio_frame);
+      } else {
+	data_size =
+	  av_samples_get_buffer_size
+	  (
+	      NULL,
+	      codecCtx->channels,
+	      is->audio_frame.nb_samples,
+	      codecCtx->sample_fmt,
+	      1
+	  );
+	memcpy(is->audio_buf, is->audio_frame.data[0], data_size);
       }
-      is->audio_pkt_data += len1;
-      is->audio_pkt_size -= len1;
       if(data_size <= 0) {
 	/* No data yet, get more frames */
 	continue;
       }
+      /* if update, update the audio clock w/pts; frames after the first
+	 in a packet have none and just carry on from the last one */
+      if(is->audio_frame.best_effort_timestamp != AV_NOPTS_VALUE) {
+	is->audio_clock = av_q2d(is->audio_st->time_base) *
+	  is->audio_frame.best_effort_timestamp;
+      }
       pts = is->audio_clock;
       *pts_ptr = pts;
-      n = 2 * is->audio_st->codec->channels;
+      n = 2 * codecCtx->channels;
       is->audio_clock += (double)data_size /
-	(double)(n * is->audio_st->codec->sample_rate);
+	(double)(n * codecCtx->sample_rate);
 
       /* We have data, return it and come back for more later */
       return data_size;
     }
-    if(pkt->data)
-      av_free_packet(pkt);
+    if(ret == AVERROR_EOF) {
+      is->audio_drained = 1;
+    }
 
     if(is->quit) {
       return -1;
     }
     /* next packet */
-    if(packet_queue_get(&is->audioq, pkt, 1) < 0) {
+    if(packet_queue_get(&is->audioq, pkt, 1, &serial) < 0) {
       return -1;
     }
-    if(pkt->data == flush_pkt.data) {
-      avcodec_flush_buffers(is->audio_st->codec);
+    if(serial != is->audio_pkt_serial) {
+      /* first packet after a seek; also takes the decoder out of
+	 draining after end of file */
+      avcodec_flush_buffers(codecCtx);
+      is->audio_pkt_serial = serial;
+      is->audio_drained = 0;
+    }
+    /* an empty packet means end of file: drain the decoder. A packet the
+       decoder rejects is skipped. */
+    start = trace_begin();
+    avcodec_send_packet(codecCtx, pkt->data ? pkt : NULL);
+    trace_end("decode audio", start);
+    av_free_packet(pkt);
+  }
+}
+
+/* Decodes ahead of the device so that a slow packet or codec call never
+   stalls the real-time audio callback. */
+int audio_thread(void *arg) {
+
+  VideoState *is = (VideoState *)arg;
+  int audio_size, len1;
+  double pts;
+
+  trace_thread_name("audio decode");
+  for(;;) {
+    audio_size = audio_decode_frame(is, &pts);
+    if(audio_size < 0) {
+      /* means we quit getting packets */
+      break;
+    }
+    if(is->audio_pkt_serial != packet_queue_serial(&is->audioq)) {
+      /* decoded before a seek */
       continue;
     }
-    is->audio_pkt_data = pkt->data;
-    is->audio_pkt_size = pkt->size;
-    /* if update, update the audio clock w/pts */
-    if(pkt->pts != AV_NOPTS_VALUE) {
-      is->audio_clock = av_q2d(is->audio_st->time_base)*pkt->pts;
+    audio_size = synchronize_audio(is, (int16_t *)is->audio_buf,
+				   audio_size, pts);
+    is->audio_buf_size = audio_size;
+    is->audio_buf_index = 0;
+    while(is->audio_buf_index < is->audio_buf_size &&
+	  is->audio_pkt_serial == packet_queue_serial(&is->audioq)) {
+      len1 = pcm_ring_write(&is->audio_ring,
+			    (uint8_t *)is->audio_buf + is->audio_buf_index,
+			    is->audio_buf_size - is->audio_buf_index,
+			    is->audio_pkt_serial);
+      if(len1 < 0) {
+	return 0;
+      }
+      is->audio_buf_index += len1;
     }
+    bench_cpu_mark(is, &is->cpu_time[STAGE_AUDIO_DECODE]);
   }
+  return 0;
 }
 
 void audio_callback(void *userdata, Uint8 *stream, int len) {
 
   VideoState *is = (VideoState *)userdata;
-  int len1, audio_size;
-  double pts;
+  int len1;
+  int64_t start;
+
+  /* SDL's thread; only the first call there names it */
+  trace_thread_name("audio callback");
+  start = trace_begin();
+  len1 = pcm_ring_read(&is->audio_ring, stream, len,
+		       packet_queue_serial(&is->audioq));
+  if(len1 < len) {
+    /* the audio thread is behind: play silence rather than wait */
+    memset(stream + len1, 0, len - len1);
+    SDL_AtomicAdd(&is->audio_ring.underruns, 1);
+    SDL_AtomicAdd(&is->audio_ring.silence_bytes, len - len1);
+  }
+  trace_end("audio_callback", start);
+}
 
-  while(len > 0) {
-    if(is->audio_buf_index >= is->audio_buf_size) {
-      /* We have already sent all our data; get more */
-      audio_size = audio_decode_frame(is, &pts);
-      if(audio_size < 0) {
-	/* If error, output silence */
-	is->audio_buf_size = 1024;
-	memset(is->audio_buf, 0, is->audio_buf_size);
-      } else {
-	audio_size = synchronize_audio(is, (int16_t *)is->audio_buf,
-				       audio_size, pts);
-	is->audio_buf_size = audio_size;
+/* What -bench has instead of an audio device. With BENCH_REALTIME it
+   calls audio_callback once per device buffer at the rate the device
+   would; otherwise it takes whatever the audio thread has written as
+   soon as it is there. */
+int audio_sink_thread(void *arg) {
+
+  VideoState *is = (VideoState *)arg;
+  uint8_t *buf;
+  int64_t period, next, now;
+  int bytes_per_sec;
+
+  trace_thread_name("audio sink");
+  buf = av_malloc(is->audio_hw_buf_size);
+  if(!buf) {
+    return -1;
+  }
+  bytes_per_sec = is->audio_st->codec->sample_rate * is->audio_st->codec->channels * 2;
+  period = (int64_t)is->audio_hw_buf_size * 1000000 / bytes_per_sec;
+  next = av_gettime();
+  while(!is->quit) {
+    if(is->bench == BENCH_REALTIME) {
+      next += period;
+      now = av_gettime();
+      if(next > now) {
+	av_usleep(next - now);
       }
-      is->audio_buf_index = 0;
+      audio_callback(is, buf, is->audio_hw_buf_size);
+    } else if(pcm_ring_read(&is->audio_ring, buf, is->audio_hw_buf_size,
+			    packet_queue_serial(&is->audioq)) == 0) {
+      pcm_ring_wait_data(&is->audio_ring);
     }
-    len1 = is->audio_buf_size - is->audio_buf_index;
-    if(len1 > len)
-      len1 = len;
-    memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
-    len -= len1;
-    stream += len1;
-    is->audio_buf_index += len1;
+    bench_cpu_mark(is, &is->cpu_time[STAGE_AUDIO_SINK]);
   }
+  av_free(buf);
+  return 0;
 }
 
 static Uint32 sdl_refresh_timer_cb(Uint32 interval, void *opaque) {
@@ -499,22 +1043,240 @@ static Uint32 sdl_refresh_timer_cb(Uint32 interval, void *opaque) {
   return 0; /* 0 means stop timer */
 }
 
-/* schedule a video refresh in 'delay' ms */
+/* schedule a video refresh in 'delay' ms; 0 means as soon as the event
+   loop gets to it */
 static void schedule_refresh(VideoState *is, int delay) {
-  SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
+  if(delay == 0) {
+    sdl_refresh_timer_cb(0, is);
+  } else {
+    SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
+  }
+}
+
+/* (Re)allocate the YUV420P frame that pictures SDL can't show directly
+   are converted into. After the first picture only a resolution change
+   gets here. */
+int display_frame_alloc(VideoState *is, int width, int height) {
+
+  av_frame_free(&is->display_frame);
+  is->display_frame = av_frame_alloc();
+  if(!is->display_frame) {
+    return -1;
+  }
+  is->display_frame->format = AV_PIX_FMT_YUV420P;
+  is->display_frame->width = width;
+  is->display_frame->height = height;
+  if(av_frame_get_buffer(is->display_frame, 32) < 0) {
+    av_frame_free(&is->display_frame);
+    return -1;
+  }
+  return 0;
+}
+
+/* Convert rows y..y+h of src into the same rows of dst, treating the
+   band as an image of its own: a SwsContext only takes slices in order
+   from the top, so a band can't be passed in as a srcSliceY slice of the
+   whole picture. Bands start on a multiple of 16 rows, which keeps the
+   chroma planes lined up. */
+int convert_band(struct SwsContext **ctx, AVFrame *src, AVFrame *dst, int y, int h) {
+
+  const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(src->format);
+  const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(dst->format);
+  const uint8_t *src_data[4];
+  uint8_t *dst_data[4];
+  int64_t start;
+  int i;
+
+  *ctx = sws_getCachedContext(*ctx, src->width, h, src->format,
+			      dst->width, h, dst->format,
+			      SWS_BILINEAR, NULL, NULL, NULL);
+  if(!*ctx || !src_desc || !dst_desc) {
+    return -1;
+  }
+  for(i = 0; i < 4; i++) {
+    src_data[i] = src->data[i] ? src->data[i] +
+      (i == 1 || i == 2 ? y >> src_desc->log2_chroma_h : y) * src->linesize[i] : NULL;
+    dst_data[i] = dst->data[i] ? dst->data[i] +
+      (i == 1 || i == 2 ? y >> dst_desc->log2_chroma_h : y) * dst->linesize[i] : NULL;
+  }
+  start = trace_begin();
+  sws_scale(*ctx, src_data, src->linesize, 0, h, dst_data, dst->linesize);
+  trace_end("sws_scale", start);
+  return 0;
+}
+
+/* Convert src into dst, split into bands across the helper threads when
+   the frame is tall enough to make that worth it. */
+int convert_picture(VideoState *is, AVFrame *src, AVFrame *dst) {
+
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src->format);
+  int nb_bands, rows, y, i, ret;
+
+  nb_bands = is->convert_threads;
+  if(nb_bands > src->height / CONVERT_MIN_BAND_ROWS) {
+    nb_bands = src->height / CONVERT_MIN_BAND_ROWS;
+  }
+  if(nb_bands <= 1 || !desc || (desc->flags & AV_PIX_FMT_FLAG_PAL)) {
+    return convert_band(&is->sws_ctx, src, dst, 0, src->height);
+  }
+
+  rows = (src->height / nb_bands) & ~15;
+  SDL_LockMutex(is->convert_mutex);
+  for(i = 0, y = 0; i < nb_bands; i++, y += rows) {
+    is->convert_bands[i].y = y;
+    is->convert_bands[i].h = i == nb_bands - 1 ? src->height - y : rows;
+  }
+  is->convert_src = src;
+  is->convert_dst = dst;
+  is->convert_nb_bands = nb_bands;
+  is->convert_pending = nb_bands - 1;
+  is->convert_generation++;
+  SDL_CondBroadcast(is->convert_start);
+  SDL_UnlockMutex(is->convert_mutex);
+
+  ret = convert_band(&is->sws_ctx, src, dst, 0, is->convert_bands[0].h);
+
+  SDL_LockMutex(is->convert_mutex);
+  while(is->convert_pending > 0 && !is->quit) {
+    SDL_CondWait(is->convert_done, is->convert_mutex);
+  }
+  SDL_UnlockMutex(is->convert_mutex);
+  return ret;
+}
+
+/* Helper for one band: wait for a picture, convert its band if the
+   picture was split that far, report back. */
+int convert_band_thread(void *arg) {
+
+  ConvertBand *band = (ConvertBand *)arg;
+  VideoState *is = band->is;
+  int generation = 0;
+  int active;
+  int64_t start;
+
+  trace_thread_name("convert");
+  for(;;) {
+    SDL_LockMutex(is->convert_mutex);
+    while(is->convert_generation == generation && !is->quit) {
+      SDL_CondWait(is->convert_start, is->convert_mutex);
+    }
+    generation = is->convert_generation;
+    active = band->index < is->convert_nb_bands;
+    SDL_UnlockMutex(is->convert_mutex);
+    if(is->quit) {
+      break;
+    }
+    if(!active) {
+      continue;
+    }
+
+    start = av_gettime();
+    if(convert_band(&band->sws_ctx, is->convert_src, is->convert_dst,
+		    band->y, band->h) < 0) {
+      fprintf(stderr, "Could not convert band %d\n", band->index);
+    }
+    band->busy_time += av_gettime() - start;
+    bench_cpu_mark(is, &band->cpu_time);
+
+    SDL_LockMutex(is->convert_mutex);
+    if(--is->convert_pending == 0) {
+      SDL_CondSignal(is->convert_done);
+    }
+    SDL_UnlockMutex(is->convert_mutex);
+  }
+  return 0;
+}
+
+/* Start the convert_threads - 1 helpers for split conversions. */
+int convert_bands_init(VideoState *is) {
+
+  ConvertBand *band;
+  int i;
+
+  is->convert_mutex = SDL_CreateMutex();
+  is->convert_start = SDL_CreateCond();
+  is->convert_done = SDL_CreateCond();
+  for(i = 0; i < is->convert_threads; i++) {
+    band = &is->convert_bands[i];
+    band->is = is;
+    band->index = i;
+    if(i > 0) {
+      band->tid = SDL_CreateThread(convert_band_thread, "Convert Band", band);
+      if(!band->tid) {
+	return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Put the picture on the texture. This is the only place a picture gets
+   converted, so pictures skipped for sync never are; YUV420P needs no
+   conversion at all. */
+int picture_upload(VideoState *is, VideoPicture *vp) {
+
+  AVFrame *yuv = vp->frame;
+  int64_t start;
+
+  if(yuv->format != AV_PIX_FMT_YUV420P && yuv->format != AV_PIX_FMT_YUVJ420P) {
+    start = av_gettime();
+    if(!is->display_frame ||
+       is->display_frame->width != vp->width ||
+       is->display_frame->height != vp->height) {
+      if(display_frame_alloc(is, vp->width, vp->height) < 0) {
+	fprintf(stderr, "Could not allocate picture\n");
+	return -1;
+      }
+    }
+    // Convert the image into YUV format that SDL uses
+    if(convert_picture(is, vp->frame, is->display_frame) < 0) {
+      fprintf(stderr, "Could not convert picture\n");
+      return -1;
+    }
+    is->convert_time += av_gettime() - start;
+    is->pictures_converted++;
+    yuv = is->display_frame;
+  }
+  if(is->bench) {
+    /* converted like it would be for the screen; that's all */
+    return 0;
+  }
+  SDL_UpdateYUVTexture(is->texture, NULL,
+		       yuv->data[0], yuv->linesize[0],
+		       yuv->data[1], yuv->linesize[1],
+		       yuv->data[2], yuv->linesize[2]);
+  return 0;
 }
 
 void video_display(VideoState *is) {
 
   SDL_Rect rect;
   VideoPicture *vp;
-  //AVPicture pict;
   float aspect_ratio;
   int w, h, x, y;
-  //int i;
+  int screen_w, screen_h, tex_w, tex_h;
 
   vp = &is->pictq[is->pictq_rindex];
-  if(vp->bmp) {
+  if(vp->frame->data[0] && is->bench) {
+    if(picture_upload(is, vp) == 0) {
+      is->pictures_shown++;
+    }
+  } else if(vp->frame->data[0]) {
+    /* textures belong to the main thread; (re)create ours on a size change */
+    if(!is->texture ||
+       SDL_QueryTexture(is->texture, NULL, NULL, &tex_w, &tex_h) < 0 ||
+       tex_w != vp->width || tex_h != vp->height) {
+      if(is->texture) {
+	SDL_DestroyTexture(is->texture);
+      }
+      is->texture = SDL_CreateTexture(is->renderer, SDL_PIXELFORMAT_IYUV,
+				      SDL_TEXTUREACCESS_STREAMING,
+				      vp->width, vp->height);
+      if(!is->texture) {
+	fprintf(stderr, "SDL: could not create SDL texture - %s\n", SDL_GetError());
+	return;
+      }
+    }
     if(is->video_st->codec->sample_aspect_ratio.num == 0) {
       aspect_ratio = 0;
     } else {
@@ -525,23 +1287,89 @@ void video_display(VideoState *is) {
       aspect_ratio = (float)is->video_st->codec->width /
 	(float)is->video_st->codec->height;
     }
-    h = screen->h;
+    SDL_GetWindowSize(screen, &screen_w, &screen_h);
+    h = screen_h;
     w = ((int)rint(h * aspect_ratio)) & -3;
-    if(w > screen->w) {
-      w = screen->w;
+    if(w > screen_w) {
+      w = screen_w;
       h = ((int)rint(w / aspect_ratio)) & -3;
     }
-    x = (screen->w - w) / 2;
-    y = (screen->h - h) / 2;
+    x = (screen_w - w) / 2;
+    y = (screen_h - h) / 2;
 
     rect.x = x;
     rect.y = y;
     rect.w = w;
     rect.h = h;
-    SDL_DisplayYUVOverlay(vp->bmp, &rect);
+    if(picture_upload(is, vp) < 0) {
+      return;
+    }
+    is->pictures_shown++;
+    SDL_RenderClear(is->renderer);
+    SDL_RenderCopy(is->renderer, is->texture, NULL, &rect);
+    SDL_RenderPresent(is->renderer);
   }
 }
 
+/* Hand the slot at the read index back to the decoder, along with the
+   frame it was holding. */
+void pictq_next(VideoState *is) {
+
+  VideoPicture *vp = &is->pictq[is->pictq_rindex];
+
+  queue_stats_get(&is->pictq_stats, vp->queued_time);
+  av_frame_unref(vp->frame);
+  if(++is->pictq_rindex == is->pictq_capacity) {
+    is->pictq_rindex = 0;
+  }
+  SDL_LockMutex(is->pictq_mutex);
+  is->pictq_size--;
+  is->pictq_bytes -= vp->bytes;
+  is->pictq_duration -= vp->duration;
+  SDL_CondSignal(is->pictq_cond);
+  SDL_UnlockMutex(is->pictq_mutex);
+}
+
+/* Every queue's statistics as one JSON object. Called from the main
+   thread while the others are running, so the numbers of a queue may
+   be a moment apart from each other. */
+void dump_queue_stats(VideoState *is, FILE *f) {
+  fprintf(f, "{\n");
+  queue_stats_json(f, "audioq", &is->audioq.stats, packet_queue_nb_packets(&is->audioq),
+		   packet_queue_size(&is->audioq), SDL_AtomicGet(&is->audioq.duration));
+  fprintf(f, ",\n");
+  queue_stats_json(f, "videoq", &is->videoq.stats, packet_queue_nb_packets(&is->videoq),
+		   packet_queue_size(&is->videoq), SDL_AtomicGet(&is->videoq.duration));
+  fprintf(f, ",\n");
+  queue_stats_json(f, "pictq", &is->pictq_stats, is->pictq_size,
+		   is->pictq_bytes, is->pictq_duration);
+  fprintf(f, "\n}\n");
+}
+
+/* Show the picture at the read index and move on from it */
+void show_picture(VideoState *is) {
+
+  VideoPicture *vp = &is->pictq[is->pictq_rindex];
+  int64_t start;
+
+  start = trace_begin();
+  video_display(is);
+  trace_end("video_display", start);
+  if(vp->demux_time != AV_NOPTS_VALUE) {
+    queue_stats_get(&is->pipeline_stats, vp->demux_time);
+  }
+
+  /* update queue for next picture! */
+  pictq_next(is);
+}
+
+/* -bench is over once the demuxer has reached the end, both decoders have
+   given out everything and the sinks have taken all of it */
+int bench_finished(VideoState *is) {
+  return is->demux_eof && is->video_drained && is->audio_drained &&
+    is->pictq_size == 0 && pcm_ring_fill(&is->audio_ring) == 0;
+}
+
 void video_refresh_timer(void *userdata) {
 
   VideoState *is = (VideoState *)userdata;
@@ -549,14 +1377,49 @@ void video_refresh_timer(void *userdata) {
   double actual_delay, delay, sync_threshold, ref_clock, diff;
 
   if(is->video_st) {
+  retry:
     if(is->pictq_size == 0) {
+      if(!is->pictq_empty_since) {
+	is->pictq_empty_since = av_gettime();
+	is->pictq_stats.consumer_waits++;
+      }
+      if(is->bench && bench_finished(is)) {
+	SDL_Event event;
+	event.type = FF_QUIT_EVENT;
+	event.user.data1 = is;
+	SDL_PushEvent(&event);
+	return;
+      }
       schedule_refresh(is, 1);
     } else {
+      if(is->pictq_empty_since) {
+	is->pictq_stats.consumer_wait_time += av_gettime() - is->pictq_empty_since;
+	is->pictq_empty_since = 0;
+      }
       vp = &is->pictq[is->pictq_rindex];
+      if(vp->serial != packet_queue_serial(&is->videoq)) {
+	/* decoded before a seek */
+	pictq_next(is);
+	goto retry;
+      }
+      if(vp->serial != is->frame_serial) {
+	/* first picture after a seek: time it from now, not from the
+	   pictures before the jump */
+	is->frame_serial = vp->serial;
+	is->frame_timer = av_gettime() / 1000000.0;
+	is->frame_last_pts = vp->pts;
+      }
 
       is->video_current_pts = vp->pts;
       is->video_current_pts_time = av_gettime();
 
+      if(is->bench == BENCH_UNTHROTTLED) {
+	/* no clock to keep to: show it and go on to the next one */
+	schedule_refresh(is, 0);
+	show_picture(is);
+	return;
+      }
+
       delay = vp->pts - is->frame_last_pts; /* the pts from last time */
       if(delay <= 0 || delay >= 1.0) {
 	/* if incorrect delay, use previous one */
@@ -586,65 +1449,59 @@ void video_refresh_timer(void *userdata) {
       is->frame_timer += delay;
       /* computer the REAL delay */
       actual_delay = is->frame_timer - (av_gettime() / 1000000.0);
+      /* more than a frame behind and a newer picture is already
+	 waiting: skip this one instead of showing it late */
+      if(is->framedrop && is->pictq_size > 1 &&
+	 actual_delay < -is->frame_last_delay) {
+	is->frames_dropped_late++;
+	pictq_next(is);
+	goto retry;
+      }
       if(actual_delay < 0.010) {
-	/* Really it should skip the picture instead */
 	actual_delay = 0.010;
       }
       schedule_refresh(is, (int)(actual_delay * 1000 + 0.5));
 
       /* show the picture! */
-      video_display(is);
-
-      /* update queue for next picture! */
-      if(++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE) {
-	is->pictq_rindex = 0;
-      }
-      SDL_LockMutex(is->pictq_mutex);
-      is->pictq_size--;
-      SDL_CondSignal(is->pictq_cond);
-      SDL_UnlockMutex(is->pictq_mutex);
+      show_picture(is);
     }
   } else {
     schedule_refresh(is, 100);
   }
 }
 
-void alloc_picture(void *userdata) {
-
-  VideoState *is = (VideoState *)userdata;
-  VideoPicture *vp;
-
-  vp = &is->pictq[is->pictq_windex];
-  if(vp->bmp) {
-    // we already have one make another, bigger/smaller
-    SDL_FreeYUVOverlay(vp->bmp);
-  }
-  // Allocate a place to put our YUV image on that screen
-  vp->bmp = SDL_CreateYUVOverlay(is->video_st->codec->width,
-				 is->video_st->codec->height,
-				 SDL_YV12_OVERLAY,
-				 screen);
-  vp->width = is->video_st->codec->width;
-  vp->height = is->video_st->codec->height;
+/* Give every slot of the picture queue its AVFrame up front so that
+   queue_picture only ever takes a reference. */
+int picture_pool_alloc(VideoState *is) {
 
-  SDL_LockMutex(is->pictq_mutex);
-  vp->allocated = 1;
-  SDL_CondSignal(is->pictq_cond);
-  SDL_UnlockMutex(is->pictq_mutex);
+  int i;
 
+  for(i = 0; i < is->pictq_capacity; i++) {
+    is->pictq[i].frame = av_frame_alloc();
+    if(!is->pictq[i].frame) {
+      fprintf(stderr, "Could not allocate picture %d of the pool\n", i);
+      return -1;
+    }
+  }
+  return 0;
 }
 
-int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
+int queue_picture(VideoState *is, AVFrame *pFrame, double pts, int serial) {
 
   VideoPicture *vp;
-  //int dst_pix_fmt;
-  AVPicture pict;
+  int64_t wait_start;
+  int i;
 
   /* wait until we have space for a new pic */
   SDL_LockMutex(is->pictq_mutex);
-  while(is->pictq_size >= VIDEO_PICTURE_QUEUE_SIZE &&
-	!is->quit) {
-    SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+  if(is->pictq_size >= is->pictq_capacity) {
+    wait_start = av_gettime();
+    is->pictq_stats.producer_waits++;
+    while(is->pictq_size >= is->pictq_capacity &&
+	  !is->quit) {
+      SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+    }
+    is->pictq_stats.producer_wait_time += av_gettime() - wait_start;
   }
   SDL_UnlockMutex(is->pictq_mutex);
 
@@ -654,71 +1511,36 @@ int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
   // windex is set to 0 initially
   vp = &is->pictq[is->pictq_windex];
 
-  /* allocate or resize the buffer! */
-  if(!vp->bmp ||
-     vp->width != is->video_st->codec->width ||
-     vp->height != is->video_st->codec->height) {
-    SDL_Event event;
-
-    vp->allocated = 0;
-    /* we have to do it in the main thread */
-    event.type = FF_ALLOC_EVENT;
-    event.user.data1 = is;
-    SDL_PushEvent(&event);
-
-    /* wait until we have a picture allocated */
-    SDL_LockMutex(is->pictq_mutex);
-    while(!vp->allocated && !is->quit) {
-      SDL_CondWait(is->pictq_cond, is->pictq_mutex);
-    }
-    SDL_UnlockMutex(is->pictq_mutex);
-    if(is->quit) {
-      return -1;
-    }
+  /* keep the decoded frame as it is; video_display converts it if and
+     when it gets shown */
+  if(av_frame_ref(vp->frame, pFrame) < 0) {
+    fprintf(stderr, "Could not reference picture\n");
+    return -1;
   }
-  /* We have a place to put our picture on the queue */
-  /* If we are skipping a frame, do we set this to null
-     but still return vp->allocated = 1? */
-
-
-  if(vp->bmp) {
-
-    SDL_LockYUVOverlay(vp->bmp);
-
-    //dst_pix_fmt = PIX_FMT_YUV420P;
-    /* point pict at the queue */
-
-    pict.data[0] = vp->bmp->pixels[0];
-    pict.data[1] = vp->bmp->pixels[2];
-    pict.data[2] = vp->bmp->pixels[1];
-
-    pict.linesize[0] = vp->bmp->pitches[0];
-    pict.linesize[1] = vp->bmp->pitches[2];
-    pict.linesize[2] = vp->bmp->pitches[1];
-
-    // Convert the image into YUV format that SDL uses
-    sws_scale
-    (
-        is->sws_ctx,
-        (uint8_t const * const *)pFrame->data,
-        pFrame->linesize,
-        0,
-        is->video_st->codec->height,
-        pict.data,
-        pict.linesize
-    );
-
-    SDL_UnlockYUVOverlay(vp->bmp);
-    vp->pts = pts;
-
-    /* now we inform our display thread that we have a pic ready */
-    if(++is->pictq_windex == VIDEO_PICTURE_QUEUE_SIZE) {
-      is->pictq_windex = 0;
-    }
-    SDL_LockMutex(is->pictq_mutex);
-    is->pictq_size++;
-    SDL_UnlockMutex(is->pictq_mutex);
+  vp->width = pFrame->width;
+  vp->height = pFrame->height;
+  vp->pts = pts;
+  vp->serial = serial;
+  vp->bytes = 0;
+  for(i = 0; i < AV_NUM_DATA_POINTERS && pFrame->buf[i]; i++) {
+    vp->bytes += pFrame->buf[i]->size;
   }
+  vp->duration = av_rescale_q(pFrame->pkt_duration, is->video_st->time_base,
+			      AV_TIME_BASE_Q);
+  vp->queued_time = av_gettime();
+  vp->demux_time = pFrame->reordered_opaque;
+
+  /* now we inform our display thread that we have a pic ready */
+  if(++is->pictq_windex == is->pictq_capacity) {
+    is->pictq_windex = 0;
+  }
+  SDL_LockMutex(is->pictq_mutex);
+  is->pictq_size++;
+  is->pictq_bytes += vp->bytes;
+  is->pictq_duration += vp->duration;
+  queue_stats_put(&is->pictq_stats, is->pictq_size, is->pictq_bytes,
+		  is->pictq_duration);
+  SDL_UnlockMutex(is->pictq_mutex);
   return 0;
 }
 
@@ -741,69 +1563,99 @@ double synchronize_video(VideoState *is, AVFrame *src_frame, double pts) {
   return pts;
 }
 
-uint64_t global_video_pkt_pts = AV_NOPTS_VALUE;
-
-/* These are called whenever we allocate a frame
- * buffer. We use this to store the global_pts in
- * a frame at the time it is allocated.
- */
-int our_get_buffer(struct AVCodecContext *c, AVFrame *pic) {
-  int ret = avcodec_default_get_buffer(c, pic);
-  uint64_t *pts = av_malloc(sizeof(uint64_t));
-  *pts = global_video_pkt_pts;
-  pic->opaque = pts;
-  return ret;
-}
-void our_release_buffer(struct AVCodecContext *c, AVFrame *pic) {
-  if(pic) av_freep(&pic->opaque);
-  avcodec_default_release_buffer(c, pic);
+/* A frame whose pts is already more than a frame behind the clock
+   can only be shown late, so it is not worth converting. When video
+   is the master clock, "behind" means behind the wall clock the
+   refresh timer keeps: the frame falls due (pts - frame_last_pts)
+   after frame_timer, the time the last picture shown was due. */
+int frame_is_late(VideoState *is, double pts, int serial) {
+
+  double diff, threshold;
+
+  if(!is->framedrop || is->bench == BENCH_UNTHROTTLED) {
+    return 0;
+  }
+  if(is->av_sync_type == AV_SYNC_VIDEO_MASTER) {
+    if(serial != is->frame_serial) {
+      /* nothing shown since the seek: the timer is not set yet */
+      return 0;
+    }
+    diff = is->frame_timer + (pts - is->frame_last_pts) - (av_gettime() / 1000000.0);
+  } else {
+    diff = pts - get_master_clock(is);
+  }
+  threshold = (is->frame_last_delay > AV_SYNC_THRESHOLD) ? is->frame_last_delay : AV_SYNC_THRESHOLD;
+  return diff < -threshold && fabs(diff) < AV_NOSYNC_THRESHOLD;
 }
 
 int video_thread(void *arg) {
   VideoState *is = (VideoState *)arg;
   AVPacket pkt1, *packet = &pkt1;
-  int frameFinished;
+  AVCodecContext *codecCtx = is->video_st->codec;
   AVFrame *pFrame;
   double pts;
+  int64_t start, elapsed, wait_before, span;
+  int queued, serial, ret;
 
+  trace_thread_name("video decode");
   pFrame = av_frame_alloc();
 
   for(;;) {
-    if(packet_queue_get(&is->videoq, packet, 1) < 0) {
+    if(packet_queue_get(&is->videoq, packet, 1, &serial) < 0) {
       // means we quit getting packets
       break;
     }
-    if(packet->data == flush_pkt.data) {
-      avcodec_flush_buffers(is->video_st->codec);
-      continue;
-    }
-    pts = 0;
-
-    // Save global pts to be stored in pFrame in first call
-    global_video_pkt_pts = packet->pts;
-    // Decode video frame
-    avcodec_decode_video2(is->video_st->codec, pFrame, &frameFinished,
-				packet);
-    if(packet->dts == AV_NOPTS_VALUE
-       && pFrame->opaque && *(uint64_t*)pFrame->opaque != AV_NOPTS_VALUE) {
-      pts = *(uint64_t *)pFrame->opaque;
-    } else if(packet->dts != AV_NOPTS_VALUE) {
-      pts = packet->dts;
-    } else {
-      pts = 0;
+    start = av_gettime();
+    wait_before = is->pictq_stats.producer_wait_time;
+    queued = is->pictq_size;
+    if(serial != is->video_pkt_serial) {
+      /* first packet after a seek */
+      avcodec_flush_buffers(codecCtx);
+      is->video_pkt_serial = serial;
+      is->video_drained = 0;
     }
-    pts *= av_q2d(is->video_st->time_base);
+    /* the frames decoded from this packet carry when it was queued */
+    codecCtx->reordered_opaque = is->videoq.last_queued_time;
+    // Decode video frame; an empty packet means end of file and drains
+    // the decoder
+    span = trace_begin();
+    avcodec_send_packet(codecCtx, packet->data ? packet : NULL);
+    trace_end("decode video", span);
+    av_free_packet(packet);
+
+    // Take every frame the decoder has ready
+    while((ret = receive_frame_traced(codecCtx, pFrame, "decode video")) == 0) {
+      if(is->video_pkt_serial != packet_queue_serial(&is->videoq)) {
+	/* a seek came in meanwhile */
+	continue;
+      }
+      is->frames_decoded++;
+      /* frames come out in display order, often several packets after
+	 their own, so only the frame's timestamp can be trusted */
+      pts = pFrame->best_effort_timestamp != AV_NOPTS_VALUE ?
+	pFrame->best_effort_timestamp : 0;
+      pts *= av_q2d(is->video_st->time_base);
 
-    // Did we get a video frame?
-    if(frameFinished) {
       pts = synchronize_video(is, pFrame, pts);
-      if(queue_picture(is, pFrame, pts) < 0) {
-	break;
+      if(frame_is_late(is, pts, is->video_pkt_serial)) {
+	is->frames_dropped_early++;
+      } else if(queue_picture(is, pFrame, pts, is->video_pkt_serial) < 0) {
+	goto quit;
       }
     }
-    av_free_packet(packet);
+    if(ret == AVERROR_EOF) {
+      is->video_drained = 1;
+    }
+    /* decoding while the display still has pictures queued is overlap */
+    elapsed = av_gettime() - start - (is->pictq_stats.producer_wait_time - wait_before);
+    is->video_decode_time += elapsed;
+    if(queued > 0 && is->pictq_size > 0) {
+      is->video_overlap_time += elapsed;
+    }
+    bench_cpu_mark(is, &is->cpu_time[STAGE_VIDEO_DECODE]);
   }
-  av_free(pFrame);
+ quit:
+  av_frame_free(&pFrame);
   return 0;
 }
 int stream_component_open(VideoState *is, int stream_index) {
@@ -831,13 +1683,27 @@ int stream_component_open(VideoState *is, int stream_index) {
     wanted_spec.callback = audio_callback;
     wanted_spec.userdata = is;
 
-    if(SDL_OpenAudio(&wanted_spec, &spec) < 0) {
+    if(is->bench) {
+      /* audio_sink_thread takes the device's place */
+      is->audio_hw_buf_size = wanted_spec.samples * wanted_spec.channels * 2;
+    } else if(SDL_OpenAudio(&wanted_spec, &spec) < 0) {
       fprintf(stderr, "SDL_OpenAudio: %s\n", SDL_GetError());
       return -1;
+    } else {
+      is->audio_hw_buf_size = spec.size;
     }
-    is->audio_hw_buf_size = spec.size;
   }
   codec = avcodec_find_decoder(codecCtx->codec_id);
+  if(codecCtx->codec_type == AVMEDIA_TYPE_VIDEO) {
+    codecCtx->thread_count = decoder_thread_count;
+    codecCtx->thread_type = decoder_thread_type;
+    /* serve the decoder's frames from our own pool */
+    if(frame_pool_init(&is->frame_pool) < 0) {
+      fprintf(stderr, "Could not create the frame pool\n");
+      return -1;
+    }
+    frame_pool_attach(&is->frame_pool, codecCtx);
+  }
   if(!codec || (avcodec_open2(codecCtx, codec, &optionsDict) < 0)) {
     fprintf(stderr, "Unsupported codec!\n");
     return -1;
@@ -863,8 +1729,17 @@ int stream_component_open(VideoState *is, int stream_index) {
 	}
 
     memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
-    packet_queue_init(&is->audioq);
-    SDL_PauseAudio(0);
+    packet_queue_init(&is->audioq, is->audio_st->time_base);
+    if(pcm_ring_init(&is->audio_ring, PCM_RING_SIZE) < 0) {
+      fprintf(stderr, "Could not allocate the audio ring\n");
+      return -1;
+    }
+    is->audio_tid = SDL_CreateThread(audio_thread, "Audio Thread", is);
+    if(is->bench) {
+      is->audio_sink_tid = SDL_CreateThread(audio_sink_thread, "Audio Sink", is);
+    } else {
+      SDL_PauseAudio(0);
+    }
     break;
   case AVMEDIA_TYPE_VIDEO:
     is->videoStream = stream_index;
@@ -874,24 +1749,15 @@ int stream_component_open(VideoState *is, int stream_index) {
     is->frame_last_delay = 40e-3;
     is->video_current_pts_time = av_gettime();
 
-    packet_queue_init(&is->videoq);
-    is->video_tid = SDL_CreateThread(video_thread, is);
-    is->sws_ctx =
-        sws_getContext
-        (
-            is->video_st->codec->width,
-            is->video_st->codec->height,
-            is->video_st->codec->pix_fmt,
-            is->video_st->codec->width,
-            is->video_st->codec->height,
-            AV_PIX_FMT_YUV420P,
-            SWS_BILINEAR,
-            NULL,
-            NULL,
-            NULL
-        );
-    codecCtx->get_buffer2 = our_get_buffer;
-    codecCtx->release_buffer = our_release_buffer;
+    packet_queue_init(&is->videoq, is->video_st->time_base);
+    if(picture_pool_alloc(is) < 0) {
+      return -1;
+    }
+    if(convert_bands_init(is) < 0) {
+      fprintf(stderr, "Could not start the conversion threads\n");
+      return -1;
+    }
+    is->video_tid = SDL_CreateThread(video_thread, "Video Thread", is);
 
     break;
   default:
@@ -915,8 +1781,11 @@ int decode_thread(void *arg) {
 
   int video_index = -1;
   int audio_index = -1;
-  int i;
+  int eof = 0; /* end of file reached and the decoders told so */
+  int i, ret;
+  int64_t start;
 
+  trace_thread_name("demux");
   is->videoStream=-1;
   is->audioStream=-1;
 
@@ -968,6 +1837,7 @@ int decode_thread(void *arg) {
 
   // main decode loop
 
+  is->start_time = av_gettime();
   for(;;) {
     if(is->quit) {
       break;
@@ -988,23 +1858,43 @@ int decode_thread(void *arg) {
       } else {
 	if(is->audioStream >= 0) {
 	  packet_queue_flush(&is->audioq);
-	  packet_queue_put(&is->audioq, &flush_pkt);
 	}
 	if(is->videoStream >= 0) {
 	  packet_queue_flush(&is->videoq);
-	  packet_queue_put(&is->videoq, &flush_pkt);
 	}
+	eof = 0;
       }
       is->seek_req = 0;
     }
 
-    if(is->audioq.size > MAX_AUDIOQ_SIZE ||
-       is->videoq.size > MAX_VIDEOQ_SIZE) {
-      SDL_Delay(10);
+    /* sleep until both queues have room; the decoders wake us */
+    if(packet_queue_wait_space(&is->audioq) < 0 ||
+       packet_queue_wait_space(&is->videoq) < 0) {
+      break;
+    }
+    if(is->seek_req) {
       continue;
     }
-    if(av_read_frame(is->pFormatCtx, packet) < 0) {
+    start = trace_begin();
+    ret = av_read_frame(is->pFormatCtx, packet);
+    trace_end("demux", start);
+    bench_cpu_mark(is, &is->cpu_time[STAGE_DEMUX]);
+    if(ret < 0) {
       if(is->pFormatCtx->pb->error == 0) {
+	if(!eof) {
+	  packet_queue_put_nullpacket(&is->videoq, is->videoStream);
+	  packet_queue_put_nullpacket(&is->audioq, is->audioStream);
+	  eof = 1;
+	}
+	if(is->bench) {
+	  /* nothing to wait for with no user; the main thread quits
+	     once the rest has been played */
+	  SDL_Event event;
+	  event.type = FF_EOF_EVENT;
+	  event.user.data1 = is;
+	  SDL_PushEvent(&event);
+	  return 0;
+	}
 	SDL_Delay(100); /* no error; wait for user input */
 	continue;
       } else {
@@ -1040,41 +1930,164 @@ void stream_seek(VideoState *is, int64_t pos, int rel) {
     is->seek_pos = pos;
     is->seek_flags = rel < 0 ? AVSEEK_FLAG_BACKWARD : 0;
     is->seek_req = 1;
+    /* the demuxer may be asleep waiting for room */
+    packet_queue_abort(&is->audioq);
+    packet_queue_abort(&is->videoq);
+  }
+}
+/* "frame", "slice" or "both" as FF_THREAD_* flags, -1 if unknown */
+int parse_thread_type(const char *name) {
+  if(!strcmp(name, "frame")) {
+    return FF_THREAD_FRAME;
+  } else if(!strcmp(name, "slice")) {
+    return FF_THREAD_SLICE;
+  } else if(!strcmp(name, "both")) {
+    return FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
+  return -1;
+}
+
+/* What -bench prints at the end, on stdout */
+void bench_report(VideoState *is) {
+
+  QueueStats *s = &is->pipeline_stats;
+  double wall = (av_gettime() - is->start_time) / 1000000.0;
+  int64_t total = cpu_time_us(CLOCK_PROCESS_CPUTIME_ID);
+  int64_t rest = total, bands = 0;
+  static const double percentiles[] = { 0.5, 0.95 };
+  int i, bound;
+
+  printf("bench: %s, showed %d pictures in %.2fs, %.1f fps\n",
+	 is->bench == BENCH_REALTIME ? "real time" : "unthrottled",
+	 is->pictures_shown, wall, wall > 0 ? is->pictures_shown / wall : 0.0);
+  if(is->video_decode_time > 0) {
+    printf("bench: decode %.1f fps, %d frames in %.2fs of decoding\n",
+	   is->frames_decoded * 1000000.0 / is->video_decode_time,
+	   is->frames_decoded, is->video_decode_time / 1000000.0);
+  }
+  if(is->pictures_converted > 0 && is->convert_time > 0) {
+    printf("bench: conversion %.1f fps, %d pictures in %.2fs in %d bands\n",
+	   is->pictures_converted * 1000000.0 / is->convert_time,
+	   is->pictures_converted, is->convert_time / 1000000.0,
+	   is->convert_threads);
+  } else {
+    printf("bench: conversion not needed, the pictures were YUV420P\n");
+  }
+  if(s->gets > 0) {
+    printf("bench: demux to display latency mean %.1f ms, max %.1f ms",
+	   s->total_latency / 1000.0 / s->gets, s->max_latency / 1000.0);
+    for(i = 0; i < (int)(sizeof(percentiles) / sizeof(percentiles[0])); i++) {
+      bound = queue_stats_percentile(s, percentiles[i]);
+      if(bound > 0) {
+	printf(", p%d under %d ms", (int)(percentiles[i] * 100), bound);
+      } else {
+	printf(", p%d over %d ms", (int)(percentiles[i] * 100),
+	       1 << (LATENCY_BUCKETS - 2));
+      }
+    }
+    printf("\n");
+  }
+  printf("bench: cpu");
+  for(i = 0; i < NB_STAGES; i++) {
+    printf("%s %s %.2fs", i ? "," : "", stage_names[i], is->cpu_time[i] / 1000000.0);
+    rest -= is->cpu_time[i];
+  }
+  for(i = 1; i < is->convert_threads; i++) {
+    bands += is->convert_bands[i].cpu_time;
   }
+  rest -= bands;
+  /* the decoders' own threads among the rest */
+  printf(", convert bands %.2fs, the rest %.2fs, total %.2fs\n",
+	 bands / 1000000.0, rest / 1000000.0, total / 1000000.0);
+  printf("bench: dropped %d frames, %d audio underruns\n",
+	 is->frames_dropped_early + is->frames_dropped_late,
+	 SDL_AtomicGet(&is->audio_ring.underruns));
 }
+
 int main(int argc, char *argv[]) {
 //int main(void) {
 
   SDL_Event       event;
   //double          pts;
   VideoState      *is;
+  const char      *filename = NULL;
+  const char      *trace_file = NULL;
+  Uint32          sdl_flags;
+  int             i;
 
   is = av_mallocz(sizeof(VideoState));
-
-  if(argc < 2) {
-    fprintf(stderr, "Usage: test <file>\n");
+  is->pictq_capacity = VIDEO_PICTURE_QUEUE_SIZE;
+  is->framedrop = 1;
+  is->convert_threads = 1;
+
+  for(i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "-pictq") && i + 1 < argc) {
+      is->pictq_capacity = atoi(argv[++i]);
+    } else if(!strcmp(argv[i], "-noframedrop")) {
+      is->framedrop = 0;
+    } else if(!strcmp(argv[i], "-threads") && i + 1 < argc) {
+      decoder_thread_count = atoi(argv[++i]);
+    } else if(!strcmp(argv[i], "-thread_type") && i + 1 < argc) {
+      decoder_thread_type = parse_thread_type(argv[++i]);
+    } else if(!strcmp(argv[i], "-convert_threads") && i + 1 < argc) {
+      is->convert_threads = atoi(argv[++i]);
+    } else if(!strcmp(argv[i], "-stats") && i + 1 < argc) {
+      is->stats_file = argv[++i];
+    } else if(!strcmp(argv[i], "-trace") && i + 1 < argc) {
+      trace_file = argv[++i];
+    } else if(!strcmp(argv[i], "-bench")) {
+      is->bench = BENCH_UNTHROTTLED;
+    } else if(!strcmp(argv[i], "-bench_realtime")) {
+      is->bench = BENCH_REALTIME;
+    } else {
+      filename = argv[i];
+    }
+  }
+  /* 0 conversion threads means one per core */
+  if(is->convert_threads == 0) {
+    is->convert_threads = FFMIN(av_cpu_count(), MAX_CONVERT_THREADS);
+  }
+  if(!filename ||
+     is->pictq_capacity < 1 || is->pictq_capacity > MAX_PICTURE_QUEUE_SIZE ||
+     decoder_thread_count < 0 || decoder_thread_type < 0 ||
+     is->convert_threads < 1 || is->convert_threads > MAX_CONVERT_THREADS) {
+    fprintf(stderr, "Usage: test [-pictq 1..%d] [-noframedrop] [-threads N] [-thread_type frame|slice|both] [-convert_threads 0..%d] [-stats file.json] [-trace file.json] [-bench|-bench_realtime] <file>\n", MAX_PICTURE_QUEUE_SIZE, MAX_CONVERT_THREADS);
     exit(1);
   }
+  is->pictq = av_mallocz(is->pictq_capacity * sizeof(VideoPicture));
   // Register all formats and codecs
   av_register_all();
 
-  if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER)) {
+  /* -bench only needs SDL's events and timers, so it runs without a
+     display or sound card, with the dummy drivers as well */
+  sdl_flags = is->bench ? SDL_INIT_EVENTS | SDL_INIT_TIMER :
+    SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER;
+  if(SDL_Init(sdl_flags)) {
     fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
     exit(1);
   }
 
-  // Make a screen to put our video
-#ifndef __DARWIN__
-  screen = SDL_SetVideoMode(640, 480, 0, 0);
-#else
-  screen = SDL_SetVideoMode(640, 480, 24, 0);
-#endif
-  if(!screen) {
-    fprintf(stderr, "SDL: could not set video mode - exiting\n");
-    exit(1);
+  if(!is->bench) {
+    // Make a screen to put our video
+    screen = SDL_CreateWindow("tutorial07", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 640, 480, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
+    if(!screen) {
+      fprintf(stderr, "SDL: could not create SDL window - %s exiting\n", SDL_GetError());
+      exit(1);
+    }
+    is->renderer = SDL_CreateRenderer(screen, -1, 0);
+    if(!is->renderer) {
+      fprintf(stderr, "SDL: could not create SDL renderer - %s exiting\n", SDL_GetError());
+      exit(1);
+    }
   }
 
-  av_strlcpy(is->filename, argv[1], 1024);
+  av_strlcpy(is->filename, filename, 1024);
+
+  if(trace_file && trace_start(trace_file) < 0) {
+    fprintf(stderr, "Could not start tracing\n");
+    exit(1);
+  }
+  trace_thread_name("main");
 
   is->pictq_mutex = SDL_CreateMutex();
   is->pictq_cond = SDL_CreateCond();
@@ -1082,15 +2095,12 @@ int main(int argc, char *argv[]) {
   schedule_refresh(is, 40);
 
   is->av_sync_type = DEFAULT_AV_SYNC_TYPE;
-  is->parse_tid = SDL_CreateThread(decode_thread, is);
+  is->parse_tid = SDL_CreateThread(decode_thread, "Decode Thread", is);
   if(!is->parse_tid) {
     av_free(is);
     return -1;
   }
 
-  av_init_packet(&flush_pkt);
-  flush_pkt.data = (unsigned char *)"FLUSH";
-
   for(;;) {
     double incr, pos;
     SDL_WaitEvent(&event);
@@ -1116,6 +2126,10 @@ int main(int argc, char *argv[]) {
 	  stream_seek(global_video_state, (int64_t)(pos * AV_TIME_BASE), incr);
 	}
 	break;
+      case SDLK_s:
+	/* the queues as they are now */
+	dump_queue_stats(is, stderr);
+	break;
       default:
 	break;
       }
@@ -1128,16 +2142,66 @@ int main(int argc, char *argv[]) {
        * audio queues are waiting for more data.  Make them stop
        * waiting and terminate normally.
        */
-      SDL_CondSignal(is->audioq.cond);
-      SDL_CondSignal(is->videoq.cond);
+      packet_queue_abort(&is->audioq);
+      packet_queue_abort(&is->videoq);
+      pcm_ring_abort(&is->audio_ring);
+      if(is->bench) {
+	bench_report(is);
+      }
+      if(is->video_decode_time > 0) {
+	fprintf(stderr, "video: %d picture slots, decode %.2fs, %.1f%% of it overlapping display, %.2fs waiting for a free slot\n",
+		is->pictq_capacity, is->video_decode_time / 1000000.0,
+		100.0 * is->video_overlap_time / is->video_decode_time,
+		is->pictq_stats.producer_wait_time / 1000000.0);
+      }
+      if(is->pictures_shown > 0) {
+	int64_t helper_time = 0;
+	for(i = 1; i < is->convert_threads; i++) {
+	  helper_time += is->convert_bands[i].busy_time;
+	}
+	fprintf(stderr, "video: showed %d pictures, converted %d of them in %.2fs (+%.2fs in %d band threads)\n",
+		is->pictures_shown, is->pictures_converted,
+		is->convert_time / 1000000.0, helper_time / 1000000.0,
+		is->convert_threads - 1);
+      }
+      fprintf(stderr, "video: %d decoder buffers, %d frame-sized allocations, %d of them after the first %d frames\n",
+		is->frame_pool.frames, is->frame_pool.allocs,
+		is->frame_pool.steady_allocs, FRAME_POOL_WARMUP);
+      fprintf(stderr, "video: dropped %d frames before conversion, %d from the picture queue\n",
+	      is->frames_dropped_early, is->frames_dropped_late);
+      fprintf(stderr, "packets: %" PRId64 " payload bytes copied into the queues for %.1fs of media\n",
+	      is->audioq.copied_bytes + is->videoq.copied_bytes,
+	      FFMAX(is->audioq.put_duration, is->videoq.put_duration) / (double)AV_TIME_BASE);
+      if(is->audio_st) {
+	fprintf(stderr, "audio: %d underruns, %d bytes of silence, ring fill %d/%d (lowest %d)\n",
+		SDL_AtomicGet(&is->audio_ring.underruns),
+		SDL_AtomicGet(&is->audio_ring.silence_bytes),
+		pcm_ring_fill(&is->audio_ring), is->audio_ring.capacity,
+		SDL_AtomicGet(&is->audio_ring.fill_low));
+      }
+      if(is->stats_file) {
+	FILE *f = fopen(is->stats_file, "w");
+	if(f) {
+	  dump_queue_stats(is, f);
+	  fclose(f);
+	} else {
+	  fprintf(stderr, "Could not open %s\n", is->stats_file);
+	}
+      } else {
+	dump_queue_stats(is, stderr);
+      }
+      if(trace_save() < 0) {
+	fprintf(stderr, "Could not write %s\n", trace_file);
+      }
       SDL_Quit();
       exit(0);
       break;
-    case FF_ALLOC_EVENT:
-      alloc_picture(event.user.data1);
-      break;
     case FF_REFRESH_EVENT:
       video_refresh_timer(event.user.data1);
+      bench_cpu_mark(is, &is->cpu_time[STAGE_DISPLAY]);
+      break;
+    case FF_EOF_EVENT:
+      is->demux_eof = 1;
       break;
     default:
       break;